@@ -0,0 +1,347 @@
+#include "rpc.h"
+#include "hist.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 6000
+#define DEFAULT_THREADS 4
+#define DEFAULT_INFLIGHT 16
+#define DEFAULT_SECONDS 2.0
+#define DEFAULT_SIZES "0,16,256,4096,65536,100000"
+#define MAX_SIZES 32
+
+rpc_data *echo(rpc_data *);
+
+/* Settings of one benchmark run */
+typedef struct {
+    char *addr;                     // server address
+    int port;                       // server port
+    int threads;                    // client threads, each with its own client unless pool is set
+    int pool;                       // connections of one client shared by every thread, 0 for none
+    int inflight;                   // calls each thread keeps in flight
+    double seconds;                 // measured time per payload size
+    double warmup;                  // unmeasured time per payload size
+    size_t size;                    // data2 length of every call
+} bench_config;
+
+/* Per-thread results */
+typedef struct {
+    pthread_t thread;
+    const bench_config *config;
+    rpc_client *client;             // client of this thread
+    rpc_handle *handle;             // handle of echo
+    hist latency;                   // call latency in nanoseconds
+    uint64_t calls;                 // measured calls completed
+    uint64_t errors;                // calls that failed or came back wrong
+} bench_thread;
+
+/* Monotonic time in nanoseconds */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Runs an in-process server until the benchmark exits */
+void *serve(void *arg) {
+    rpc_serve_all((rpc_server *) arg);
+    return NULL;
+}
+
+/* Keeps config->inflight calls going on one connection: as soon as the
+ * oldest call completes, its slot starts a new one */
+void *drive(void *arg) {
+    bench_thread *bt = (bench_thread *) arg;
+    const bench_config *config = bt->config;
+    int inflight = config->inflight;
+    rpc_future **futures = calloc(inflight, sizeof(rpc_future *));
+    uint64_t *started = calloc(inflight, sizeof(uint64_t));
+    char *payload = malloc(config->size == 0 ? 1 : config->size);
+    if (futures == NULL || started == NULL || payload == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memset(payload, 'x', config->size);
+    rpc_data request = {.data1 = 0, .data2_len = config->size,
+                        .data2 = config->size == 0 ? NULL : payload};
+
+    uint64_t begin = now_ns();
+    uint64_t measure_from = begin + (uint64_t) (config->warmup * 1e9);
+    uint64_t end = measure_from + (uint64_t) (config->seconds * 1e9);
+    for (int i = 0; i < inflight; i++) {
+        request.data1 = i;
+        started[i] = now_ns();
+        futures[i] = rpc_call_async(bt->client, bt->handle, &request);
+    }
+
+    /* A slot whose started time is 0 is retired */
+    int live = inflight;
+    for (int slot = 0; live > 0; slot = (slot + 1) % inflight) {
+        if (started[slot] == 0) {
+            continue;
+        }
+        rpc_data *response = rpc_wait(futures[slot]);
+        uint64_t done = now_ns();
+        if (started[slot] >= measure_from && done <= end) {
+            if (response == NULL || response->data2_len != config->size) {
+                bt->errors++;
+            } else {
+                bt->calls++;
+                hist_record(&bt->latency, done - started[slot]);
+            }
+        }
+        rpc_data_free(response);
+
+        /* Refill the slot until time is up */
+        if (done >= end) {
+            started[slot] = 0;
+            live--;
+            continue;
+        }
+        request.data1 = slot;
+        started[slot] = now_ns();
+        futures[slot] = rpc_call_async(bt->client, bt->handle, &request);
+    }
+
+    free(futures);
+    free(started);
+    free(payload);
+    return NULL;
+}
+
+/* Prints one histogram as [highest value, count] pairs of its non-empty
+ * buckets */
+void print_histogram(const hist *h) {
+    int first = 1;
+    printf("[");
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        if (h->counts[i] == 0) {
+            continue;
+        }
+        printf("%s[%llu,%llu]", first ? "" : ",", (unsigned long long) hist_bucket_max(i),
+               (unsigned long long) h->counts[i]);
+        first = 0;
+    }
+    printf("]");
+}
+
+/* Runs every client thread for one payload size and prints its JSON
+ * result */
+void run_size(bench_config *config, bench_thread *threads, int first) {
+    size_t allocs = rpc_alloc_count();
+    size_t syscalls = rpc_syscall_count();
+    size_t wire = rpc_wire_bytes();
+    for (int i = 0; i < config->threads; i++) {
+        threads[i].config = config;
+        threads[i].calls = 0;
+        threads[i].errors = 0;
+        hist_init(&threads[i].latency);
+        if (pthread_create(&threads[i].thread, NULL, drive, &threads[i]) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    hist *latency = malloc(sizeof(hist));
+    if (latency == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    hist_init(latency);
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    for (int i = 0; i < config->threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        hist_merge(latency, &threads[i].latency);
+        calls += threads[i].calls;
+        errors += threads[i].errors;
+    }
+    allocs = rpc_alloc_count() - allocs;
+    syscalls = rpc_syscall_count() - syscalls;
+    wire = rpc_wire_bytes() - wire;
+
+    double rate = calls / config->seconds;
+    printf("%s\n    {\"size\":%zu,\"calls\":%llu,\"errors\":%llu,\"calls_per_sec\":%.1f,"
+           "\"mb_per_sec\":%.3f,\"allocs_per_call\":%.4f,\"syscalls_per_call\":%.4f,"
+           "\"wire_bytes_per_call\":%.1f,\n",
+           first ? "" : ",", config->size, (unsigned long long) calls, (unsigned long long) errors, rate,
+           rate * config->size * 2 / 1e6, calls == 0 ? 0.0 : (double) allocs / calls,
+           calls == 0 ? 0.0 : (double) syscalls / calls, calls == 0 ? 0.0 : (double) wire / calls);
+    printf("     \"latency_ns\":{\"min\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,"
+           "\"p99\":%llu,\"p999\":%llu,\"max\":%llu},\n",
+           (unsigned long long) (latency->total == 0 ? 0 : latency->min),
+           latency->total == 0 ? 0.0 : (double) latency->sum / latency->total,
+           (unsigned long long) hist_percentile(latency, 0.5),
+           (unsigned long long) hist_percentile(latency, 0.9),
+           (unsigned long long) hist_percentile(latency, 0.99),
+           (unsigned long long) hist_percentile(latency, 0.999),
+           (unsigned long long) latency->max);
+    printf("     \"histogram\":");
+    print_histogram(latency);
+    printf("}");
+    fflush(stdout);
+    free(latency);
+}
+
+/* Prints the options and exits with status */
+void usage(FILE *out, int status) {
+    fprintf(out, "Usage: rpc-bench [-i addr] [-p port] [-t threads] [-c inflight]\n"
+                 "                 [-d seconds] [-s size,size,...] [-w workers] [-b usec]\n"
+                 "                 [-P conns] [-l loops] [-u 0|1] [-T socket|shm]\n");
+    exit(status);
+}
+
+/* Load generator: N client threads each keep M calls in flight against an
+ * echo function, for every payload size in turn, and the results are
+ * printed as JSON.
+ * Usage: rpc-bench [-i addr] [-p port] [-t threads] [-c inflight]
+ *                  [-d seconds] [-s size,size,...] [-w workers] [-b usec]
+ *                  [-P conns] [-l loops] [-u 0|1] [-T socket|shm]
+ * Without -i the server runs in this process on the loopback address, with
+ * -l event loops (0 for one per CPU) and on io_uring with -u 1.
+ * syscalls_per_call and wire_bytes_per_call, both ways, count the
+ * in-process server only. With -P every thread shares one client pooling
+ * up to conns connections.
+ * -T picks how clients reach a server on this host: socket, the default,
+ * over the loopback socket, or shm through shared memory, with -b setting
+ * how long its waits spin before sleeping.
+ * -h prints the usage, and an unknown option or one missing its value
+ * prints it and fails */
+int main(int argc, char *argv[]) {
+    bench_config config = {.addr = NULL, .port = DEFAULT_PORT, .threads = DEFAULT_THREADS,
+                           .inflight = DEFAULT_INFLIGHT, .seconds = DEFAULT_SECONDS};
+    char *sizes_arg = DEFAULT_SIZES;
+    int workers = -1;
+    int loops = 1;
+    char *transport = "socket";
+
+    for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage(stdout, EXIT_SUCCESS);
+        } else if (i + 1 == argc) {
+            fprintf(stderr, "Missing value of %s\n", argv[i]);
+            usage(stderr, EXIT_FAILURE);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            config.addr = argv[i + 1];
+        } else if (strcmp(argv[i], "-p") == 0) {
+            config.port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            config.threads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            config.inflight = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            config.seconds = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            sizes_arg = argv[i + 1];
+        } else if (strcmp(argv[i], "-w") == 0) {
+            workers = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            rpc_shm_busy_poll(atoi(argv[i + 1]));
+        } else if (strcmp(argv[i], "-P") == 0) {
+            config.pool = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            loops = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            setenv("RPC_URING", argv[i + 1], 1);
+        } else if (strcmp(argv[i], "-T") == 0) {
+            transport = argv[i + 1];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            usage(stderr, EXIT_FAILURE);
+        }
+    }
+    if (strcmp(transport, "socket") == 0) {
+        unsetenv("RPC_SHM");
+    } else if (strcmp(transport, "shm") == 0) {
+        setenv("RPC_SHM", "1", 1);
+    } else {
+        fprintf(stderr, "Invalid transport %s\n", transport);
+        exit(EXIT_FAILURE);
+    }
+    if (config.threads < 1 || config.inflight < 1 || config.seconds <= 0 || config.pool < 0) {
+        fprintf(stderr, "Invalid benchmark settings\n");
+        exit(EXIT_FAILURE);
+    }
+    config.warmup = config.seconds / 10 < 1.0 ? config.seconds / 10 : 1.0;
+
+    size_t sizes[MAX_SIZES];
+    int num_sizes = 0;
+    char *copy = strdup(sizes_arg);
+    for (char *tok = strtok(copy, ","); tok != NULL && num_sizes < MAX_SIZES; tok = strtok(NULL, ",")) {
+        sizes[num_sizes++] = strtoull(tok, NULL, 10);
+    }
+    free(copy);
+
+    /* Start the in-process server */
+    int in_process = config.addr == NULL;
+    if (in_process) {
+        rpc_server *server = rpc_init_server(config.port);
+        if (server == NULL || rpc_register(server, "echo", echo) == -1) {
+            fprintf(stderr, "Failed to start server\n");
+            exit(EXIT_FAILURE);
+        }
+        if (workers >= 0 && rpc_server_set_workers(server, workers < 2 ? workers : 2, workers) == -1) {
+            fprintf(stderr, "Invalid number of workers\n");
+            exit(EXIT_FAILURE);
+        }
+        if (rpc_server_set_loops(server, loops) == -1) {
+            fprintf(stderr, "Invalid number of event loops\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_t server_thread;
+        if (pthread_create(&server_thread, NULL, serve, server) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(server_thread);
+        usleep(100000);
+        config.addr = "::1";
+    }
+
+    bench_thread *threads = calloc(config.threads, sizeof(bench_thread));
+    if (threads == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < config.threads; i++) {
+        if (config.pool > 0 && i > 0) {
+            threads[i].client = threads[0].client;
+            threads[i].handle = threads[0].handle;
+            continue;
+        }
+        threads[i].client = rpc_init_client(config.addr, config.port);
+        if (threads[i].client == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        if (config.pool > 0 && rpc_client_set_pool(threads[i].client, 1, config.pool) < 0) {
+            fprintf(stderr, "Invalid pool size\n");
+            exit(EXIT_FAILURE);
+        }
+        threads[i].handle = rpc_find(threads[i].client, "echo");
+        if (threads[i].handle == NULL) {
+            fprintf(stderr, "ERROR: Function echo does not exist\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("{\"server\":\"%s\",\"transport\":\"%s\",\"threads\":%d,\"inflight\":%d,\"pool\":%d,"
+           "\"seconds\":%.3f,\"results\":[",
+           in_process ? "in-process" : config.addr, transport, config.threads, config.inflight, config.pool,
+           config.seconds);
+    for (int i = 0; i < num_sizes; i++) {
+        config.size = sizes[i];
+        run_size(&config, threads, i == 0);
+    }
+    printf("\n]}\n");
+
+    for (int i = 0; i < (config.pool > 0 ? 1 : config.threads); i++) {
+        free(threads[i].handle);
+        rpc_close_client(threads[i].client);
+    }
+    free(threads);
+    return 0;
+}
+
+/* Sends the payload straight back */
+rpc_data *echo(rpc_data *in) {
+    return in;
+}
@@ -0,0 +1,101 @@
+#include "hist.h"
+#include <string.h>
+
+#define HIST_HALF ((uint64_t) 1 << (HIST_SUB_BITS - 1))
+
+/* Empties a histogram.
+ * */
+void hist_init(hist *h) {
+    memset(h, 0, sizeof(hist));
+    h->min = UINT64_MAX;
+}
+
+/* Bucket of a value: small values map to themselves, larger ones keep
+ * their top HIST_SUB_BITS bits and the number of bits shifted out.
+ * */
+size_t hist_bucket(uint64_t value) {
+    if (value < 2 * HIST_HALF) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return shift * HIST_HALF + (value >> shift);
+}
+
+/* Largest value counted in a bucket.
+ * */
+uint64_t hist_bucket_max(size_t bucket) {
+    if (bucket < 2 * HIST_HALF) {
+        return bucket;
+    }
+    int shift = bucket / HIST_HALF - 1;
+    uint64_t top = bucket - shift * HIST_HALF;
+    return ((top + 1) << shift) - 1;
+}
+
+/* Store a field the recording thread alone writes. Relaxed atomic stores
+ * cost the same as plain ones but let other threads merge meanwhile.
+ * */
+static void hist_set(uint64_t *field, uint64_t value) {
+    __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+/* Read a field that its recording thread may be writing.
+ * */
+static uint64_t hist_get(const uint64_t *field) {
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+/* Counts one value.
+ * */
+void hist_record(hist *h, uint64_t value) {
+    size_t bucket = hist_bucket(value);
+    hist_set(&h->counts[bucket], h->counts[bucket] + 1);
+    hist_set(&h->total, h->total + 1);
+    hist_set(&h->sum, h->sum + value);
+    if (value < h->min) {
+        hist_set(&h->min, value);
+    }
+    if (value > h->max) {
+        hist_set(&h->max, value);
+    }
+}
+
+/* Adds the counts of one histogram into another.
+ * */
+void hist_merge(hist *h, const hist *from) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        h->counts[i] += hist_get(&from->counts[i]);
+    }
+    h->total += hist_get(&from->total);
+    h->sum += hist_get(&from->sum);
+    uint64_t min = hist_get(&from->min);
+    uint64_t max = hist_get(&from->max);
+    if (min < h->min) {
+        h->min = min;
+    }
+    if (max > h->max) {
+        h->max = max;
+    }
+}
+
+/* Value at or below which a fraction p of the recorded values fall,
+ * reported as the top of its bucket but never above the largest value.
+ * */
+uint64_t hist_percentile(const hist *h, double p) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (p * h->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hist_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
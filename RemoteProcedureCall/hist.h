@@ -0,0 +1,44 @@
+/* Header for latency histograms */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Values below 2^HIST_SUB_BITS are counted exactly; above that each power
+ * of two is split into 2^(HIST_SUB_BITS - 1) buckets, so a recorded value
+ * is off by less than 1.6% */
+#define HIST_SUB_BITS 7
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) << (HIST_SUB_BITS - 1))
+
+/* Log-linear histogram of values such as latencies in nanoseconds.
+ * One thread records into a histogram, and others may merge it meanwhile */
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} hist;
+
+/* Empties a histogram */
+void hist_init(hist *h);
+
+/* Counts one value */
+void hist_record(hist *h, uint64_t value);
+
+/* Adds the counts of from into h */
+void hist_merge(hist *h, const hist *from);
+
+/* RETURNS: the value at or below which a fraction p (0 to 1) of the
+ * recorded values fall, 0 when the histogram is empty */
+uint64_t hist_percentile(const hist *h, double p);
+
+/* RETURNS: the bucket a value is counted in */
+size_t hist_bucket(uint64_t value);
+
+/* RETURNS: the largest value counted in a bucket */
+uint64_t hist_bucket_max(size_t bucket);
+
+#endif
@@ -0,0 +1,228 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 13             // entries of the match finder, as a power of two
+#define LZ_MIN_MATCH 4              // shortest match worth an offset
+#define LZ_MAX_OFFSET 65535         // furthest match an offset reaches
+#define LZ_LAST_LITERALS 5          // trailing bytes always sent as literals
+#define LZ_MATCH_LIMIT 12           // no match starts this close to the end
+#define LZ_SKIP_SHIFT 6             // misses before the finder starts skipping ahead
+
+/* Unaligned little-endian 32-bit load.
+ * */
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Unaligned 64-bit load.
+ * */
+static inline uint64_t lz_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Number of equal bytes at a and b before limit, compared a word at a time.
+ * */
+static inline size_t lz_common(const uint8_t *a, const uint8_t *b, const uint8_t *limit) {
+    const uint8_t *start = a;
+    while (limit - a >= 8) {
+        uint64_t diff = lz_read64(a) ^ lz_read64(b);
+        if (diff != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return a - start + (__builtin_ctzll(diff) >> 3);
+#else
+            return a - start + (__builtin_clzll(diff) >> 3);
+#endif
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+/* Hash of the 4 bytes at p.
+ * */
+static inline uint32_t lz_hash(const uint8_t *p) {
+    return (lz_read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write a length above 15 as the nibble's continuation: bytes of 255 and
+ * a final byte below it.
+ * */
+static inline uint8_t *lz_put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+/* Write one sequence: the literals from anchor, then a match of match_len
+ * bytes at offset unless match_len is 0.
+ * Returns NULL if it would not fit before end.
+ * */
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *end, const uint8_t *anchor, size_t lit_len,
+                                size_t offset, size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len != 0 ? 2 + match_len / 255 + 1 : 0);
+    if ((size_t) (end - op) < need) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t) ((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) {
+        op = lz_put_length(op, lit_len - 15);
+    }
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+    if (match_len == 0) {
+        return op;
+    }
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+    size_t extra = match_len - LZ_MIN_MATCH;
+    *token |= (uint8_t) (extra < 15 ? extra : 15);
+    if (extra >= 15) {
+        op = lz_put_length(op, extra - 15);
+    }
+    return op;
+}
+
+/* Greedy single-pass compressor. Each position is looked up in a table of
+ * the last position with the same 4-byte hash, and the lookups step
+ * further apart the longer no match turns up, so incompressible data costs
+ * little more than a copy.
+ * */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+    const uint8_t *base = (const uint8_t *) src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *in_end = base + len;
+    uint8_t *op = (uint8_t *) dst;
+    uint8_t *out_end = op + cap;
+    uint32_t table[1 << LZ_HASH_BITS];
+
+    if (len >= LZ_MATCH_LIMIT + 1) {
+        const uint8_t *match_limit = in_end - LZ_MATCH_LIMIT;
+        const uint8_t *match_end = in_end - LZ_LAST_LITERALS;
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip < match_limit) {
+            /* Find a match, skipping faster through data that has none */
+            const uint8_t *ref;
+            unsigned misses = 1 << LZ_SKIP_SHIFT;
+            while (1) {
+                uint32_t h = lz_hash(ip);
+                ref = base + table[h];
+                table[h] = (uint32_t) (ip - base);
+                if (ref < ip && ip - ref <= LZ_MAX_OFFSET && lz_read32(ref) == lz_read32(ip)) {
+                    break;
+                }
+                ip += misses++ >> LZ_SKIP_SHIFT;
+                if (ip >= match_limit) {
+                    goto last_literals;
+                }
+            }
+
+            /* Extend it backwards over literals, and forwards */
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *start = ip;
+            size_t offset = ip - ref;
+            ip += LZ_MIN_MATCH;
+            ip += lz_common(ip, ref + LZ_MIN_MATCH, match_end);
+            op = lz_put_sequence(op, out_end, anchor, start - anchor, offset, ip - start);
+            if (op == NULL) {
+                return 0;
+            }
+            anchor = ip;
+            if (ip < match_limit) {
+                table[lz_hash(ip - 2)] = (uint32_t) (ip - 2 - base);
+            }
+        }
+    }
+
+last_literals:
+    op = lz_put_sequence(op, out_end, anchor, in_end - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return op - (uint8_t *) dst;
+}
+
+/* Read a length continued past its nibble.
+ * Returns -1 if the input ends first.
+ * */
+static inline int lz_get_length(const uint8_t **ip, const uint8_t *in_end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= in_end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Replays the sequences, checking every length against both buffers.
+ * */
+int lz_decompress(const void *src, size_t src_len, void *dst, size_t len) {
+    const uint8_t *ip = (const uint8_t *) src;
+    const uint8_t *in_end = ip + src_len;
+    uint8_t *out = (uint8_t *) dst;
+    uint8_t *op = out;
+    uint8_t *out_end = out + len;
+
+    while (ip < in_end) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && lz_get_length(&ip, in_end, &lit_len) < 0) {
+            return -1;
+        }
+        if ((size_t) (in_end - ip) < lit_len || (size_t) (out_end - op) < lit_len) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == in_end) {
+            break;
+        }
+
+        if (in_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && lz_get_length(&ip, in_end, &match_len) < 0) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t) (op - out) || (size_t) (out_end - op) < match_len) {
+            return -1;
+        }
+
+        /* An offset shorter than the match repeats the bytes just written,
+         * so each copy can take twice as many as the last */
+        const uint8_t *ref = op - offset;
+        while (match_len > 0) {
+            size_t n = (size_t) (op - ref) < match_len ? (size_t) (op - ref) : match_len;
+            memcpy(op, ref, n);
+            op += n;
+            match_len -= n;
+        }
+    }
+    return op == out_end ? 0 : -1;
+}
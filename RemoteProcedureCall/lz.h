@@ -0,0 +1,19 @@
+/* Header for block compression */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/* Compresses len bytes of src into dst, which holds cap bytes, in the LZ4
+ * block format: runs of literals, each followed by a 16-bit offset and
+ * length copying earlier output. Favours speed over ratio */
+/* RETURNS: bytes written to dst, or 0 if they would not fit in cap */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/* Decompresses src_len bytes of src into exactly len bytes at dst. Never
+ * reads or writes out of bounds, whatever src holds */
+/* RETURNS: -1 if src is corrupt or does not decompress to len bytes */
+int lz_decompress(const void *src, size_t src_len, void *dst, size_t len);
+
+#endif
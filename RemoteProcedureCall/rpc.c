@@ -1,5 +1,9 @@
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include "rpc.h"
+#include "hist.h"
+#include "trace.h"
+#include "lz.h"
+#include "uring.h"
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -20,36 +24,642 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <execinfo.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/un.h>
+#include <sched.h>
 
 #define NONBLOCKING
 #define MAX_BYTES 1001
 #define MAX_DATA 100000
-#define HEADER_LEN 4
+#define FRAME_HEADER_LEN 12         // body length, op, flags, 2 reserved bytes, request id
+#define PAYLOAD_HEADER_LEN 12       // data1 (uint64_t) + data2_len (uint32_t)
+#define COMPACT_HEADER_MAX 14       // op and flags byte, then varints of the length, request id and budget
+#define COMPACT_BODY_MAX 15         // varints of the function id, data1 and data2_len of a compact frame
+#define VARINT_MAX 10               // longest varint of a uint64_t
+#define MAX_FRAME (16 << 20)        // largest frame body, bounds batches
+#define READ_CHUNK 65536
+#define MAX_EVENTS 64
+#define QUEUE_CAPACITY 4096         // pending calls, must be a power of two
+#define DEFAULT_MIN_WORKERS 2
+#define DEFAULT_MAX_WORKERS 64
+#define WORKER_IDLE_SEC 2           // idle time before a surplus worker exits
+#define CACHE_LINE 64
+#define REGISTRY_INIT_SLOTS 64      // must be a power of two
+#define PENDING_BUCKETS 256         // buckets of a client's calls in flight, power of two
+#define LARGE_HEADER_LEN 16         // data1 (uint64_t) + data2_len (uint64_t) of a large payload
+#define MAX_LARGE_DATA (1ULL << 40) // largest data2 of a large payload
+#define CHUNK_SIZE (1 << 20)        // data2 bytes per CHUNK frame of a large payload
+#define OUT_HIGH_WATER (4 << 20)    // queued bytes before a large reply waits for the socket
+#define SEND_TIMEOUT_MS 10000       // wait without progress before a large reply gives up on its client
+#define POOL_MIN_SHIFT 5            // smallest pooled block, 32 bytes
+#define POOL_CLASSES 16             // pooled block sizes, doubling from 32 bytes to 1 MiB
+#define POOL_REGION (64UL << 20)    // address space reserved per block size
+#define POOL_CACHE_BYTES (512 << 10) // free bytes a thread keeps per block size
+#define POOL_CACHE_BLOCKS 64        // free blocks a thread keeps per block size
+#define STATS_NAME "__stats"        // built-in function reporting server metrics
+#define TRACE_NAME "__trace"        // built-in function returning traced spans
+#define RESERVED_PREFIX "__"        // names of built-in functions
+#define NUM_BUILTINS 2              // built-in functions registered by rpc_init_server
+#define SHM_RING (1 << 20)          // bytes of each direction of a shared-memory connection
+#define SHM_MAGIC 0x52504353u       // marks an initialised shared-memory region
+#define SHM_PREFIX "/rpc-shm-"      // names of shared-memory regions
+#define SHM_NAME_MAX 64             // longest region name
+#define SHM_WAIT_MS 100             // sleep before checking a shared-memory peer is alive
+#define UNIX_PREFIX "unix:"         // client address of a Unix socket path
+#define FD_HEADER_LEN 24            // data1, data2_len and offset (uint64_t) of a payload passed as a descriptor
+#define MAX_PASSED_FDS 16           // descriptors accepted with one message
+#define DEFAULT_MIN_CONNS 1         // connections a client keeps open while idle
+#define DEFAULT_MAX_CONNS 4         // upper bound of a client's connection pool
+#define POOL_GROW_CALLS 8           // calls in flight on every connection before the pool grows
+#define POOL_IDLE_SEC 2             // idle time before a surplus connection is closed
+#define DEFAULT_COMPRESS_MIN 4096   // smallest data2 compressed by default
+#define COMPRESS_SAVING 8           // compressed data2 must be at least 1/8 smaller to be sent
+#define CAP_COMPRESS 0x01           // HELLO capability: frames may carry compressed data2
+#define CAP_COMPACT 0x02            // HELLO capability: CALL and DATA frames may use the compact encoding
+#define CAP_LIST 0x04               // HELLO capability: LIST is answered with the registry
+#define YESS_LEN (2 * sizeof(uint32_t) + sizeof(uint64_t)) // id or capabilities, flags, registry generation
+#define TABLE_ENTRY_LEN (2 * sizeof(uint32_t) + sizeof(uint16_t)) // id, flags and name length of a TABLE entry
+#define DEFAULT_CACHE_BYTES (64 << 20) // memory of the response cache of pure functions
+#define CACHE_SHARDS 16             // independently locked parts of the response cache, power of two
+#define CACHE_BUCKETS 4096          // hash chains per cache shard, power of two
+#define CACHE_MAX_SHARE 8           // a cached response takes at most 1/8 of its shard
+#define STREAM_WINDOW 32            // items of a streaming call sent ahead of the client reading them
+#define FUNC_STREAM 0x100           // function flag FIND reports for handlers registered with rpc_register_stream
+#define MAX_BUDGET_MS 65535         // longest deadline a frame carries, later ones are not sent
+#define OVERLOAD_INTERVAL (100 * 1000000ULL) // queue never empty for this long, in ns, means overload
+#define LISTEN_BACKLOG SOMAXCONN    // pending connections per listener, capped by net.core.somaxconn
+#define URING_ENTRIES 1024          // SQEs of a loop's io_uring, power of two
+#define URING_BUFS 256              // receive buffers of a loop's io_uring, power of two
+#define URING_BUF_LEN 16384         // bytes per receive buffer
+#define URING_BGID 0                // buffer group of the receive buffers
+#define URING_TAG_BITS 3            // low bits of an SQE's user_data saying what it is for
+#define URING_TAGS ((1 << URING_TAG_BITS) - 1)
+#define URING_ACCEPT 1              // multishot accept, user_data holds the listener
+#define URING_RECV 2                // multishot receive of a connection
+#define URING_POLL 3                // multishot poll of a connection
+#define URING_SEND 4                // send of a connection's flight
+#define URING_CANCEL 5              // cancellation of a closed connection's requests
+
+/* Frame opcodes, named after the signals of the original protocol */
+#define OP_FIND 'F'                 // finds a procedure
+#define OP_CALL 'C'                 // calls a procedure
+#define OP_BATCH 'B'                // calls a procedure once per payload
+#define OP_YESS 'Y'                 // a procedure is found
+#define OP_DATA 'D'                 // data is being sent back
+#define OP_NULL 'N'                 // invalid request
+#define OP_RSLT 'R'                 // results of a batch are being sent back
+#define OP_CHUNK 'K'                // next part of a large payload's data2
+#define OP_SHM 'M'                  // moves the connection's frames onto shared memory
+#define OP_HELLO 'H'                // negotiates the capabilities of a connection
+#define OP_BUSY 'O'                 // call shed because the server is overloaded
+#define OP_EXPIRED 'E'              // call dropped because its deadline passed
+#define OP_END 'Z'                  // a streaming call sent its last item
+#define OP_GRANT 'G'                // client has room for more items of a streaming call
+#define OP_LIST 'L'                 // asks for every registered function
+#define OP_TABLE 'T'                // every registered function is being sent back
+
+/* Frame flags */
+#define FLAG_LARGE 0x01             // CALL or DATA whose data2 follows in CHUNK frames
+#define FLAG_TRACE 0x02             // CALL or BATCH sampled for tracing by the client
+#define FLAG_FD 0x04                // CALL or DATA whose data2 is a descriptor passed with SCM_RIGHTS
+#define FLAG_COMPRESSED 0x08        // CALL, DATA or CHUNK whose data2 is compressed
+#define FLAG_MORE 0x10              // RSLT followed by another RSLT of the same batch
+#define FLAG_STREAM 0x20            // CALL of a streaming function, or DATA holding one item of its results
+
+/* First byte of a compact frame, whose low bits are its FLAG_ bits */
+#define COMPACT_MARK 0x80           // frame uses the compact encoding, never set in a fixed header
+#define COMPACT_DATA 0x40           // DATA rather than CALL
+#define COMPACT_BUDGET 0x10         // a deadline budget follows the request id
+#define COMPACT_FLAGS (FLAG_TRACE | FLAG_COMPRESSED | FLAG_STREAM) // flags a compact frame may carry
+
+/* Header in front of every message */
+typedef struct {
+    uint32_t len;                   // length of the body after the header
+    uint8_t op;                     // one of the OP_ codes
+    uint8_t flags;                  // FLAG_ bits
+    uint16_t budget;                // milliseconds the caller waits for the reply, 0 for no deadline
+    uint32_t id;                    // request id, echoed by the reply
+    uint8_t compact;                // CALL or DATA in the compact encoding
+} frame_header;
+
+/* One direction of a shared-memory connection: a byte ring with a single
+ * producer and a single consumer, carrying the same frames as a socket */
+typedef struct {
+    _Alignas(CACHE_LINE) uint64_t head; // bytes written, advanced by the producer
+    _Alignas(CACHE_LINE) uint64_t tail; // bytes read, advanced by the consumer
+    _Alignas(CACHE_LINE) char data[SHM_RING];
+} shm_ring;
+
+/* Futex that one side of a shared-memory connection sleeps on */
+typedef struct {
+    _Alignas(CACHE_LINE) uint32_t bell; // bumped to wake the side
+    uint32_t waiting;               // threads of the side asleep or about to sleep
+} shm_bell;
+
+/* Memory shared by a same-host client and the server. The client creates
+ * it, and the server maps it when the client asks with OP_SHM. The
+ * server's event loop serves the rings, and sleeps on the connection's
+ * socket, so the client wakes it with a byte there rather than a futex */
+typedef struct {
+    uint32_t magic;                 // SHM_MAGIC
+    uint32_t ring_size;             // SHM_RING
+    uint32_t closed;                // either side has gone
+    uint32_t loop_waiting;          // the server's loop waits for a byte on the socket
+    uint32_t replies_held;          // the server holds replies the reply ring had no room for
+    shm_bell client_bell;           // wakes the client's reader and senders
+    shm_bell server_bell;           // wakes server threads waiting for room in the reply ring
+    shm_ring requests;              // client to server
+    shm_ring replies;               // server to client
+} shm_region;
+
+/* Descriptors received with SCM_RIGHTS on a Unix socket, in the order of
+ * the FLAG_FD frames they belong to */
+typedef struct {
+    int *fds;                       // descriptors, oldest at head
+    size_t head;                    // index of the oldest descriptor
+    size_t len;                     // number of descriptors held
+    size_t cap;                     // capacity of fds
+} fd_queue;
+
+/* A decoded call waiting for a worker */
+typedef struct rpc_request rpc_request;
+
+/* A client connection of the server */
+typedef struct rpc_conn rpc_conn;
+
+/* Credit of a streaming call: items its handler may still send before the
+ * client must grant more with GRANT frames. Kept on the connection, so the
+ * thread parsing the client's frames finds it by request id */
+typedef struct rpc_flow {
+    uint32_t id;                    // request id of the call
+    uint32_t credit;                // items the client has room for
+    int cancelled;                  // client stopped reading, or the connection closed
+    struct rpc_flow *next;          // next streaming call of the connection
+} rpc_flow;
+
+/* A large result its connection's event loop sends a chunk at a time, as
+ * the connection's output drains, since the loop cannot wait for room.
+ * Only that loop touches it */
+typedef struct held_reply {
+    uint32_t id;                    // request id of the call
+    rpc_data *result;               // result, freed once its last chunk is queued
+    size_t off;                     // data2 bytes of it queued so far
+    int compress;                   // chunks are compressed where that pays off
+    struct held_reply *next;        // next held result of the connection
+} held_reply;
+
+/* Compression of the data2 of one direction of a call */
+typedef struct {
+    uint64_t raw;                   // data2 bytes compression was tried on
+    uint64_t wire;                  // bytes of them on the wire, raw when not worth compressing
+    uint64_t ns;                    // time compressing or decompressing
+} zip_stats;
+
+/* Metrics of one handler, kept per thread. Only the owning thread writes
+ * them, with relaxed atomic stores, so __stats can merge them at any time */
+typedef struct {
+    uint64_t calls;                 // calls run
+    uint64_t errors;                // calls answered with NULL
+    uint64_t bytes_in;              // payload bytes received
+    uint64_t bytes_out;             // payload bytes sent back
+    zip_stats zip_in;               // decompression of payloads
+    zip_stats zip_out;              // compression of results
+    hist latency;                   // handler time in nanoseconds
+} handler_stats;
+
+/* Metrics of an open connection, copied for __stats under stats_lock */
+typedef struct {
+    uint64_t id;                    // connection number
+    char peer[INET6_ADDRSTRLEN + 8]; // client address and port
+    int loop;                       // index of the event loop it is on
+    int shm;                        // frames go through shared memory
+    uint64_t calls;                 // calls received
+    uint64_t errors;                // NULL replies sent
+    uint64_t bytes_in;              // bytes received
+    uint64_t bytes_out;             // bytes sent or queued
+} conn_stats;
+
+/* Handler metrics of one thread that runs calls. A shard is handed to a
+ * new thread once its previous thread exits, and is never freed while the
+ * server lives */
+typedef struct stats_shard {
+    rpc_server *srv;                // server the shard belongs to
+    int in_use;                     // owned by a live thread
+    size_t num_handlers;            // length of handlers
+    _Atomic(handler_stats *) *handlers; // metrics by function id, allocated on first call
+    struct stats_shard *next;       // next shard of the server
+} stats_shard;
+
+/* A response of a pure function, kept with the payload it answers. The
+ * reply is stored encoded, so a hit only needs a frame header in front */
+typedef struct cache_entry {
+    uint64_t hash;                  // hash of the function id and payload
+    uint32_t func_id;               // function called
+    int data1;                      // data1 of the payload
+    size_t key_len;                 // data2_len of the payload
+    size_t reply_len;               // encoded result: payload header and data2
+    atomic_uint refs;               // held by the cache and by senders of a hit
+    struct cache_entry *chain;      // next entry in the same hash chain
+    struct cache_entry *newer;      // neighbours in least recently used order
+    struct cache_entry *older;
+    char bytes[];                   // data2 of the payload, then the encoded result
+} cache_entry;
+
+/* One independently locked part of the response cache, chosen by hash */
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock; // guards the shard
+    cache_entry *buckets[CACHE_BUCKETS]; // hash chains
+    cache_entry *newest;            // most recently used entry
+    cache_entry *oldest;            // least recently used entry, evicted first
+    size_t bytes;                   // memory held by the entries
+    size_t num_entries;             // entries cached
+    uint64_t hits;                  // lookups answered from the cache
+    uint64_t misses;                // lookups that ran the handler
+    uint64_t evictions;             // entries dropped to make room
+} cache_shard;
+
+/* A slot of the request queue, stamped with the position it may be used at */
+typedef struct {
+    atomic_size_t seq;              // position the slot is ready for
+    rpc_request *req;               // queued request
+} queue_cell;
+
+/* Bounded lock-free multi-producer multi-consumer queue of requests */
+typedef struct {
+    queue_cell *cells;              // ring of QUEUE_CAPACITY slots
+    size_t mask;                    // QUEUE_CAPACITY - 1
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+} rpc_queue;
+
+/* A registered function. The name is interned in the registry, and the
+ * entry's index is the function id handed out to clients by FIND. */
+typedef struct {
+    uint32_t hash;                  // hash of the name
+    uint32_t name_off;              // offset of the name in the name arena
+    uint32_t name_len;              // length of the name
+    uint32_t flags;                 // RPC_NO_COMPRESS, RPC_PURE, FUNC_STREAM, sent to clients by FIND
+    rpc_handler function;           // function
+    rpc_async_handler async;        // function registered with rpc_register_async, which finishes later
+    uint64_t installed;             // registry generation its handlers were installed at
+} rpc_entry;
+
+/* Slot of the registry index. Keeps the hash so probing rarely has to
+ * touch the entry itself. */
+typedef struct {
+    uint32_t hash;                  // hash of the entry's name
+    uint32_t entry;                 // entry index + 1, 0 for an empty slot
+} registry_slot;
+
+/* Functions registered on a server, indexed by name with open addressing.
+ * Once the server is serving, lookups go to copies that are never written:
+ * a registration publishes a new copy, and frees the old one once no
+ * reader can still be using it, so lookups take no lock. */
+typedef struct {
+    registry_slot *slots;           // linear probing index
+    size_t mask;                    // number of slots - 1
+    rpc_entry *entries;             // registered functions
+    size_t num_entries;             // number of entries
+    size_t entries_cap;             // capacity of entries
+    char *names;                    // arena of NUL-terminated names
+    size_t names_len;               // bytes used in names
+    size_t names_cap;               // capacity of names
+    uint64_t generation;            // changes with every registration, and between servers
+} rpc_registry;
+
+/* A thread that looks functions up in a server's published registry. A
+ * reader is handed to a new thread once its previous thread exits, and is
+ * never freed while the server lives */
+typedef struct registry_reader {
+    _Alignas(CACHE_LINE) atomic_uint_least64_t epoch; // epoch the thread started its lookups in, 0 if it is not
+    rpc_server *srv;                // server the reader belongs to
+    int in_use;                     // owned by a live thread
+    int depth;                      // lookups of the thread entered and not yet exited
+    struct registry_reader *next;   // next reader of the server
+} registry_reader;
+
+/* A published registry replaced by a registration, freed once every
+ * reader has moved past the epoch it was replaced in */
+typedef struct retired_registry {
+    rpc_registry *registry;         // registry no longer published
+    uint64_t epoch;                 // epoch it was replaced in
+    struct retired_registry *next;  // next registry waiting to be freed
+} retired_registry;
+
+/* An event loop of rpc_serve_all. With more than one, each has its own
+ * SO_REUSEPORT listener, is pinned to a CPU and keeps every connection it
+ * accepts, and looks functions up in its own copy of the registry. */
+typedef struct {
+    rpc_server *srv;                // server the loop belongs to
+    int index;                      // position among the server's loops
+    int epoll_fd;                   // listeners and connections of the loop
+    int listen_fd;                  // TCP listener of the loop
+    int cpu;                        // CPU the loop is pinned to, or -1
+    rpc_registry snapshot;          // copy of the published registry made by a pinned loop's thread
+    atomic_uint_least64_t accepted; // connections accepted
+    uring *ring;                    // io_uring the loop runs on, or NULL for epoll
+    uring_bufs bufs;                // buffers the ring receives into
+} rpc_loop;
 
 struct rpc_server {
     int srv_socket;                 // server socket
-    rpc_handle *handles_head;       // head of handlers linked list
-    int num_handles;                // number of handlers
-    int new_socket_fd;              // when connect with a client
+    int unix_socket;                // Unix socket listener, or -1
+    rpc_registry registry;          // registered functions, written by registrations only
+    pthread_mutex_t registry_lock;  // serializes registrations, guards registry once serving
+    _Atomic(rpc_registry *) published; // copy of registry lookups go to, once serving
+    atomic_uint_least64_t epoch;    // advanced each time published is replaced
+    pthread_key_t reader_key;       // reader of the calling thread
+    registry_reader *readers;       // readers of the published registry, guarded by registry_lock
+    retired_registry *retired;      // replaced registries not yet freed, guarded by registry_lock
+    int serving;                    // set once rpc_serve_all starts
+    int num_loops;                  // event loops of rpc_serve_all, 0 for one per CPU until it starts
+    rpc_loop *loops;                // event loops, once serving
+    cpu_set_t cpus;                 // CPUs the server may run on, which workers keep
+    int uring;                      // loops run on io_uring rather than epoll
+    int min_workers;                // workers kept alive while idle
+    int max_workers;                // upper bound of the worker pool
+    rpc_queue queue;                // calls waiting for a worker
+    sem_t queue_items;              // wakes idle workers
+    atomic_int num_workers;         // live workers
+    atomic_int idle_workers;        // workers waiting for a call
+    pthread_key_t stats_key;        // shard of the thread running a call
+    pthread_mutex_t stats_lock;     // guards shards and conns
+    stats_shard *shards;            // per-thread handler metrics
+    rpc_conn *conns;                // open connections
+    uint64_t next_conn_id;          // id of the next connection
+    struct timespec started;        // when the server was created
+    size_t cache_bytes;             // bound of the response cache, 0 to disable it
+    _Atomic(cache_shard *) cache;   // response cache of pure functions, or NULL
+    size_t max_queued;              // calls waiting before new ones are shed, 0 for no limit
+    uint64_t target_delay;          // time a call may wait while overloaded, in ns, 0 for no limit
+    atomic_uint_least64_t last_empty; // when a worker last found the queue empty
+    atomic_uint_least64_t shed;     // calls answered BUSY
+    atomic_uint_least64_t expired;  // calls answered EXPIRED
+    atomic_size_t async_pending;    // calls started by asynchronous handlers and not yet completed
+};
+
+/* A call in flight on a client */
+struct rpc_future {
+    rpc_client *cl;                 // client the call was made on
+    uint32_t id;                    // request id
+    uint8_t op;                     // reply opcode, 0 until the reply arrives
+    uint32_t func_id;               // function id of a YESS reply
+    uint32_t func_flags;            // function flags of a YESS reply
+    uint64_t generation;            // registry generation of a YESS or TABLE reply
+    rpc_registry *table;            // functions of a TABLE reply, NULL if the client had them already
+    rpc_data *result;               // payload of a DATA reply
+    rpc_data **results;             // payloads of a RSLT reply
+    uint32_t num_results;           // number of results
+    rpc_data *into;                 // caller's result of rpc_call_into, or NULL
+    void *into_buf;                 // caller's buffer for the result's data2
+    size_t into_len;                // capacity of into_buf
+    int receiving;                  // CHUNK frames of a large result are arriving
+    int discard;                    // large result does not fit, chunks are dropped
+    size_t large_off;               // data2 bytes of the large result received
+    int traced;                     // call is sampled for tracing
+    uint64_t trace_start;           // when the call started, if traced
+    uint64_t deadline;              // when the caller stops waiting, 0 for never
+    int stream;                     // call of rpc_call_stream, whose items queue up until read
+    rpc_data **items;               // ring of items received and not yet read
+    uint32_t items_head;            // index of the oldest item
+    uint32_t items_len;             // items queued
+    uint32_t items_cap;             // capacity of items, a power of two
+    uint32_t consumed;              // items read since credit was last granted
+    rpc_future *next;               // next call in the same pending bucket
 };
 
+/* Client state. Calls from many threads share the connection: frames are
+ * written whole under send_lock, and whichever waiting thread finds nobody
+ * reading becomes the reader and completes replies for every call.
+ * The client rpc_init_client returns also owns a pool of connections to the
+ * same server, itself first, and each call goes to the one with the fewest
+ * calls in flight. */
 struct rpc_client {
     int cli_socket;                 // client socket
     struct addrinfo *server_addr;   // server address
     char* addr;                     // client address
     int port;                       // port number
+    char *in;                       // received bytes, frames are parsed in place
+    size_t in_off;                  // start of the bytes not yet parsed
+    size_t in_len;                  // end of the received bytes
+    size_t in_cap;                  // capacity of in
+    pthread_mutex_t send_lock;      // keeps frames of concurrent calls whole
+    pthread_mutex_t lock;           // guards the fields below
+    pthread_cond_t replied;         // broadcast when replies are completed
+    int reading;                    // a waiting thread is reading replies
+    int broken;                     // connection failed, no more replies
+    uint32_t next_id;               // id of the next request
+    int zerocopy;                   // socket accepts MSG_ZEROCOPY
+    int compress;                   // server takes compressed data2
+    int compact;                    // server takes compact frames
+    int list;                       // server answers LIST
+    uint64_t generation;            // registry generation the server last reported
+    shm_region *shm;                // shared memory frames go through, or NULL
+    int unix_socket;                // connected to a Unix socket, large payloads pass as descriptors
+    fd_queue fds;                   // descriptors received ahead of their frames
+    rpc_future *pending[PENDING_BUCKETS];   // calls in flight by request id
+    atomic_uint inflight;           // calls picked this connection and not yet finished
+    uint64_t idle_since;            // when a call on this connection last finished
+    pthread_mutex_t pool_lock;      // guards the pool fields below
+    rpc_client **conns;             // connections of the pool, conns[0] is this client
+    size_t num_conns;               // connections in the pool
+    size_t conns_cap;               // capacity of conns
+    int min_conns;                  // connections kept open while idle
+    int max_conns;                  // upper bound of the pool
+    int connecting;                 // a thread is opening a connection for the pool
+    uint64_t timeout;               // time each call may take in nanoseconds, 0 for no deadline
 };
 
-/* The node of the handler linked list */
+/* Client handle of a remote function, allocated as a single block */
 struct rpc_handle {
-    char name[MAX_BYTES];           // function name
-    rpc_handler function;           // function
-    rpc_handle* next;               // next handle
+    uint32_t id;                    // function id assigned by the server
+    uint32_t flags;                 // flags the function was registered with
+    uint32_t name_len;              // length of the function name
+    char name[];                    // function name
+};
+
+/* A client connection multiplexed by the server event loop.
+ * Workers hold a reference while they run a call for the connection, so
+ * the socket is only closed once the last reply has been queued. */
+struct rpc_conn {
+    rpc_server *srv;                // server the connection belongs to
+    rpc_loop *loop;                 // event loop the connection stays on
+    int socket;                     // non-blocking client socket
+    atomic_int refs;                // event loop + calls in flight
+    pthread_mutex_t out_lock;       // guards out between event loop and workers
+    char *in;                       // received bytes not yet parsed
+    size_t in_len;                  // number of bytes in in
+    size_t in_cap;                  // capacity of in
+    char *out;                      // bytes waiting to be sent
+    size_t out_off;                 // bytes of out already sent
+    size_t out_len;                 // number of bytes in out
+    size_t out_cap;                 // capacity of out
+    char *flight;                   // output handed to the kernel by an io_uring SEND
+    size_t flight_off;              // bytes of flight sent
+    size_t flight_len;              // bytes of flight, 0 while nothing is in flight
+    size_t flight_cap;              // capacity of flight
+    int sending;                    // a SEND of flight is submitted
+    int closing;                    // closed, waiting for its io_uring requests to end
+    rpc_request *large;             // large CALL whose data2 is still arriving
+    size_t large_off;               // data2 bytes of it received so far
+    held_reply *held;               // large results the loop sends as output drains, oldest first
+    held_reply *held_tail;          // newest of them
+    uint64_t recv_start;            // when the last read began, if tracing
+    uint64_t recv_end;              // when the last read ended, if tracing
+    uint64_t id;                    // connection number, for __stats
+    char peer[INET6_ADDRSTRLEN + 8]; // client address and port
+    int local;                      // client is on this host
+    int compress;                   // client takes compressed data2
+    int compact;                    // client takes compact frames
+    shm_region *shm;                // shared memory frames go through, or NULL
+    int unix_socket;                // accepted on the Unix socket listener
+    fd_queue fds;                   // descriptors received ahead of their frames
+    pthread_mutex_t flow_lock;      // guards flows and their credit
+    pthread_cond_t credited;        // broadcast when a streaming call gets credit or is cancelled
+    rpc_flow *flows;                // streaming calls of the connection
+    atomic_uint_least64_t calls;    // calls received
+    atomic_uint_least64_t errors;   // NULL replies sent
+    atomic_uint_least64_t bytes_in; // bytes received
+    atomic_uint_least64_t bytes_out; // bytes sent or queued
+    rpc_conn *prev;                 // previous open connection
+    rpc_conn *next;                 // next open connection
 };
 
-void* rpc_handle_client(void* serv);                            // client process
-int send_data(int socket, rpc_data *payload, char *command);    // convert data to network byte order and send
-int receive_data(int socket, rpc_data* result);                 // receive a data and convert to local byte order
+struct rpc_request {
+    rpc_conn *conn;                 // connection to reply on
+    uint32_t id;                    // request id to reply with
+    rpc_handler function;           // handler to run
+    rpc_async_handler async;        // asynchronous handler to start instead, or NULL
+    uint32_t func_id;               // function id, for metrics
+    uint32_t func_flags;            // flags of the function when the call arrived
+    rpc_data data;                  // payload of a CALL
+    rpc_data *batch;                // payloads of a BATCH, NULL for a CALL
+    uint32_t batch_len;             // number of payloads in batch
+    char *body;                     // copy of the frame body the payloads point into
+    int large;                      // data2 is a large buffer, or is discarded if NULL
+    int traced;                     // request is sampled for tracing
+    uint64_t queued;                // when the request was dispatched, if traced
+    zip_stats unzipped;             // decompression of the payload
+    int cacheable;                  // result goes into the response cache
+    uint64_t cache_hash;            // hash of the function id, its handler and payload, if cacheable
+    uint64_t deadline;              // when the client stops waiting, 0 for never
+    uint64_t enqueued;              // when the request was queued, if calls may be shed by delay
+    uint64_t started;               // when its asynchronous handler was started
+    rpc_flow *flow;                 // credit of a streaming call, NULL for any other
+    uint64_t streamed;              // bytes of the items a streaming call has sent
+    zip_stats zipped;               // compression of the items a streaming call has sent
+};
+
+int rpc_handle_client(rpc_server *srv, rpc_conn *conn);         // parse and serve buffered commands
+int worker_retire(rpc_server *srv);                             // take an idle worker out of the pool
+void conn_yess(rpc_conn *conn, uint32_t id, uint32_t value, uint32_t flags, uint64_t generation); // answer FIND or HELLO
+void conn_list(rpc_conn *conn, rpc_registry *reg, uint32_t id, uint64_t known); // answer LIST with the registry
+rpc_data *stats_handler(rpc_data *payload);                     // placeholder handler of __stats
+rpc_data *stats_report(rpc_server *srv);                        // build the reply of __stats
+rpc_data *trace_handler(rpc_data *payload);                     // placeholder handler of __trace
+rpc_data *trace_report(void);                                   // build the reply of __trace
+uint64_t stats_clock(void);                                     // monotonic clock in nanoseconds
+uint64_t payload_hash(uint32_t func_id, uint64_t installed, const rpc_data *payload); // hash a call for the response cache
+int cache_reply(rpc_server *srv, rpc_conn *conn, uint32_t id, uint32_t func_id, const rpc_data *payload,
+                uint64_t hash);                                 // answer a call from the response cache
+void cache_store(rpc_server *srv, rpc_request *req, rpc_data *result); // cache the result of a pure call
+void cache_init(rpc_server *srv);                               // allocate the response cache if it is used
+int request_late(rpc_server *srv, rpc_request *req);            // answer a queued call that should not run
+void start_async(rpc_request *req);                             // hand a call to its asynchronous handler
+void finish_call(rpc_request *req, rpc_data *result, uint64_t start, uint64_t end); // reply with a call's result
+void end_async(rpc_request *req);                               // release a finished call of an asynchronous handler
+void loop_send(rpc_conn *conn);                                 // send what a loop on io_uring queued for a connection
+int stream_send(rpc_request *req, rpc_data *item, int wait);    // send one item of a streaming call
+void flow_close(rpc_conn *conn, rpc_flow *flow);                // stop tracking the credit of a streaming call
+int flow_take(rpc_conn *conn, rpc_flow *flow, int wait);        // take a credit of a streaming call
+void uring_send(rpc_loop *loop, rpc_conn *conn);                // hand a connection's queued output to io_uring
+void shed_call(rpc_server *srv, rpc_request *req);              // answer a call BUSY
+void stats_release(void *shard);                                // hand a thread's stats shard on at thread exit
+void registry_add(rpc_registry *reg, const char *name, size_t name_len, rpc_handler handler, uint32_t flags); // add a new function
+int register_function(rpc_server *srv, char *name, rpc_handler handler, rpc_async_handler async, unsigned flags); // add or replace a function
+void registry_copy(rpc_registry *dst, const rpc_registry *src); // copy a registry to publish or for a loop
+void registry_init(rpc_registry *reg);                          // set up an empty registry
+void registry_free(rpc_registry *reg);                          // free a registry's memory
+void registry_publish(rpc_server *srv);                         // make the registry's current state the one lookups see
+rpc_registry *registry_enter(rpc_server *srv, registry_reader **reader); // start looking functions up without a lock
+void registry_exit(registry_reader *reader);                    // end the lookups started by registry_enter
+void reader_release(void *reader);                              // hand a thread's registry reader on at thread exit
+int serve_frames(rpc_server *srv, rpc_conn *conn, rpc_registry *reg); // serve buffered commands with a registry
+void stats_grow(rpc_server *srv, stats_shard *shard, size_t num_handlers); // make room for more function ids in a shard
+int listen_shard(int socket_fd);                                // open another listener on the same port
+void *loop_main(void *loop);                                    // run one event loop of rpc_serve_all
+void conn_open(rpc_loop *loop, int socket_fd, int listen_fd);   // set up an accepted connection
+int uring_start(rpc_loop *loop);                                // move a loop onto io_uring
+void uring_run(rpc_loop *loop);                                 // run a loop on io_uring
+void uring_accept(rpc_loop *loop, int listen_fd);               // accept on a listener through io_uring
+void uring_watch(rpc_loop *loop, rpc_conn *conn);               // start a connection's io_uring requests
+void uring_cancel(rpc_loop *loop, rpc_conn *conn);              // end a closed connection's io_uring requests
+rpc_entry *registry_find(rpc_registry *reg, const char *name, size_t name_len); // look up a function by name
+int encode_data(rpc_data *payload, char *buf);                  // write the payload header in network byte order
+int decode_data(const char *buf, rpc_data *result);             // read a payload header in network byte order
+int data_valid(rpc_data *payload);                              // check data2 and data2_len agree
+void encode_frame_header(char *buf, frame_header *hdr);         // write a frame header in network byte order
+void decode_frame_header(const char *buf, frame_header *hdr);   // read a frame header in network byte order
+size_t encode_compact_header(char *buf, frame_header *hdr);     // write the header of a compact frame
+int parse_frame_header(const char *buf, size_t avail, frame_header *hdr); // read a frame header of either encoding
+size_t frame_header_room(frame_header *hdr);                    // bytes to leave for a frame header
+void encode_header_iov(struct iovec *iov, frame_header *hdr);   // write a frame header in front of its body
+size_t encode_body(frame_header *hdr, char *buf, uint32_t func_id, int data1, size_t data2_len, size_t wire_len); // write the start of a CALL or DATA body
+int decode_func_id(frame_header *hdr, const char *body, size_t body_len, uint32_t *func_id); // read the function id of a CALL
+int decode_body(frame_header *hdr, const char *body, size_t body_len, rpc_data *data, size_t *wire_len); // read the payload of a CALL or DATA
+int send_all(int socket, struct iovec *iov, int iovcnt, int flags); // send a message with as few sendmsg calls as possible
+ssize_t recv_fds(int socket, char *buf, size_t len, int flags, fd_queue *q); // receive bytes and passed descriptors
+ssize_t send_fd(int socket, struct iovec *iov, int iovcnt, int fd, int flags); // send bytes with a descriptor attached
+int fd_queue_pop(fd_queue *q);                                  // take the oldest passed descriptor
+void fd_queue_clear(fd_queue *q);                               // close every passed descriptor held
+int memfd_from(const void *buf, size_t len);                    // copy data2 into a sealed memfd
+void *fd_data2(int fd, uint64_t offset, size_t len);            // take data2 passed as a descriptor
+void encode_fd_header(int data1, uint64_t len, uint64_t offset, char *buf); // write the header of a payload passed as a descriptor
+int decode_fd_header(const char *buf, rpc_data *result, uint64_t *offset); // read the header of a payload passed as a descriptor
+rpc_future *client_send(rpc_client *cl, frame_header *hdr, struct iovec *iov, int iovcnt); // send a request and register its call
+void client_await(rpc_client *cl, rpc_future *f);               // wait for a call's reply
+void client_queue_item(rpc_future *f, rpc_data *item);          // queue an item of a streaming call until it is read
+void client_use_shm(rpc_client *cl);                            // move a same-host client onto shared memory
+void client_wake_loop(rpc_client *cl);                          // wake the server's loop serving shared memory
+void client_hello(rpc_client *cl, uint32_t caps);               // negotiate optional protocol features
+int decode_table(frame_header *hdr, char *body, uint64_t *generation, rpc_registry **table); // read the functions of a TABLE reply
+int client_list(rpc_client *cl, const char *name, size_t name_len, rpc_handle **handle); // find a function through the handle cache
+rpc_handle *handle_new(uint32_t id, uint32_t flags, const char *name, size_t name_len); // allocate a handle
+uint16_t call_budget(rpc_future *f);                            // milliseconds left of a call's deadline
+void call_errno(rpc_future *f);                                 // report why a call failed in errno
+rpc_client *client_connect(char *addr, int port);               // open one connection of a client's pool
+void client_close_conn(rpc_client *cl);                         // close one connection of a client's pool
+void *pool_alloc(size_t len);                                   // take a buffer from the pools
+void pool_free(void *ptr);                                      // return a buffer taken with pool_alloc
+void *large_alloc(size_t len);                                  // map a buffer for a large payload
+void large_track(void *base, void *addr, size_t len);           // note a mapping data2 points into
+size_t page_size(void);                                         // bytes of a memory page
+void free_data2(void *data2);                                   // free data2 of any payload
+void encode_large(int data1, uint64_t len, char *buf);          // write a large payload header in network byte order
+int decode_large(const char *buf, rpc_data *result);            // read a large payload header in network byte order
+size_t zip_data2(const void *data2, size_t len, char **out, zip_stats *zs); // compress data2 if it is worth it
+int unzip_data2(const char *body, size_t body_len, void *data2, size_t len, zip_stats *zs); // decompress data2
+size_t ring_put(shm_ring *ring, const char *src, size_t len);   // copy bytes into a shared-memory ring
+ssize_t ring_get(shm_ring *ring, char *dst, size_t len);        // copy bytes out of a shared-memory ring
+int ring_ready(shm_ring *ring, int space);                      // whether a ring can be read, or written
+void shm_wake(shm_bell *b);                                     // wake the sleepers of a shared-memory side
+int shm_wait(shm_region *shm, shm_bell *b, shm_ring *ring, int space, uint64_t deadline); // wait for a shared-memory ring
 
 
 /*
@@ -99,373 +709,5794 @@ rpc_server *rpc_init_server(int port) {
         exit(EXIT_FAILURE);
     }
     server->srv_socket = socket_fd;
-    server->handles_head = NULL;
-    server->num_handles = 0;
-    server->new_socket_fd = 0;
+    server->unix_socket = -1;
+    registry_init(&server->registry);
+
+    /* Clients cache the registry by address, so a server restarted there
+     * must not reuse a generation */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    server->registry.generation = ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec) ^ ((uint64_t) getpid() << 40);
+    pthread_mutex_init(&server->registry_lock, NULL);
+    atomic_init(&server->published, NULL);
+    atomic_init(&server->epoch, 1);
+    if (pthread_key_create(&server->reader_key, reader_release) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    server->readers = NULL;
+    server->retired = NULL;
+    server->serving = 0;
+    server->num_loops = 1;
+    server->loops = NULL;
+    char *uring_env = getenv("RPC_URING");
+    server->uring = uring_env != NULL && atoi(uring_env) == 1 && uring_supported();
+    server->min_workers = DEFAULT_MIN_WORKERS;
+    server->max_workers = DEFAULT_MAX_WORKERS;
+    atomic_init(&server->num_workers, 0);
+    atomic_init(&server->idle_workers, 0);
+    if (sem_init(&server->queue_items, 0, 0) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    server->queue.cells = malloc(QUEUE_CAPACITY * sizeof(queue_cell));
+    if (server->queue.cells == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < QUEUE_CAPACITY; i++) {
+        atomic_init(&server->queue.cells[i].seq, i);
+    }
+    server->queue.mask = QUEUE_CAPACITY - 1;
+    atomic_init(&server->queue.enqueue_pos, 0);
+    atomic_init(&server->queue.dequeue_pos, 0);
+    if (pthread_key_create(&server->stats_key, stats_release) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&server->stats_lock, NULL);
+    server->shards = NULL;
+    server->conns = NULL;
+    server->next_conn_id = 1;
+    server->cache_bytes = DEFAULT_CACHE_BYTES;
+    atomic_init(&server->cache, NULL);
+    server->max_queued = 0;
+    server->target_delay = 0;
+    atomic_init(&server->last_empty, 0);
+    atomic_init(&server->shed, 0);
+    atomic_init(&server->expired, 0);
+    atomic_init(&server->async_pending, 0);
+    clock_gettime(CLOCK_MONOTONIC, &server->started);
+    registry_add(&server->registry, STATS_NAME, strlen(STATS_NAME), stats_handler, 0);
+    registry_add(&server->registry, TRACE_NAME, strlen(TRACE_NAME), trace_handler, 0);
+    trace_configure();
     freeaddrinfo(res);
     return server;
 }
 
-/*
- * Server register a function.
- * Create handle for the handler and add to handle list of server.
- * Return the number of handles currently.
- * Return -1 with invalid input.
+/* FNV-1a hash of a function name.
  * */
-int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
-
-    /* Error handling */
-    if (srv == NULL || name == NULL || handler == NULL) {
-        return -1;
+uint32_t hash_name(const char *name, size_t name_len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < name_len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    /* Create handle */
-    rpc_handle *handle = (rpc_handle *) malloc(sizeof(rpc_handle));
-    if (handle == NULL) {
+/* Sets up an empty registry.
+ * */
+void registry_init(rpc_registry *reg) {
+    memset(reg, 0, sizeof(rpc_registry));
+    reg->slots = calloc(REGISTRY_INIT_SLOTS, sizeof(registry_slot));
+    if (reg->slots == NULL) {
         exit(EXIT_FAILURE);
     }
+    reg->mask = REGISTRY_INIT_SLOTS - 1;
+}
 
-    /* Store variables in handle */
-    size_t namelen = strlen(name) + 1;
-    strncpy(handle->name, name, namelen);
-    handle->function = handler;
-    handle->next = NULL;
-
-    /* Add the handle to the server's list of handles */
-    if (srv->handles_head == NULL) {
-        srv->handles_head = handle;
-    } else {
-        rpc_handle *current = srv->handles_head;
-        while (current->next != NULL) {
-            /* Replace if found repeated function */
-            if (strcmp(current->next->name, handle->name) == 0) {
-                rpc_handle *next = current->next->next;
-                current->next = handle;
-                handle->next = next;
-                srv->num_handles += 1;
-                return srv->num_handles;
-            }
-            current = current->next;
-        }
-        current->next = handle;
-    }
-    srv->num_handles += 1;
-    return srv->num_handles;
+/* Frees the memory of a registry.
+ * */
+void registry_free(rpc_registry *reg) {
+    free(reg->slots);
+    free(reg->entries);
+    free(reg->names);
 }
 
-/* Server handles a client.
- * Server receives a command, and send back signal or data with corresponding client call.
+/* Publishes a copy of the registry for lookups, and frees the copies it
+ * replaced that no reader can still be using. Called with registry_lock
+ * held, once serving.
  * */
-void* rpc_handle_client(void* serv) {
-    rpc_server* srv = (rpc_server*) serv;
-    int client_socket = srv->new_socket_fd;
+void registry_publish(rpc_server *srv) {
+    rpc_registry *reg = malloc(sizeof(rpc_registry));
+    if (reg == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    registry_copy(reg, &srv->registry);
 
-    while (1) {
-        char *buffer = malloc(MAX_BYTES);
-        if (buffer == NULL) {
+    /* A reader whose epoch is later than the one the old copy is retired
+     * in entered after it was replaced, so cannot be using it */
+    rpc_registry *old = atomic_exchange(&srv->published, reg);
+    if (old != NULL) {
+        retired_registry *r = malloc(sizeof(retired_registry));
+        if (r == NULL) {
             exit(EXIT_FAILURE);
         }
+        r->registry = old;
+        r->epoch = atomic_fetch_add(&srv->epoch, 1);
+        r->next = srv->retired;
+        srv->retired = r;
+    }
 
-        /* Read request from client */
-        int num_bytes = read(client_socket, buffer, MAX_BYTES);
-        if (num_bytes == -1) {
-            free(buffer);
-            return NULL;
-        } else if (num_bytes == 0) {
-            free(buffer);
-            return NULL;
+    uint64_t oldest = UINT64_MAX;
+    for (registry_reader *reader = srv->readers; reader != NULL; reader = reader->next) {
+        uint64_t epoch = atomic_load(&reader->epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
         }
-        buffer[num_bytes] = '\0';
+    }
+    retired_registry **link = &srv->retired;
+    while (*link != NULL) {
+        retired_registry *r = *link;
+        if (r->epoch < oldest) {
+            *link = r->next;
+            registry_free(r->registry);
+            free(r->registry);
+            free(r);
+        } else {
+            link = &r->next;
+        }
+    }
+}
 
-        /* Getting command */
-        char *command, *saveptr;
-        command = strtok_r(buffer, " ", &saveptr);
+/* Starts looking functions up in the published registry, which stays
+ * valid until registry_exit even if a registration replaces it meanwhile.
+ * The thread only announces the epoch it entered in, on a reader of its
+ * own claimed on its first lookup. Lookups may nest, as when a handler
+ * run inline reports the registry, and keep the outermost epoch.
+ * */
+rpc_registry *registry_enter(rpc_server *srv, registry_reader **reader) {
+    registry_reader *r = pthread_getspecific(srv->reader_key);
+    if (r == NULL) {
+        pthread_mutex_lock(&srv->registry_lock);
+        for (r = srv->readers; r != NULL && r->in_use; r = r->next) {
+        }
+        if (r == NULL) {
+            r = calloc(1, sizeof(registry_reader));
+            if (r == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            r->srv = srv;
+            r->next = srv->readers;
+            srv->readers = r;
+        }
+        r->in_use = 1;
+        pthread_mutex_unlock(&srv->registry_lock);
+        pthread_setspecific(srv->reader_key, r);
+    }
 
-        /* If client called rpc_find */
-        if (strcmp(command, "FIND") == 0) {
-            char *name = strtok_r(NULL, " ", &saveptr);
+    /* Sequentially consistent, so a registration either sees this epoch
+     * or has already published the registry loaded next */
+    if (r->depth++ == 0) {
+        atomic_store(&r->epoch, atomic_load(&srv->epoch));
+    }
+    *reader = r;
+    return atomic_load(&srv->published);
+}
 
-            /* Finding handler */
-            rpc_handle *handle = NULL;
-            rpc_handle *curr = srv->handles_head;
-            while (curr != NULL) {
-                if (strcmp(curr->name, name) == 0) {
-                    handle = curr;
-                    break;
-                }
-                curr = curr->next;
-            }
-            if (handle == NULL) {
-                char *null = "NULL";
-                int bytes_sent = write(client_socket, null, strlen(null));
-                if (bytes_sent < 0) {
-                    continue;
-                }
-            }
-            /* Send signal to the client */
-            if (handle != NULL) {
-                char *handle_str = "YESS";
-                int bytes_sent = write(client_socket, handle_str, strlen(handle_str));
-                if (bytes_sent < 0) {
-                    continue;
-                }
-            }
+/* Ends the lookups started by registry_enter.
+ * */
+void registry_exit(registry_reader *reader) {
+    if (--reader->depth == 0) {
+        atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+    }
+}
 
-        /* If client called rpc_call */
-        } else if (strcmp(command, "CALL") == 0) {
-            uint32_t func_len_nwb;
-            num_bytes = read(client_socket, &func_len_nwb, sizeof(uint32_t));
-            if (num_bytes == 0) {
-                continue;
-            }
-            size_t func_len = (size_t) ntohl(func_len_nwb);
-
-            char *func_name = malloc(func_len + 1);
-            read(client_socket, func_name, func_len);
-            func_name[func_len] = '\0';
-            rpc_data data;
-            receive_data(client_socket, &data);
-
-            /* Finding handler */
-            rpc_handle *handle = NULL;
-            rpc_handle *curr = srv->handles_head;
-            while (curr != NULL) {
-                if (strcmp(curr->name, func_name) == 0) {
-                    handle = curr;
-                    break;
-                }
-                curr = curr->next;
-            }
+/* Key destructor of reader_key: frees a thread's reader for the next
+ * thread.
+ * */
+void reader_release(void *arg) {
+    registry_reader *reader = (registry_reader *) arg;
+    pthread_mutex_lock(&reader->srv->registry_lock);
+    reader->in_use = 0;
+    pthread_mutex_unlock(&reader->srv->registry_lock);
+}
 
-            /* Handle does not exist */
-            if (handle == NULL) {
-                char *null = "NULL";
-                int bytes_sent = write(client_socket, null, strlen(null));
-                if (bytes_sent < 0) {
-                    continue;
-                }
-                continue;
-            }
-            rpc_data* result = handle->function(&data);
-            if (result == NULL) {
-                char *null = "NULL";
-                int bytes_sent = write(client_socket, null, strlen(null));
-                if (bytes_sent < 0) {
-                    continue;
-                }
-            }
-            if (result != NULL) {
-                char *command_data = "DATA";
-                if (send_data(client_socket, result, command_data) == 1) {
-                    char *null = "NULL";
-                    int bytes_sent = write(client_socket, null, strlen(null));
-                    if (bytes_sent < 0) {
-                        continue;
-                    }
-                }
+/* Looks up a registered function by name.
+ * Returns NULL if the function does not exist.
+ * */
+rpc_entry *registry_find(rpc_registry *reg, const char *name, size_t name_len) {
+    uint32_t hash = hash_name(name, name_len);
+    size_t i = hash & reg->mask;
+    while (reg->slots[i].entry != 0) {
+        if (reg->slots[i].hash == hash) {
+            rpc_entry *entry = &reg->entries[reg->slots[i].entry - 1];
+            if (entry->name_len == name_len &&
+                memcmp(reg->names + entry->name_off, name, name_len) == 0) {
+                return entry;
             }
         }
-        free(buffer);
+        i = (i + 1) & reg->mask;
     }
+    return NULL;
 }
 
-/* This function is responsible for accepting client connection and
- * creating a new thread for each client.
+/* Inserts an entry index into the registry index.
  * */
-void rpc_serve_all(rpc_server *srv) {
-    struct sockaddr_in6 client_addr;
-    socklen_t client_addr_length;
-    int socket_fd = srv->srv_socket;
-
-    /* Server starts listening */
-    if (listen(socket_fd, 5) < 0) {
-        perror("server listen");
-        exit(EXIT_FAILURE);
+void registry_index(registry_slot *slots, size_t mask, uint32_t hash, uint32_t entry) {
+    size_t i = hash & mask;
+    while (slots[i].entry != 0) {
+        i = (i + 1) & mask;
     }
+    slots[i].hash = hash;
+    slots[i].entry = entry;
+}
 
-    while (1) {
-        client_addr_length = sizeof(client_addr);
-        pthread_t thread_id;
-        int new_socket_fd;
+/* Adds a new function to the registry, growing the index to keep it at
+ * most half full.
+ * */
+void registry_add(rpc_registry *reg, const char *name, size_t name_len, rpc_handler handler, uint32_t flags) {
 
-        /* Accept connections */
-        new_socket_fd = accept(socket_fd, (struct sockaddr*)&client_addr, &client_addr_length);
-        if (new_socket_fd < 0) {
-            continue;
-        } else {
-            srv->new_socket_fd = new_socket_fd;
+    /* Intern the name */
+    if (reg->names_len + name_len + 1 > reg->names_cap) {
+        size_t cap = reg->names_cap == 0 ? MAX_BYTES : reg->names_cap * 2;
+        while (cap < reg->names_len + name_len + 1) {
+            cap *= 2;
         }
-        if (pthread_create(&thread_id, NULL, rpc_handle_client, srv) < 0) {
-            close(new_socket_fd);
-            continue;
+        reg->names = realloc(reg->names, cap);
+        if (reg->names == NULL) {
+            exit(EXIT_FAILURE);
         }
-        if (pthread_detach(thread_id) < 0) {
-            close(new_socket_fd);
-            continue;
+        reg->names_cap = cap;
+    }
+    memcpy(reg->names + reg->names_len, name, name_len + 1);
+
+    /* Create the entry */
+    if (reg->num_entries == reg->entries_cap) {
+        reg->entries_cap = reg->entries_cap == 0 ? REGISTRY_INIT_SLOTS / 2 : reg->entries_cap * 2;
+        reg->entries = realloc(reg->entries, reg->entries_cap * sizeof(rpc_entry));
+        if (reg->entries == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    rpc_entry *entry = &reg->entries[reg->num_entries];
+    entry->hash = hash_name(name, name_len);
+    entry->name_off = reg->names_len;
+    entry->name_len = name_len;
+    entry->function = handler;
+    entry->async = NULL;
+    entry->flags = flags;
+    entry->installed = 0;
+    reg->names_len += name_len + 1;
+    reg->num_entries += 1;
+
+    /* Rehash into a larger index when more than half full */
+    if (reg->num_entries * 2 > reg->mask + 1) {
+        size_t num_slots = (reg->mask + 1) * 2;
+        registry_slot *slots = calloc(num_slots, sizeof(registry_slot));
+        if (slots == NULL) {
+            exit(EXIT_FAILURE);
         }
+        for (size_t i = 0; i < reg->num_entries; i++) {
+            registry_index(slots, num_slots - 1, reg->entries[i].hash, i + 1);
+        }
+        free(reg->slots);
+        reg->slots = slots;
+        reg->mask = num_slots - 1;
+    } else {
+        registry_index(reg->slots, reg->mask, entry->hash, reg->num_entries);
     }
 }
 
-/* Create and return a client with corresponding port number and address.
+/* Copies a registry, to publish for lookups, or for a loop to look
+ * functions up in memory of its own.
  * */
-rpc_client *rpc_init_client(char *addr, int port) {
-    int sockfd, s;
-    struct addrinfo hints, *servinfo, *rp;
-    char port_str[10];
-    sprintf(port_str, "%d", port);
-
-    /* Create address */
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET6;
-    hints.ai_socktype = SOCK_STREAM;
-
-    s = getaddrinfo(addr, port_str, &hints, &servinfo);
-    if (s != 0) {
-        perror("getaddrinfo");
+void registry_copy(rpc_registry *dst, const rpc_registry *src) {
+    *dst = *src;
+    dst->slots = malloc((src->mask + 1) * sizeof(registry_slot));
+    dst->entries = malloc(src->entries_cap * sizeof(rpc_entry));
+    dst->names = malloc(src->names_cap);
+    if (dst->slots == NULL || dst->entries == NULL || dst->names == NULL) {
         exit(EXIT_FAILURE);
     }
+    memcpy(dst->slots, src->slots, (src->mask + 1) * sizeof(registry_slot));
+    memcpy(dst->entries, src->entries, src->num_entries * sizeof(rpc_entry));
+    memcpy(dst->names, src->names, src->names_len);
+}
 
-    /* Connect to first valid result */
-    for (rp = servinfo; rp != NULL; rp = rp->ai_next) {
-        sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sockfd == -1)
-            continue;
-        if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
-            break;
-        close(sockfd);
-    }
-    if (rp == NULL) {
-        perror("failed to connect");
-        exit(EXIT_FAILURE);
+/*
+ * Server register a function.
+ * Add the handler to the server's registry, replacing the handler of a
+ * function registered under the same name, also while serving.
+ * Return the number of functions currently registered, not counting
+ * built-in ones.
+ * Return -1 with invalid input, a reserved name, or when a function that
+ * streams would be replaced by one that does not, or the other way round,
+ * while serving.
+ * */
+int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
+    return rpc_register_flags(srv, name, handler, 0);
+}
+
+/* Server register a function with flags, as rpc_register does.
+ * */
+int rpc_register_flags(rpc_server *srv, char *name, rpc_handler handler, unsigned flags) {
+    if (handler == NULL || (flags & FUNC_STREAM)) {
+        return -1;
     }
+    return register_function(srv, name, handler, NULL, flags);
+}
 
-    /* Create client */
-    rpc_client *client =  (rpc_client *) malloc(sizeof(rpc_client));
-    if (client == NULL) {
-        exit(EXIT_FAILURE);
+/* Server registers a function whose handler finishes its calls later,
+ * with rpc_complete.
+ * Returns as rpc_register.
+ * */
+int rpc_register_async(rpc_server *srv, char *name, rpc_async_handler handler, unsigned flags) {
+    if (handler == NULL || (flags & FUNC_STREAM)) {
+        return -1;
     }
-    client->cli_socket = sockfd;
-    client->addr = strdup(addr);
-    client->port = port;
-    client->server_addr = servinfo;
-    return client;
+    return register_function(srv, name, NULL, handler, flags);
 }
 
-/* Client find a server function with corresponding name.
- * Returns a handle if the function exists in server.
+/* Server registers a function whose handler sends its results as a
+ * stream of items. Its results are never cached.
+ * Returns as rpc_register.
  * */
-rpc_handle *rpc_find(rpc_client *cl, char *name) {
-    if (cl == NULL || name == NULL) {
-        return NULL;
+int rpc_register_stream(rpc_server *srv, char *name, rpc_async_handler handler, unsigned flags) {
+    if (handler == NULL || (flags & (RPC_PURE | FUNC_STREAM))) {
+        return -1;
     }
+    return register_function(srv, name, NULL, handler, flags | FUNC_STREAM);
+}
 
-    /* Sending command and function name to server */
-    char *command = calloc(MAX_BYTES, sizeof(char));
-    if (command == NULL) {
-        exit(EXIT_FAILURE);
+/* Add a function to the registry with either a handler or an asynchronous
+ * one, or replace the handlers of the function of the same name. Once
+ * serving, the change is published as a new copy of the registry: calls
+ * already parsed finish with the handlers they were parsed with, and the
+ * results a replaced pure function left in the cache are never hit.
+ * */
+int register_function(rpc_server *srv, char *name, rpc_handler handler, rpc_async_handler async, unsigned flags) {
+
+    /* Error handling */
+    if (srv == NULL || name == NULL || (flags & ~(RPC_NO_COMPRESS | RPC_PURE | FUNC_STREAM)) != 0) {
+        return -1;
+    }
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len >= MAX_BYTES) {
+        return -1;
+    }
+    if (strncmp(name, RESERVED_PREFIX, strlen(RESERVED_PREFIX)) == 0) {
+        return -1;
     }
-    char *find = "FIND ";
-    strcat(command, find);
-    strcat(command, name);
-    int sockfd = cl->cli_socket;
-    int len = strlen(command);
-    write(sockfd, command, len);
 
-    /* Receiving signal from server */
-    char header[HEADER_LEN + 1] = {0};
-    rpc_handle *handle = (rpc_handle *) malloc(sizeof(rpc_handle));
-    if (handle == NULL) {
-        exit(EXIT_FAILURE);
+    /* Replace if found repeated function. Clients hold handles whose
+     * flags say whether the function streams, which must stay true */
+    pthread_mutex_lock(&srv->registry_lock);
+    rpc_entry *entry = registry_find(&srv->registry, name, name_len);
+    if (entry != NULL && srv->serving && (entry->flags & FUNC_STREAM) != (flags & FUNC_STREAM)) {
+        pthread_mutex_unlock(&srv->registry_lock);
+        return -1;
+    }
+    if (entry == NULL) {
+        registry_add(&srv->registry, name, name_len, handler, flags);
+        entry = &srv->registry.entries[srv->registry.num_entries - 1];
+    }
+    entry->function = handler;
+    entry->async = async;
+    entry->flags = flags;
+    entry->installed = ++srv->registry.generation;
+    if (srv->serving) {
+        cache_init(srv);
+        registry_publish(srv);
     }
+    int registered = srv->registry.num_entries - NUM_BUILTINS;
+    pthread_mutex_unlock(&srv->registry_lock);
+    return registered;
+}
 
-    while (1) {
-        int num_bytes = read(sockfd, header, HEADER_LEN);
-        if (num_bytes > 0) {
-            header[HEADER_LEN] = '\0';
-            if (strcmp(header, "NULL") == 0) {
-                free(command);
-                return NULL;
-            }
-            size_t namelen = strlen(name) + 1;
-            strncpy(handle->name, name, namelen);
-            handle->function = NULL;
-            handle->next = NULL;
-            free(command);
-            return handle;
-        } else {
-            return NULL;
+static __thread int io_thread;      // set on threads that parse connections' frames
+static __thread rpc_loop *current_loop;
+static atomic_size_t io_syscalls;
+static atomic_size_t wire_bytes;
+
+/* Queue bytes to be sent to a client connection.
+ * */
+void conn_queue(rpc_conn *conn, const void *bytes, size_t len) {
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = conn->out_cap == 0 ? READ_CHUNK : conn->out_cap;
+        while (cap < conn->out_len + len) {
+            cap *= 2;
+        }
+        conn->out = realloc(conn->out, cap);
+        if (conn->out == NULL) {
+            exit(EXIT_FAILURE);
         }
+        conn->out_cap = cap;
     }
+    memcpy(conn->out + conn->out_len, bytes, len);
+    conn->out_len += len;
 }
 
-/* Client call a server function with given data.
- * Returns a data if the procedure is called successfully.
+/* Send as much queued output as the socket accepts without blocking.
+ * Returns -1 if the connection is broken.
  * */
-rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
-    int sockfd = cl->cli_socket;
-    /* Safety handling */
-    if (cl == NULL || h == NULL || payload == NULL) {
-        return NULL;
-    }
-    if ((payload->data2 == NULL && payload->data2_len != 0) || (payload->data2 != NULL && payload->data2_len == 0)) {
-        return NULL;
+int conn_flush(rpc_conn *conn) {
+    if (conn->flight_len != 0) {
+        /* The loop sends the rest once the kernel is done with its flight */
+        return 0;
     }
-    if (payload->data2_len > MAX_DATA) {
-        perror("Overlength error");
-        exit(EXIT_FAILURE);
+    if (conn->shm != NULL && conn->out_off < conn->out_len) {
+        /* The client frees room in the ring as it reads, and wakes the loop
+         * to flush again if replies are held. Having said so, try once
+         * more, in case the client read everything just before */
+        shm_region *shm = conn->shm;
+        size_t num_bytes = ring_put(&shm->replies, conn->out + conn->out_off, conn->out_len - conn->out_off);
+        conn->out_off += num_bytes;
+        if (conn->out_off < conn->out_len) {
+            __atomic_store_n(&shm->replies_held, 1, __ATOMIC_SEQ_CST);
+            size_t more = ring_put(&shm->replies, conn->out + conn->out_off, conn->out_len - conn->out_off);
+            conn->out_off += more;
+            num_bytes += more;
+        }
+        if (num_bytes > 0) {
+            shm_wake(&shm->client_bell);
+        }
+        if (conn->out_off < conn->out_len) {
+            return __atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE) ? -1 : 0;
+        }
+        __atomic_store_n(&shm->replies_held, 0, __ATOMIC_RELAXED);
     }
-
-    /* Sending call command */
-    char* command = "CALL";
-    write(sockfd, command, strlen(command) + 1);
-    size_t func_len = strlen(h->name);
-    uint32_t func_len_nwb = htonl((uint32_t) func_len);
-    write(sockfd, &func_len_nwb, sizeof(uint32_t));
-    write(sockfd, h->name, strlen(h->name));
-    if (send_data(sockfd, payload, NULL) == 1) {
-        return NULL;
+    while (conn->out_off < conn->out_len) {
+        ssize_t num_bytes = send(conn->socket, conn->out + conn->out_off,
+                                 conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        atomic_fetch_add_explicit(&io_syscalls, 1, memory_order_relaxed);
+        if (num_bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Edge-triggered EPOLLOUT will resume the flush */
+                return 0;
+            }
+            return -1;
+        }
+        conn->out_off += num_bytes;
     }
+    conn->out_off = 0;
+    conn->out_len = 0;
+    return 0;
+}
 
-    /* Receiving result from server */
+/* Read everything currently available on a client socket.
+ * A short read means the socket is drained, and edge-triggered epoll reports
+ * the next arrival, so only a hang-up needs reading on to end of stream.
+ * A Unix socket also ends reads at passed descriptors, so it is read until
+ * it would block.
+ * Returns -1 if the connection is closed or broken.
+ * */
+int conn_fill(rpc_conn *conn, int hangup) {
     while (1) {
-        char* header = (char*) malloc( HEADER_LEN * sizeof(char));
-        int num_bytes = read(sockfd, header, HEADER_LEN);
-        header[4] = '\0';
-        if (num_bytes > 0) {
-            if (strcmp("NULL", header) == 0) {
-                free(header);
-                return NULL;
+        if (conn->in_cap - conn->in_len < READ_CHUNK) {
+            conn->in_cap = conn->in_len + READ_CHUNK;
+            conn->in = realloc(conn->in, conn->in_cap);
+            if (conn->in == NULL) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        size_t room = conn->in_cap - conn->in_len;
+        ssize_t num_bytes;
+        if (conn->unix_socket) {
+            num_bytes = recv_fds(conn->socket, conn->in + conn->in_len, room, 0, &conn->fds);
+        } else {
+            num_bytes = recv(conn->socket, conn->in + conn->in_len, room, 0);
+        }
+        atomic_fetch_add_explicit(&io_syscalls, 1, memory_order_relaxed);
+        if (num_bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
             }
-            rpc_data* result = (rpc_data*) malloc(sizeof(rpc_data));
-            receive_data(sockfd, result);
-            return result;
+            return -1;
+        } else if (num_bytes == 0) {
+            return -1;
+        }
+        conn->in_len += num_bytes;
+        atomic_fetch_add_explicit(&conn->bytes_in, num_bytes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&wire_bytes, num_bytes, memory_order_relaxed);
+        if ((size_t) num_bytes < room && !hangup && !conn->unix_socket) {
+            return 0;
         }
-        free(header);
     }
 }
 
-/* This function closes the client socket and frees the client address.
+/* Send a frame on the connection with a single sendmsg, queueing whatever
+ * the socket does not take. If earlier frames are still queued the frame
+ * is queued behind them instead. A loop on io_uring only queues it, and
+ * sends everything it queued for the connection at once when it is done.
  * */
-void rpc_close_client(rpc_client *cl) {
-    if (cl == NULL) {
-        return;
-    }
+void conn_sendv(rpc_conn *conn, struct iovec *iov, int iovcnt) {
+    size_t sent = 0;
+    size_t len = 0;
 
-    /* Close client socket */
-    if (cl->cli_socket != -1) {
-        close(cl->cli_socket);
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
     }
+    atomic_fetch_add_explicit(&conn->bytes_out, len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&wire_bytes, len, memory_order_relaxed);
 
-    /* Free client address */
-    if (cl->addr != NULL) {
-        free(cl->addr);
+    pthread_mutex_lock(&conn->out_lock);
+    int queued = conn->out_len != 0 || conn->flight_len != 0;
+    int deferred = current_loop != NULL && current_loop == conn->loop && current_loop->ring != NULL &&
+                   conn->shm == NULL;
+    if (deferred) {
+        /* Queued below */
+    } else if (!queued && conn->shm != NULL) {
+        for (int i = 0; i < iovcnt; i++) {
+            size_t num_bytes = ring_put(&conn->shm->replies, iov[i].iov_base, iov[i].iov_len);
+            sent += num_bytes;
+            if (num_bytes < iov[i].iov_len) {
+                break;
+            }
+        }
+        shm_wake(&conn->shm->client_bell);
+    } else if (!queued) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t num_bytes;
+        do {
+            num_bytes = sendmsg(conn->socket, &msg, MSG_NOSIGNAL);
+            atomic_fetch_add_explicit(&io_syscalls, 1, memory_order_relaxed);
+        } while (num_bytes < 0 && errno == EINTR);
+        if (num_bytes > 0) {
+            sent = num_bytes;
+        }
+    }
+
+    /* Queue the rest for EPOLLOUT */
+    for (int i = 0; i < iovcnt; i++) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        conn_queue(conn, (char *) iov[i].iov_base + sent, iov[i].iov_len - sent);
+        sent = 0;
+    }
+    if ((queued || conn->shm != NULL) && !deferred) {
+        conn_flush(conn);
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+}
+
+/* Send a frame with no body on the connection.
+ * */
+void conn_signal(rpc_conn *conn, uint32_t id, uint8_t op) {
+    char frame[FRAME_HEADER_LEN];
+    if (op == OP_NULL) {
+        atomic_fetch_add_explicit(&conn->errors, 1, memory_order_relaxed);
+    }
+    frame_header hdr = {.len = 0, .op = op, .flags = 0, .id = id};
+    encode_frame_header(frame, &hdr);
+
+    struct iovec iov = {.iov_base = frame, .iov_len = FRAME_HEADER_LEN};
+    conn_sendv(conn, &iov, 1);
+}
+
+/* Send a YESS reply: a function id and its flags for FIND, or the accepted
+ * capabilities and 0 for HELLO, then the registry's generation.
+ * */
+void conn_yess(rpc_conn *conn, uint32_t id, uint32_t value, uint32_t flags, uint64_t generation) {
+    char frame[FRAME_HEADER_LEN + YESS_LEN];
+    frame_header hdr = {.len = YESS_LEN, .op = OP_YESS, .flags = 0, .id = id};
+    encode_frame_header(frame, &hdr);
+    uint32_t value_nwb = htonl(value);
+    uint32_t flags_nwb = htonl(flags);
+    uint64_t generation_nwb = htobe64(generation);
+    memcpy(frame + FRAME_HEADER_LEN, &value_nwb, sizeof(uint32_t));
+    memcpy(frame + FRAME_HEADER_LEN + sizeof(uint32_t), &flags_nwb, sizeof(uint32_t));
+    memcpy(frame + FRAME_HEADER_LEN + 2 * sizeof(uint32_t), &generation_nwb, sizeof(uint64_t));
+
+    struct iovec iov = {.iov_base = frame, .iov_len = sizeof(frame)};
+    conn_sendv(conn, &iov, 1);
+}
+
+/* Answer LIST with the registry's generation, followed by the id, flags
+ * and name of every function unless known is already that generation, all
+ * in one TABLE frame. A registry too large for a frame is answered NULL.
+ * */
+void conn_list(rpc_conn *conn, rpc_registry *reg, uint32_t id, uint64_t known) {
+    int changed = known == 0 || known != reg->generation;
+    size_t len = sizeof(uint64_t);
+    if (changed) {
+        len += sizeof(uint32_t);
+        for (size_t i = 0; i < reg->num_entries; i++) {
+            len += TABLE_ENTRY_LEN + reg->entries[i].name_len;
+        }
+    }
+    if (len > MAX_FRAME) {
+        conn_signal(conn, id, OP_NULL);
+        return;
+    }
+
+    char *frame = pool_alloc(FRAME_HEADER_LEN + len);
+    frame_header hdr = {.len = len, .op = OP_TABLE, .flags = 0, .id = id};
+    encode_frame_header(frame, &hdr);
+    char *p = frame + FRAME_HEADER_LEN;
+    uint64_t generation_nwb = htobe64(reg->generation);
+    memcpy(p, &generation_nwb, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    if (changed) {
+        uint32_t count_nwb = htonl(reg->num_entries);
+        memcpy(p, &count_nwb, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        for (size_t i = 0; i < reg->num_entries; i++) {
+            rpc_entry *entry = &reg->entries[i];
+            uint32_t id_nwb = htonl(i);
+            uint32_t flags_nwb = htonl(entry->flags);
+            uint16_t name_len_nwb = htons(entry->name_len);
+            memcpy(p, &id_nwb, sizeof(uint32_t));
+            memcpy(p + sizeof(uint32_t), &flags_nwb, sizeof(uint32_t));
+            memcpy(p + 2 * sizeof(uint32_t), &name_len_nwb, sizeof(uint16_t));
+            memcpy(p + TABLE_ENTRY_LEN, reg->names + entry->name_off, entry->name_len);
+            p += TABLE_ENTRY_LEN + entry->name_len;
+        }
+    }
+
+    struct iovec iov = {.iov_base = frame, .iov_len = FRAME_HEADER_LEN + len};
+    conn_sendv(conn, &iov, 1);
+    pool_free(frame);
+}
+
+/* Shut down a connection whose client stopped reading in the middle of a
+ * large reply. The event loop then closes it, and the client fails the
+ * calls it has in flight.
+ * */
+void conn_abandon(rpc_conn *conn) {
+    if (conn->shm != NULL) {
+        __atomic_store_n(&conn->shm->closed, 1, __ATOMIC_RELEASE);
+        shm_wake(&conn->shm->client_bell);
+        shm_wake(&conn->shm->server_bell);
+    }
+    shutdown(conn->socket, SHUT_RDWR);
+}
+
+/* Wait until the connection's queued output drops below OUT_HIGH_WATER,
+ * flushing it from this thread. Lets a large reply stream out in chunks
+ * instead of being copied whole into the output buffer. The threads that
+ * parse a connection's frames never wait, since every other connection on
+ * the loop would wait with them, and a loop on io_uring only completes its
+ * own sends; conn_reply_large has them hold a large reply instead.
+ * A worker waits until the call's deadline, or for SEND_TIMEOUT_MS without
+ * progress if it has none, and then gives up on a client that stopped
+ * reading by shutting the connection down, since the rest of the reply
+ * can no longer follow.
+ * Returns -1 if the connection is broken.
+ * */
+int conn_wait_room(rpc_conn *conn, uint64_t deadline) {
+    if (io_thread) {
+        return 0;
+    }
+    uint64_t until = deadline != 0 ? deadline : stats_clock() + SEND_TIMEOUT_MS * 1000000ULL;
+    pthread_mutex_lock(&conn->out_lock);
+    while (conn->out_len - conn->out_off > OUT_HIGH_WATER) {
+        int flying = conn->flight_len != 0;
+        pthread_mutex_unlock(&conn->out_lock);
+        uint64_t now = stats_clock();
+        if (now >= until) {
+            conn_abandon(conn);
+            return -1;
+        }
+        if (conn->shm != NULL) {
+            if (shm_wait(conn->shm, &conn->shm->server_bell, &conn->shm->replies, 1, until) < 0) {
+                return -1;
+            }
+        } else {
+            /* The socket may be writable while the loop's SEND is still in
+             * flight, so check back soon rather than spin */
+            int timeout = (int) ((until - now + 999999) / 1000000);
+            struct pollfd pfd = {.fd = conn->socket, .events = POLLOUT};
+            if (poll(&pfd, 1, flying && timeout > 1 ? 1 : timeout) < 0 && errno != EINTR) {
+                return -1;
+            }
+            if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                return -1;
+            }
+        }
+        pthread_mutex_lock(&conn->out_lock);
+        size_t queued = conn->out_len - conn->out_off;
+        if (conn_flush(conn) < 0) {
+            pthread_mutex_unlock(&conn->out_lock);
+            return -1;
+        }
+        if (deadline == 0 && conn->out_len - conn->out_off < queued) {
+            until = stats_clock() + SEND_TIMEOUT_MS * 1000000ULL;
+        }
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+    return 0;
+}
+
+/* Send the n bytes of data2 at data as a CHUNK frame of call id, compressed
+ * where that pays off unless zipped is NULL.
+ * */
+void conn_send_chunk(rpc_conn *conn, uint32_t id, const char *data, size_t n, zip_stats *zipped) {
+    char chunk[FRAME_HEADER_LEN];
+    char *zip = NULL;
+    size_t zip_len = zipped != NULL ? zip_data2(data, n, &zip, zipped) : 0;
+    frame_header hdr = {.len = zip_len != 0 ? zip_len : n, .op = OP_CHUNK,
+                        .flags = zip_len != 0 ? FLAG_COMPRESSED : 0, .id = id};
+    encode_frame_header(chunk, &hdr);
+    struct iovec iov[2];
+    iov[0].iov_base = chunk;
+    iov[0].iov_len = FRAME_HEADER_LEN;
+    iov[1].iov_base = zip_len != 0 ? zip : (char *) data;
+    iov[1].iov_len = hdr.len;
+    conn_sendv(conn, iov, 2);
+    pool_free(zip);
+}
+
+/* Queue chunks of the large results the loop holds for the connection,
+ * oldest first, while its output stays below OUT_HIGH_WATER, and free each
+ * result once its last chunk is queued. The loop calls it whenever the
+ * connection's output drains: on EPOLLOUT, on an io_uring SEND completion
+ * or POLLOUT, and when a shared memory client makes room in the reply ring.
+ * The compression of these chunks is not counted in the call's metrics,
+ * which are recorded by then.
+ * */
+void conn_pump(rpc_conn *conn) {
+    while (conn->held != NULL && !conn->closing) {
+        pthread_mutex_lock(&conn->out_lock);
+        size_t queued = conn->out_len - conn->out_off;
+        pthread_mutex_unlock(&conn->out_lock);
+        if (queued > OUT_HIGH_WATER) {
+            return;
+        }
+        held_reply *held = conn->held;
+        rpc_data *result = held->result;
+        zip_stats zipped = {0, 0, 0};
+        size_t n = result->data2_len - held->off < CHUNK_SIZE ? result->data2_len - held->off : CHUNK_SIZE;
+        conn_send_chunk(conn, held->id, (char *) result->data2 + held->off, n, held->compress ? &zipped : NULL);
+        held->off += n;
+        if (held->off == result->data2_len) {
+            conn->held = held->next;
+            if (conn->held == NULL) {
+                conn->held_tail = NULL;
+            }
+            rpc_data_free(result);
+            pool_free(held);
+        }
+    }
+}
+
+/* Send a result larger than MAX_DATA as a DATA frame flagged FLAG_LARGE,
+ * followed by its data2 in CHUNK frames. Replies to other calls on the
+ * connection may go out between the chunks. Unless zipped is NULL, each
+ * chunk is compressed on its own where that pays off. The call's
+ * deadline, unless it is 0, bounds the wait for the client to take them.
+ * The connection's own loop cannot wait, so it keeps the result, which
+ * conn_pump sends as the output drains, however long the client takes.
+ * Returns 1 if the connection kept the result, and frees it once sent.
+ * */
+int conn_reply_large(rpc_conn *conn, uint32_t id, rpc_data *result, zip_stats *zipped, uint64_t deadline) {
+    char frame[FRAME_HEADER_LEN + LARGE_HEADER_LEN];
+    frame_header hdr = {.len = LARGE_HEADER_LEN, .op = OP_DATA, .flags = FLAG_LARGE, .id = id};
+    encode_frame_header(frame, &hdr);
+    encode_large(result->data1, result->data2_len, frame + FRAME_HEADER_LEN);
+    struct iovec iov = {.iov_base = frame, .iov_len = sizeof(frame)};
+    conn_sendv(conn, &iov, 1);
+
+    if (current_loop != NULL && current_loop == conn->loop) {
+        held_reply *held = pool_alloc(sizeof(held_reply));
+        held->id = id;
+        held->result = result;
+        held->off = 0;
+        held->compress = zipped != NULL;
+        held->next = NULL;
+        if (conn->held_tail != NULL) {
+            conn->held_tail->next = held;
+        } else {
+            conn->held = held;
+        }
+        conn->held_tail = held;
+        conn_pump(conn);
+        return 1;
+    }
+
+    for (size_t off = 0, n; off < result->data2_len; off += n) {
+        if (conn_wait_room(conn, deadline) < 0) {
+            break;
+        }
+        n = result->data2_len - off < CHUNK_SIZE ? result->data2_len - off : CHUNK_SIZE;
+        conn_send_chunk(conn, id, (char *) result->data2 + off, n, zipped);
+    }
+    return 0;
+}
+
+/* Send a result larger than MAX_DATA on a Unix socket connection as a DATA
+ * frame flagged FLAG_FD, with data2 in a sealed memfd passed alongside.
+ * The descriptor rides on the frame's first byte, so it is only sent when
+ * no earlier output is queued.
+ * Returns -1 if nothing was sent, and the result should go in chunks.
+ * */
+int conn_reply_fd(rpc_conn *conn, uint32_t id, rpc_data *result) {
+    int fd = memfd_from(result->data2, result->data2_len);
+    if (fd < 0) {
+        return -1;
+    }
+    char frame[FRAME_HEADER_LEN + FD_HEADER_LEN];
+    frame_header hdr = {.len = FD_HEADER_LEN, .op = OP_DATA, .flags = FLAG_FD, .id = id};
+    encode_frame_header(frame, &hdr);
+    encode_fd_header(result->data1, result->data2_len, 0, frame + FRAME_HEADER_LEN);
+    struct iovec iov = {.iov_base = frame, .iov_len = sizeof(frame)};
+
+    ssize_t sent = -1;
+    pthread_mutex_lock(&conn->out_lock);
+    conn_flush(conn);
+    if (conn->out_len == 0 && conn->flight_len == 0) {
+        sent = send_fd(conn->socket, &iov, 1, fd, 0);
+        atomic_fetch_add_explicit(&io_syscalls, 1, memory_order_relaxed);
+    }
+    if (sent > 0 && (size_t) sent < sizeof(frame)) {
+        conn_queue(conn, frame + sent, sizeof(frame) - sent);
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+    close(fd);
+    if (sent <= 0) {
+        return -1;
+    }
+    atomic_fetch_add_explicit(&conn->bytes_out, sizeof(frame), memory_order_relaxed);
+    atomic_fetch_add_explicit(&wire_bytes, sizeof(frame), memory_order_relaxed);
+    return 0;
+}
+
+/* Send a DATA frame of data1 and wire_len bytes of data2, in the compact
+ * encoding if the client takes it. data2_len is the size of data2 once
+ * decompressed if flags has FLAG_COMPRESSED.
+ * */
+void conn_send_data(rpc_conn *conn, uint32_t id, int data1, size_t data2_len, const void *wire, size_t wire_len,
+                    uint8_t flags) {
+    char frame[COMPACT_HEADER_MAX + COMPACT_BODY_MAX];
+    frame_header hdr = {.op = OP_DATA, .flags = flags, .id = id, .compact = conn->compact};
+    size_t room = frame_header_room(&hdr);
+
+    struct iovec iov[2];
+    iov[0].iov_base = frame;
+    iov[0].iov_len = room + encode_body(&hdr, frame + room, 0, data1, data2_len, wire_len);
+    encode_header_iov(iov, &hdr);
+    iov[1].iov_base = (void *) wire;
+    iov[1].iov_len = wire_len;
+    conn_sendv(conn, iov, wire_len != 0 ? 2 : 1);
+}
+
+/* Send the result of a call on the connection.
+ * A NULL or invalid result is sent as the NULL signal. The call's deadline,
+ * unless it is 0, bounds how long a large result waits for the client.
+ * If encoded is set, it receives the time the reply was ready to send.
+ * If zipped is set and the connection negotiated compression, data2 is
+ * compressed where that pays off, and the attempt counted in zipped.
+ * Returns -1 if the NULL signal was sent, and 1 if the connection kept a
+ * large result to send later, and frees it once sent.
+ * */
+int conn_reply(rpc_conn *conn, uint32_t id, rpc_data *result, uint64_t *encoded, zip_stats *zipped,
+               uint64_t deadline) {
+    if (!conn->compress || conn->shm != NULL) {
+        zipped = NULL;
+    }
+
+    if (result != NULL && result->data2 != NULL && result->data2_len > MAX_DATA) {
+        if (encoded != NULL) {
+            *encoded = stats_clock();
+        }
+        if (!conn->unix_socket || conn_reply_fd(conn, id, result) < 0) {
+            return conn_reply_large(conn, id, result, zipped, deadline);
+        }
+        return 0;
+    }
+
+    /* Server will not send invalid data back to client */
+    if (result == NULL || !data_valid(result)) {
+        if (encoded != NULL) {
+            *encoded = stats_clock();
+        }
+        conn_signal(conn, id, OP_NULL);
+        return -1;
+    }
+    char *zip = NULL;
+    size_t zip_len = zipped != NULL ? zip_data2(result->data2, result->data2_len, &zip, zipped) : 0;
+    if (encoded != NULL) {
+        *encoded = stats_clock();
+    }
+    conn_send_data(conn, id, result->data1, result->data2_len, zip_len != 0 ? zip : result->data2,
+                   zip_len != 0 ? zip_len : result->data2_len, zip_len != 0 ? FLAG_COMPRESSED : 0);
+    pool_free(zip);
+    return 0;
+}
+
+/* Frees a request and the payloads it owns.
+ * */
+void request_free(rpc_request *req) {
+    if (req->large) {
+        free_data2(req->data.data2);
+    }
+    pool_free(req->body);
+    pool_free(req->batch);
+    pool_free(req);
+}
+
+/* Drops a reference to a connection, closing it with the last one.
+ * */
+void conn_release(rpc_conn *conn) {
+    if (atomic_fetch_sub(&conn->refs, 1) != 1) {
+        return;
+    }
+    if (conn->large != NULL) {
+        request_free(conn->large);
+    }
+    while (conn->held != NULL) {
+        held_reply *held = conn->held;
+        conn->held = held->next;
+        rpc_data_free(held->result);
+        pool_free(held);
+    }
+    pthread_mutex_lock(&conn->srv->stats_lock);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else if (conn->srv->conns == conn) {
+        conn->srv->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&conn->srv->stats_lock);
+    if (conn->shm != NULL) {
+        munmap(conn->shm, sizeof(shm_region));
+    }
+    fd_queue_clear(&conn->fds);
+    close(conn->socket);
+    pthread_mutex_destroy(&conn->out_lock);
+    pthread_mutex_destroy(&conn->flow_lock);
+    pthread_cond_destroy(&conn->credited);
+    free(conn->in);
+    free(conn->out);
+    free(conn->flight);
+    free(conn);
+}
+
+/* Monotonic clock in nanoseconds.
+ * */
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Hands a thread's shard to the next thread that runs calls.
+ * */
+void stats_release(void *arg) {
+    stats_shard *shard = (stats_shard *) arg;
+    pthread_mutex_lock(&shard->srv->stats_lock);
+    shard->in_use = 0;
+    pthread_mutex_unlock(&shard->srv->stats_lock);
+}
+
+/* Metrics of a handler in the calling thread's shard, claiming a shard
+ * left by an exited thread or adding one on the thread's first call.
+ * */
+handler_stats *stats_local(rpc_server *srv, uint32_t func_id) {
+    stats_shard *shard = pthread_getspecific(srv->stats_key);
+    if (shard == NULL) {
+        pthread_mutex_lock(&srv->stats_lock);
+        for (shard = srv->shards; shard != NULL && shard->in_use; shard = shard->next) {
+        }
+        if (shard == NULL) {
+            shard = calloc(1, sizeof(stats_shard));
+            if (shard == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            shard->srv = srv;
+            shard->next = srv->shards;
+            srv->shards = shard;
+        }
+        shard->in_use = 1;
+        pthread_mutex_unlock(&srv->stats_lock);
+        pthread_setspecific(srv->stats_key, shard);
+    }
+    if (func_id >= shard->num_handlers) {
+        stats_grow(srv, shard, func_id + 1);
+    }
+
+    handler_stats *hs = atomic_load_explicit(&shard->handlers[func_id], memory_order_acquire);
+    if (hs == NULL) {
+        hs = calloc(1, sizeof(handler_stats));
+        if (hs == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        hist_init(&hs->latency);
+        atomic_store_explicit(&shard->handlers[func_id], hs, memory_order_release);
+    }
+    return hs;
+}
+
+/* Make room in a shard for the metrics of function ids below
+ * num_handlers, which grows as functions are registered while serving.
+ * Only the owning thread writes handlers, under stats_lock since
+ * stats_report reads it.
+ * */
+void stats_grow(rpc_server *srv, stats_shard *shard, size_t num_handlers) {
+    size_t cap = shard->num_handlers == 0 ? REGISTRY_INIT_SLOTS / 2 : shard->num_handlers;
+    while (cap < num_handlers) {
+        cap *= 2;
+    }
+    _Atomic(handler_stats *) *handlers = calloc(cap, sizeof(handler_stats *));
+    if (handlers == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < shard->num_handlers; i++) {
+        atomic_init(&handlers[i], atomic_load_explicit(&shard->handlers[i], memory_order_relaxed));
+    }
+    pthread_mutex_lock(&srv->stats_lock);
+    free(shard->handlers);
+    shard->handlers = handlers;
+    shard->num_handlers = cap;
+    pthread_mutex_unlock(&srv->stats_lock);
+}
+
+/* Add to a counter only the owning thread writes.
+ * */
+void stats_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/* Count one call of a handler.
+ * */
+void stats_record(rpc_server *srv, uint32_t func_id, size_t bytes_in, size_t bytes_out, int error, uint64_t elapsed,
+                  const zip_stats *zip_in, const zip_stats *zip_out) {
+    handler_stats *hs = stats_local(srv, func_id);
+    stats_add(&hs->calls, 1);
+    stats_add(&hs->errors, error != 0);
+    stats_add(&hs->bytes_in, bytes_in);
+    stats_add(&hs->bytes_out, bytes_out);
+    if (zip_in != NULL && zip_in->raw != 0) {
+        stats_add(&hs->zip_in.raw, zip_in->raw);
+        stats_add(&hs->zip_in.wire, zip_in->wire);
+        stats_add(&hs->zip_in.ns, zip_in->ns);
+    }
+    if (zip_out != NULL && zip_out->raw != 0) {
+        stats_add(&hs->zip_out.raw, zip_out->raw);
+        stats_add(&hs->zip_out.wire, zip_out->wire);
+        stats_add(&hs->zip_out.ns, zip_out->ns);
+    }
+    hist_record(&hs->latency, elapsed);
+}
+
+/* Record the phases of a traced request from the worker that ran it:
+ * waiting in the queue, the handler, encoding the reply and sending it.
+ * */
+void trace_request(rpc_request *req, uint64_t start, uint64_t end, uint64_t encoded, uint64_t sent) {
+    uint64_t conn = req->conn->id;
+    trace_span("queue", TRACE_SERVER, req->id, conn, req->queued, start);
+    trace_span("handler", TRACE_SERVER, req->id, conn, start, end);
+    trace_span("encode", TRACE_SERVER, req->id, conn, end, encoded);
+    trace_span("send", TRACE_SERVER, req->id, conn, encoded, sent);
+}
+
+/* Run a handler on every payload of a batch and send the results back in
+ * as few RSLT frames as MAX_FRAME allows, all but the last flagged MORE.
+ * Each result is tagged DATA or NULL.
+ * */
+void run_batch(rpc_request *req) {
+    rpc_server *srv = req->conn->srv;
+    rpc_data **results = pool_alloc(req->batch_len * sizeof(rpc_data *));
+    uint64_t began = req->traced ? stats_clock() : 0;
+    for (uint32_t i = 0; i < req->batch_len; i++) {
+        uint64_t start = stats_clock();
+        results[i] = req->function(&req->batch[i]);
+        uint64_t elapsed = stats_clock() - start;
+        int error = results[i] == NULL || results[i]->data2_len > MAX_DATA ||
+                    (results[i]->data2 == NULL) != (results[i]->data2_len == 0);
+        stats_record(srv, req->func_id, PAYLOAD_HEADER_LEN + req->batch[i].data2_len,
+                     error ? 0 : PAYLOAD_HEADER_LEN + results[i]->data2_len, error, elapsed, NULL, NULL);
+        if (error) {
+            atomic_fetch_add_explicit(&req->conn->errors, 1, memory_order_relaxed);
+
+            /* Server will not send invalid data back to client */
+            if (results[i] != NULL && results[i] != &req->batch[i]) {
+                rpc_data_free(results[i]);
+            }
+            results[i] = NULL;
+        }
+    }
+
+    uint64_t ended = req->traced ? stats_clock() : 0;
+    uint64_t encoded = ended;
+
+    /* Every result fits a frame on its own, since data2_len <= MAX_DATA */
+    uint32_t first = 0;
+    do {
+        size_t len = sizeof(uint32_t);
+        uint32_t end = first;
+        while (end < req->batch_len) {
+            size_t item_len = 1 + (results[end] != NULL ? PAYLOAD_HEADER_LEN + results[end]->data2_len : 0);
+            if (len + item_len > MAX_FRAME) {
+                break;
+            }
+            len += item_len;
+            end++;
+        }
+
+        char *frame = pool_alloc(FRAME_HEADER_LEN + len);
+        uint32_t count_nwb = htonl(end - first);
+        memcpy(frame + FRAME_HEADER_LEN, &count_nwb, sizeof(uint32_t));
+        char *p = frame + FRAME_HEADER_LEN + sizeof(uint32_t);
+        for (uint32_t i = first; i < end; i++) {
+            rpc_data *result = results[i];
+            if (result == NULL || encode_data(result, p + 1) == 1) {
+                *p++ = OP_NULL;
+            } else {
+                *p++ = OP_DATA;
+                p += PAYLOAD_HEADER_LEN;
+                if (result->data2_len != 0) {
+                    memcpy(p, result->data2, result->data2_len);
+                    p += result->data2_len;
+                }
+            }
+            if (result != NULL && result != &req->batch[i]) {
+                rpc_data_free(result);
+            }
+        }
+        frame_header hdr = {.len = p - frame - FRAME_HEADER_LEN, .op = OP_RSLT,
+                            .flags = end < req->batch_len ? FLAG_MORE : 0, .id = req->id};
+        encode_frame_header(frame, &hdr);
+
+        encoded = req->traced ? stats_clock() : 0;
+
+        struct iovec iov = {.iov_base = frame, .iov_len = p - frame};
+        conn_sendv(req->conn, &iov, 1);
+        pool_free(frame);
+        first = end;
+    } while (first < req->batch_len);
+
+    pool_free(results);
+    if (req->traced) {
+        trace_request(req, began, ended, encoded, stats_clock());
+    }
+}
+
+/* Run a handler and reply with its result.
+ * */
+void run_call(rpc_request *req) {
+    if (req->batch != NULL) {
+        run_batch(req);
+        return;
+    }
+    if (req->async != NULL) {
+        start_async(req);
+        return;
+    }
+    uint64_t start = stats_clock();
+    rpc_data *result;
+    if (req->function == stats_handler) {
+        result = stats_report(req->conn->srv);
+    } else if (req->function == trace_handler) {
+        result = trace_report();
+    } else {
+        result = req->function(&req->data);
+    }
+    finish_call(req, result, start, stats_clock());
+}
+
+/* Start a call of an asynchronous handler, which finishes it later with
+ * rpc_complete. The call moves into a request of its own, which owns the
+ * payload and holds a reference to the connection until then.
+ * */
+void start_async(rpc_request *req) {
+    rpc_request *call = pool_alloc(sizeof(rpc_request));
+    *call = *req;
+    req->flow = NULL;
+    if (req->body != NULL || req->large) {
+        req->body = NULL;
+        req->large = 0;
+    } else if (req->data.data2_len != 0) {
+        /* The payload still points into the connection buffer */
+        call->body = pool_alloc(req->data.data2_len);
+        memcpy(call->body, req->data.data2, req->data.data2_len);
+        call->data.data2 = call->body;
+    }
+    atomic_fetch_add(&call->conn->refs, 1);
+    atomic_fetch_add_explicit(&call->conn->srv->async_pending, 1, memory_order_relaxed);
+    call->started = stats_clock();
+    call->async(&call->data, (rpc_token *) call);
+}
+
+/* Finish a call started by an asynchronous handler, from any thread.
+ * A streaming call ends, with the result as its last item.
+ * */
+void rpc_complete(rpc_token *token, rpc_data *result) {
+    if (token == NULL) {
+        return;
+    }
+    rpc_request *req = (rpc_request *) token;
+    if (req->flow != NULL) {
+        int ok = result != NULL && stream_send(req, result, 0) == 0;
+        rpc_stream_end(token, ok);
+        return;
+    }
+    finish_call(req, result, req->started, stats_clock());
+    end_async(req);
+}
+
+/* Release what a call of an asynchronous handler holds once its reply or
+ * end of stream is queued.
+ * */
+void end_async(rpc_request *req) {
+    rpc_conn *conn = req->conn;
+    loop_send(conn);
+    atomic_fetch_sub_explicit(&conn->srv->async_pending, 1, memory_order_relaxed);
+    flow_close(conn, req->flow);
+    request_free(req);
+    conn_release(conn);
+}
+
+/* A loop on io_uring only sends what it queued once it is done with the
+ * connection, which it may not be serving now, so output queued from the
+ * loop's thread for a call finishing later is handed over at once.
+ * */
+void loop_send(rpc_conn *conn) {
+    if (current_loop != NULL && current_loop == conn->loop && current_loop->ring != NULL) {
+        uring_send(current_loop, conn);
+    }
+}
+
+/* Send the next item of a streaming call, from any thread.
+ * */
+int rpc_stream_send(rpc_token *token, rpc_data *item) {
+    rpc_request *req = (rpc_request *) token;
+    if (req == NULL || req->flow == NULL) {
+        if (req == NULL || item != &req->data) {
+            rpc_data_free(item);
+        }
+        return -1;
+    }
+    return stream_send(req, item, 1);
+}
+
+/* End a streaming call, from any thread.
+ * */
+void rpc_stream_end(rpc_token *token, int ok) {
+    if (token == NULL) {
+        return;
+    }
+    rpc_request *req = (rpc_request *) token;
+    if (req->flow == NULL) {
+        rpc_complete(token, NULL);
+        return;
+    }
+    uint64_t end = stats_clock();
+    conn_signal(req->conn, req->id, ok ? OP_END : OP_NULL);
+    stats_record(req->conn->srv, req->func_id, PAYLOAD_HEADER_LEN + req->data.data2_len, req->streamed, !ok,
+                 end - req->started, &req->unzipped, &req->zipped);
+    if (req->traced) {
+        trace_request(req, req->started, end, end, stats_clock());
+    }
+    end_async(req);
+}
+
+/* Send one item of a streaming call as a DATA frame flagged FLAG_STREAM,
+ * compressed as a reply would be, once the client has granted credit for
+ * it. Only waits for credit if wait is set and this thread does not parse
+ * the client's frames, which grant it. The item is freed unless it is the
+ * payload.
+ * Returns -1 if the item is invalid or the stream was cancelled.
+ * */
+int stream_send(rpc_request *req, rpc_data *item, int wait) {
+    rpc_conn *conn = req->conn;
+    int s = -1;
+    if (item != NULL && data_valid(item) && flow_take(conn, req->flow, wait) == 0) {
+        zip_stats *zipped = NULL;
+        if (conn->compress && conn->shm == NULL &&
+            !(req->func_flags & RPC_NO_COMPRESS)) {
+            zipped = &req->zipped;
+        }
+        char *zip = NULL;
+        size_t zip_len = zipped != NULL ? zip_data2(item->data2, item->data2_len, &zip, zipped) : 0;
+        conn_send_data(conn, req->id, item->data1, item->data2_len, zip_len != 0 ? zip : item->data2,
+                       zip_len != 0 ? zip_len : item->data2_len, FLAG_STREAM | (zip_len != 0 ? FLAG_COMPRESSED : 0));
+        pool_free(zip);
+        loop_send(conn);
+        req->streamed += PAYLOAD_HEADER_LEN + item->data2_len;
+        s = 0;
+    }
+    if (item != &req->data) {
+        rpc_data_free(item);
+    }
+    return s;
+}
+
+/* Start tracking the credit of a streaming call, which may send a window
+ * of items before the client grants more.
+ * */
+rpc_flow *flow_open(rpc_conn *conn, uint32_t id) {
+    rpc_flow *flow = pool_alloc(sizeof(rpc_flow));
+    flow->id = id;
+    flow->credit = STREAM_WINDOW;
+    flow->cancelled = 0;
+    pthread_mutex_lock(&conn->flow_lock);
+    flow->next = conn->flows;
+    conn->flows = flow;
+    pthread_mutex_unlock(&conn->flow_lock);
+    return flow;
+}
+
+/* Stop tracking the credit of a streaming call, if it is one.
+ * */
+void flow_close(rpc_conn *conn, rpc_flow *flow) {
+    if (flow == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&conn->flow_lock);
+    for (rpc_flow **link = &conn->flows; *link != NULL; link = &(*link)->next) {
+        if (*link == flow) {
+            *link = flow->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conn->flow_lock);
+    pool_free(flow);
+}
+
+/* Add the credit a GRANT frame carries to the streaming call it names, or
+ * cancel the call if the credit is 0. A grant for a call that has already
+ * ended is ignored.
+ * */
+void flow_grant(rpc_conn *conn, uint32_t id, uint32_t credit) {
+    pthread_mutex_lock(&conn->flow_lock);
+    for (rpc_flow *flow = conn->flows; flow != NULL; flow = flow->next) {
+        if (flow->id != id) {
+            continue;
+        }
+        if (credit == 0) {
+            flow->cancelled = 1;
+        } else {
+            flow->credit = flow->credit > UINT32_MAX - credit ? UINT32_MAX : flow->credit + credit;
+        }
+        pthread_cond_broadcast(&conn->credited);
+        break;
+    }
+    pthread_mutex_unlock(&conn->flow_lock);
+}
+
+/* Cancel every streaming call of a closed connection, waking the handlers
+ * waiting for credit.
+ * */
+void flow_cancel_all(rpc_conn *conn) {
+    pthread_mutex_lock(&conn->flow_lock);
+    for (rpc_flow *flow = conn->flows; flow != NULL; flow = flow->next) {
+        flow->cancelled = 1;
+    }
+    pthread_cond_broadcast(&conn->credited);
+    pthread_mutex_unlock(&conn->flow_lock);
+}
+
+/* Take a credit of a streaming call for its next item, waiting for one if
+ * wait is set. The threads that parse a connection's frames never wait,
+ * since only they could read the grant, and send regardless.
+ * Returns -1 if the call was cancelled.
+ * */
+int flow_take(rpc_conn *conn, rpc_flow *flow, int wait) {
+    wait = wait && !io_thread;
+    pthread_mutex_lock(&conn->flow_lock);
+    while (wait && flow->credit == 0 && !flow->cancelled) {
+        pthread_cond_wait(&conn->credited, &conn->flow_lock);
+    }
+    int s = flow->cancelled ? -1 : 0;
+    if (s == 0 && flow->credit > 0) {
+        flow->credit--;
+    }
+    pthread_mutex_unlock(&conn->flow_lock);
+    return s;
+}
+
+/* Reply to a call with the result its handler produced between start and
+ * end, caching it if the function is pure, and record the call's metrics
+ * and trace. The result is freed unless it is the payload itself, or the
+ * connection keeps it to send later.
+ * */
+void finish_call(rpc_request *req, rpc_data *result, uint64_t start, uint64_t end) {
+    uint64_t encoded;
+    rpc_server *srv = req->conn->srv;
+    size_t data2_len = req->data.data2_len;
+
+    /* Cached before replying, so a client repeating the call hits */
+    if (req->cacheable && result != NULL && result->data2_len <= MAX_DATA &&
+        (result->data2 == NULL) == (result->data2_len == 0)) {
+        cache_store(srv, req, result);
+    }
+
+    /* A large payload sent back is handed over, as the connection may
+     * keep it after the request is freed */
+    if (result == &req->data && req->large && result->data2_len > MAX_DATA) {
+        result = pool_alloc(sizeof(rpc_data));
+        *result = req->data;
+        req->data.data2 = NULL;
+        req->large = 0;
+    }
+    size_t result_len = result != NULL ? result->data2_len : 0;
+    zip_stats zipped = {0, 0, 0};
+    int compress = !(req->func_flags & RPC_NO_COMPRESS);
+    int replied = conn_reply(req->conn, req->id, result, req->traced ? &encoded : NULL, compress ? &zipped : NULL,
+                             req->deadline);
+    int error = replied < 0;
+    stats_record(srv, req->func_id, PAYLOAD_HEADER_LEN + data2_len, error ? 0 : PAYLOAD_HEADER_LEN + result_len,
+                 error, end - start, &req->unzipped, &zipped);
+    if (result != NULL && result != &req->data && replied != 1) {
+        rpc_data_free(result);
+    }
+    if (req->traced) {
+        trace_request(req, start, end, encoded, stats_clock());
+    }
+}
+
+/* Add a request to the queue.
+ * Returns -1 if the queue is full.
+ * */
+int queue_push(rpc_queue *queue, rpc_request *req) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        queue_cell *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->req = req;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/* Take the oldest request from the queue.
+ * Returns NULL if the queue is empty.
+ * */
+rpc_request *queue_pop(rpc_queue *queue) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        queue_cell *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                rpc_request *req = cell->req;
+                atomic_store_explicit(&cell->seq, pos + queue->mask + 1, memory_order_release);
+                return req;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/* Number of requests waiting in the queue.
+ * */
+size_t queue_depth(rpc_queue *queue) {
+    size_t head = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+}
+
+/* Answer a call taken off the queue without running it, if its deadline
+ * passed while it waited, or if it waited longer than the target delay
+ * while the server is overloaded. The server counts as overloaded once
+ * the queue has not been empty for OVERLOAD_INTERVAL: then calls are
+ * served only while fresh, and the backlog is shed instead of every call
+ * in it running late.
+ * Returns 1 if the call was answered.
+ * */
+int request_late(rpc_server *srv, rpc_request *req) {
+    if (req->deadline == 0 && srv->target_delay == 0) {
+        return 0;
+    }
+    uint64_t now = stats_clock();
+    if (req->deadline != 0 && now >= req->deadline) {
+        atomic_fetch_add_explicit(&srv->expired, 1, memory_order_relaxed);
+        conn_signal(req->conn, req->id, OP_EXPIRED);
+        flow_close(req->conn, req->flow);
+        req->flow = NULL;
+        return 1;
+    }
+    if (srv->target_delay == 0) {
+        return 0;
+    }
+    if (queue_depth(&srv->queue) == 0) {
+        atomic_store_explicit(&srv->last_empty, now, memory_order_relaxed);
+        return 0;
+    }
+    uint64_t last_empty = atomic_load_explicit(&srv->last_empty, memory_order_relaxed);
+    if (now - req->enqueued > srv->target_delay && now > last_empty + OVERLOAD_INTERVAL &&
+        req->func_id >= NUM_BUILTINS) {
+        shed_call(srv, req);
+        return 1;
+    }
+    return 0;
+}
+
+/* Worker thread: runs queued calls, and exits after sitting idle while the
+ * pool is above its minimum size.
+ * */
+void *worker_main(void *arg) {
+    rpc_server *srv = (rpc_server *) arg;
+
+    while (1) {
+        rpc_request *req = queue_pop(&srv->queue);
+        if (req != NULL) {
+            if (!request_late(srv, req)) {
+                run_call(req);
+            }
+            conn_release(req->conn);
+            request_free(req);
+            continue;
+        }
+        if (srv->target_delay != 0) {
+            atomic_store_explicit(&srv->last_empty, stats_clock(), memory_order_relaxed);
+        }
+
+        /* Wait for a call */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WORKER_IDLE_SEC;
+        atomic_fetch_add(&srv->idle_workers, 1);
+        int s = sem_timedwait(&srv->queue_items, &deadline);
+        atomic_fetch_sub(&srv->idle_workers, 1);
+        if (s < 0 && errno == ETIMEDOUT && worker_retire(srv)) {
+            return NULL;
+        }
+    }
+}
+
+/* Take a worker that sat idle out of the pool, unless that would leave
+ * fewer than min_workers. queue_call counted this worker idle until it
+ * woke, so a call queued meanwhile started no worker of its own, and the
+ * worker stays to run it.
+ * Returns 1 if the worker should exit.
+ * */
+int worker_retire(rpc_server *srv) {
+    int workers = atomic_load(&srv->num_workers);
+    while (workers > srv->min_workers) {
+        if (!atomic_compare_exchange_weak(&srv->num_workers, &workers, workers - 1)) {
+            continue;
+        }
+        if (queue_depth(&srv->queue) == 0) {
+            return 1;
+        }
+
+        /* Rejoin, unless workers started since fill the pool */
+        workers = atomic_load(&srv->num_workers);
+        do {
+            if (workers >= srv->max_workers) {
+                return 1;
+            }
+        } while (!atomic_compare_exchange_weak(&srv->num_workers, &workers, workers + 1));
+        return 0;
+    }
+    return 0;
+}
+
+/* Start a worker unless the pool is already at its maximum size.
+ * Returns -1 if no worker was started.
+ * */
+int start_worker(rpc_server *srv) {
+    int workers = atomic_load(&srv->num_workers);
+    do {
+        if (workers >= srv->max_workers) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&srv->num_workers, &workers, workers + 1));
+
+    /* Workers started by a pinned loop may still run on any CPU */
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &srv->cpus);
+    int s = pthread_create(&thread_id, &attr, worker_main, srv);
+    pthread_attr_destroy(&attr);
+    if (s != 0) {
+        atomic_fetch_sub(&srv->num_workers, 1);
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
+
+/* Point a payload parsed from one copy of a frame body into another.
+ * */
+void rebase_data(rpc_data *data, char *from, char *to) {
+    if (data->data2 != NULL) {
+        data->data2 = to + ((char *) data->data2 - from);
+    }
+}
+
+/* Answer a call with BUSY instead of running it.
+ * */
+void shed_call(rpc_server *srv, rpc_request *req) {
+    atomic_fetch_add_explicit(&srv->shed, 1, memory_order_relaxed);
+    conn_signal(req->conn, req->id, OP_BUSY);
+    flow_close(req->conn, req->flow);
+    req->flow = NULL;
+}
+
+/* Admission control: a call arriving while max_queued calls already wait
+ * is answered BUSY at once. Built-in functions are always admitted, so
+ * an overloaded server can still be inspected.
+ * Returns -1 if the call was shed.
+ * */
+int admit_call(rpc_server *srv, rpc_request *req) {
+    if (srv->max_queued == 0 || req->func_id < NUM_BUILTINS || queue_depth(&srv->queue) < srv->max_queued) {
+        return 0;
+    }
+    shed_call(srv, req);
+    return -1;
+}
+
+/* Queue a request that owns its payloads for the worker pool.
+ * The pool grows while calls queue up faster than idle workers take them,
+ * and replies go out in whatever order the calls finish.
+ * With no pool the event loop runs the call, and also when the queue is
+ * full unless the server sheds load, in which case the call is shed.
+ * */
+void queue_call(rpc_server *srv, rpc_request *req) {
+    if (srv->max_workers == 0) {
+        run_call(req);
+        request_free(req);
+        return;
+    }
+    if (admit_call(srv, req) < 0) {
+        request_free(req);
+        return;
+    }
+    if (srv->target_delay != 0) {
+        req->enqueued = stats_clock();
+    }
+    atomic_fetch_add(&req->conn->refs, 1);
+    if (queue_push(&srv->queue, req) < 0) {
+        if (srv->max_queued != 0 || srv->target_delay != 0) {
+            shed_call(srv, req);
+            conn_release(req->conn);
+            request_free(req);
+            return;
+        }
+        run_call(req);
+        conn_release(req->conn);
+        request_free(req);
+        return;
+    }
+    sem_post(&srv->queue_items);
+    if (queue_depth(&srv->queue) > (size_t) atomic_load(&srv->idle_workers)) {
+        start_worker(srv);
+    }
+}
+
+/* Hash of a call for the response cache: the function id and data1 and
+ * data2 of the payload, mixed a word at a time. Every step is invertible,
+ * so calls of the same payload to handlers installed at different times
+ * never share a hash, and a replaced handler's results are never hit.
+ * */
+uint64_t payload_hash(uint32_t func_id, uint64_t installed, const rpc_data *payload) {
+    const char *p = payload->data2;
+    size_t len = payload->data2_len;
+    uint64_t hash = (((uint64_t) func_id << 32) | (uint32_t) payload->data1) * 0x9e3779b97f4a7c15ULL ^ len ^
+                    installed * 0xbf58476d1ce4e5b9ULL;
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(uint64_t));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    if (len > 0) {
+        memcpy(&tail, p, len);
+    }
+    hash = (hash ^ tail) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 33);
+}
+
+/* Shard of the response cache holding the calls with this hash.
+ * */
+static inline cache_shard *cache_shard_of(rpc_server *srv, uint64_t hash) {
+    return &atomic_load_explicit(&srv->cache, memory_order_acquire)[(hash >> 32) & (CACHE_SHARDS - 1)];
+}
+
+/* Memory an entry holds.
+ * */
+static inline size_t cache_entry_size(const cache_entry *e) {
+    return sizeof(cache_entry) + e->key_len + e->reply_len;
+}
+
+/* Drops a reference to a cache entry, freeing it with the last one.
+ * */
+void cache_release(cache_entry *e) {
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        pool_free(e);
+    }
+}
+
+/* Unlinks an entry from a shard's least recently used list. Called with
+ * the shard locked.
+ * */
+void cache_unlink(cache_shard *shard, cache_entry *e) {
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        shard->newest = e->older;
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        shard->oldest = e->newer;
+    }
+}
+
+/* Links an entry in as a shard's most recently used. Called with the
+ * shard locked.
+ * */
+void cache_push(cache_shard *shard, cache_entry *e) {
+    e->newer = NULL;
+    e->older = shard->newest;
+    if (shard->newest != NULL) {
+        shard->newest->newer = e;
+    } else {
+        shard->oldest = e;
+    }
+    shard->newest = e;
+}
+
+/* Finds the entry of a call in its shard. Called with the shard locked.
+ * Returns NULL if the call is not cached.
+ * */
+cache_entry *cache_find(cache_shard *shard, uint32_t func_id, const rpc_data *payload, uint64_t hash) {
+    cache_entry *e = shard->buckets[hash & (CACHE_BUCKETS - 1)];
+    while (e != NULL && (e->hash != hash || e->func_id != func_id || e->data1 != payload->data1 ||
+                         e->key_len != payload->data2_len ||
+                         (e->key_len != 0 && memcmp(e->bytes, payload->data2, e->key_len) != 0))) {
+        e = e->chain;
+    }
+    return e;
+}
+
+/* Answer a call to a pure function from the response cache, sending the
+ * stored reply under the call's request id. The entry is pinned rather
+ * than the shard held while the reply is written.
+ * Returns 1 on a hit, 0 if the handler has to run.
+ * */
+int cache_reply(rpc_server *srv, rpc_conn *conn, uint32_t id, uint32_t func_id, const rpc_data *payload,
+                uint64_t hash) {
+    cache_shard *shard = cache_shard_of(srv, hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry *e = cache_find(shard, func_id, payload, hash);
+    if (e == NULL) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    shard->hits++;
+    cache_unlink(shard, e);
+    cache_push(shard, e);
+    atomic_fetch_add(&e->refs, 1);
+    pthread_mutex_unlock(&shard->lock);
+
+    /* The stored reply needs only a frame header, unless it is re-encoded
+     * compactly */
+    char *reply = e->bytes + e->key_len;
+    if (conn->compact) {
+        rpc_data result;
+        decode_data(reply, &result);
+        conn_send_data(conn, id, result.data1, result.data2_len, reply + PAYLOAD_HEADER_LEN, result.data2_len, 0);
+    } else {
+        char frame[FRAME_HEADER_LEN];
+        frame_header hdr = {.len = e->reply_len, .op = OP_DATA, .flags = 0, .id = id};
+        encode_frame_header(frame, &hdr);
+        struct iovec iov[2];
+        iov[0].iov_base = frame;
+        iov[0].iov_len = FRAME_HEADER_LEN;
+        iov[1].iov_base = reply;
+        iov[1].iov_len = e->reply_len;
+        conn_sendv(conn, iov, 2);
+    }
+    cache_release(e);
+    return 1;
+}
+
+/* Cache the result of a call to a pure function, encoded as it goes on the
+ * wire, evicting the least recently used entries of its shard to stay
+ * within the bound. A result too big for its share of the cache, or one
+ * another call cached first, is not stored.
+ * */
+void cache_store(rpc_server *srv, rpc_request *req, rpc_data *result) {
+    size_t limit = srv->cache_bytes / CACHE_SHARDS;
+    size_t reply_len = PAYLOAD_HEADER_LEN + result->data2_len;
+    if (sizeof(cache_entry) + req->data.data2_len + reply_len > limit / CACHE_MAX_SHARE) {
+        return;
+    }
+    cache_entry *e = pool_alloc(sizeof(cache_entry) + req->data.data2_len + reply_len);
+    e->hash = req->cache_hash;
+    e->func_id = req->func_id;
+    e->data1 = req->data.data1;
+    e->key_len = req->data.data2_len;
+    e->reply_len = reply_len;
+    atomic_init(&e->refs, 1);
+    if (e->key_len != 0) {
+        memcpy(e->bytes, req->data.data2, e->key_len);
+    }
+    encode_data(result, e->bytes + e->key_len);
+    if (result->data2_len != 0) {
+        memcpy(e->bytes + e->key_len + PAYLOAD_HEADER_LEN, result->data2, result->data2_len);
+    }
+
+    cache_shard *shard = cache_shard_of(srv, e->hash);
+    pthread_mutex_lock(&shard->lock);
+    if (cache_find(shard, e->func_id, &req->data, e->hash) != NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        pool_free(e);
+        return;
+    }
+    cache_entry **bucket = &shard->buckets[e->hash & (CACHE_BUCKETS - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+    cache_push(shard, e);
+    shard->bytes += cache_entry_size(e);
+    shard->num_entries++;
+
+    while (shard->bytes > limit) {
+        cache_entry *old = shard->oldest;
+        cache_entry **link = &shard->buckets[old->hash & (CACHE_BUCKETS - 1)];
+        while (*link != old) {
+            link = &(*link)->chain;
+        }
+        *link = old->chain;
+        cache_unlink(shard, old);
+        shard->bytes -= cache_entry_size(old);
+        shard->num_entries--;
+        shard->evictions++;
+        cache_release(old);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Hand a call over to the worker pool.
+ * The call's payloads point into the connection buffer at body, and are
+ * moved into a copy of the body owned by the queued request. A call whose
+ * body is already set owns its payload, decompressed out of the buffer.
+ * */
+void dispatch_call(rpc_server *srv, rpc_request *call, char *body, size_t body_len) {
+    if (srv->max_workers == 0) {
+        run_call(call);
+        pool_free(call->batch);
+        pool_free(call->body);
+        return;
+    }
+    if (admit_call(srv, call) < 0) {
+        pool_free(call->batch);
+        pool_free(call->body);
+        return;
+    }
+
+    rpc_request *req = pool_alloc(sizeof(rpc_request));
+    *req = *call;
+    if (req->body != NULL) {
+        queue_call(srv, req);
+        return;
+    }
+
+    /* Copy the payloads out of the connection buffer */
+    req->body = pool_alloc(body_len);
+    memcpy(req->body, body, body_len);
+    rebase_data(&req->data, body, req->body);
+    for (uint32_t i = 0; i < req->batch_len; i++) {
+        rebase_data(&req->batch[i], body, req->body);
+    }
+    queue_call(srv, req);
+}
+
+/* Start receiving a large CALL: map a buffer for its data2, which arrives
+ * in the CHUNK frames that follow. A call to an unknown function is
+ * answered now and its chunks are discarded.
+ * Returns -1 if the header is malformed.
+ * */
+int begin_large_call(rpc_server *srv, rpc_conn *conn, rpc_registry *reg, uint32_t id, uint32_t func_id, char *body, size_t body_len,
+                     uint64_t deadline) {
+    rpc_request *req = pool_alloc(sizeof(rpc_request));
+    memset(req, 0, sizeof(rpc_request));
+    if (conn->large != NULL || body_len != LARGE_HEADER_LEN || decode_large(body, &req->data) == 1) {
+        pool_free(req);
+        return -1;
+    }
+    req->conn = conn;
+    req->id = id;
+    req->deadline = deadline;
+    atomic_fetch_add_explicit(&conn->calls, 1, memory_order_relaxed);
+    if (func_id < reg->num_entries && !(reg->entries[func_id].flags & FUNC_STREAM)) {
+        req->function = reg->entries[func_id].function;
+        req->async = reg->entries[func_id].async;
+        req->func_id = func_id;
+        req->func_flags = reg->entries[func_id].flags;
+        req->data.data2 = large_alloc(req->data.data2_len);
+        req->large = req->data.data2 != NULL || req->data.data2_len == 0;
+    }
+    if (!req->large) {
+        conn_signal(conn, id, OP_NULL);
+    }
+    conn->large = req;
+    conn->large_off = 0;
+    return 0;
+}
+
+/* Take a CALL whose data2 was passed as a descriptor, and queue it. The
+ * descriptor is the oldest one received on the connection.
+ * Returns -1 if the descriptor is missing or the header is malformed.
+ * */
+int begin_fd_call(rpc_server *srv, rpc_conn *conn, rpc_registry *reg, uint32_t id, uint32_t func_id, char *body, size_t body_len,
+                  uint64_t deadline) {
+    rpc_data data;
+    uint64_t offset;
+    int fd = fd_queue_pop(&conn->fds);
+    if (fd < 0) {
+        return -1;
+    }
+    if (body_len != FD_HEADER_LEN || decode_fd_header(body, &data, &offset) == 1) {
+        close(fd);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&conn->calls, 1, memory_order_relaxed);
+    if (func_id >= reg->num_entries || (reg->entries[func_id].flags & FUNC_STREAM)) {
+        close(fd);
+        conn_signal(conn, id, OP_NULL);
+        return 0;
+    }
+    data.data2 = fd_data2(fd, offset, data.data2_len);
+    close(fd);
+    if (data.data2 == NULL && data.data2_len != 0) {
+        conn_signal(conn, id, OP_NULL);
+        return 0;
+    }
+
+    rpc_request *req = pool_alloc(sizeof(rpc_request));
+    memset(req, 0, sizeof(rpc_request));
+    req->conn = conn;
+    req->id = id;
+    req->function = reg->entries[func_id].function;
+    req->async = reg->entries[func_id].async;
+    req->func_id = func_id;
+    req->func_flags = reg->entries[func_id].flags;
+    req->data = data;
+    req->large = 1;
+    req->deadline = deadline;
+    queue_call(srv, req);
+    return 0;
+}
+
+/* Copy the next CHUNK of the large CALL being received, decompressing it
+ * if it is flagged FLAG_COMPRESSED, and queue the call once its data2 is
+ * complete.
+ * Returns -1 if the chunk does not belong to it or is corrupt.
+ * */
+int receive_large_chunk(rpc_server *srv, rpc_conn *conn, uint32_t id, char *body, size_t len, int compressed) {
+    rpc_request *req = conn->large;
+    if (req == NULL || req->id != id) {
+        return -1;
+    }
+    size_t remaining = req->data.data2_len - conn->large_off;
+    if (compressed) {
+        size_t n = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+        if (!conn->compress || n == 0) {
+            return -1;
+        }
+        if (req->large &&
+            unzip_data2(body, len, (char *) req->data.data2 + conn->large_off, n, &req->unzipped) < 0) {
+            return -1;
+        }
+        len = n;
+    } else if (remaining < len) {
+        return -1;
+    } else if (req->large) {
+        memcpy((char *) req->data.data2 + conn->large_off, body, len);
+    }
+    conn->large_off += len;
+    if (conn->large_off == req->data.data2_len) {
+        conn->large = NULL;
+        if (req->large) {
+            queue_call(srv, req);
+        } else {
+            request_free(req);
+        }
+    }
+    return 0;
+}
+
+/* Parse the payloads of a BATCH body into the request.
+ * Returns -1 if the body is malformed.
+ * */
+int decode_batch(rpc_request *call, char *body, size_t body_len) {
+    uint32_t count_nwb;
+    if (body_len < sizeof(uint32_t)) {
+        return -1;
+    }
+    memcpy(&count_nwb, body, sizeof(uint32_t));
+    uint32_t count = ntohl(count_nwb);
+    if (count == 0 || count > body_len / PAYLOAD_HEADER_LEN) {
+        return -1;
+    }
+
+    call->batch = pool_alloc(count * sizeof(rpc_data));
+    call->batch_len = count;
+    size_t pos = sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        rpc_data *data = &call->batch[i];
+        if (body_len - pos < PAYLOAD_HEADER_LEN || decode_data(body + pos, data) == 1 ||
+            body_len - pos - PAYLOAD_HEADER_LEN < data->data2_len) {
+            pool_free(call->batch);
+            return -1;
+        }
+        pos += PAYLOAD_HEADER_LEN;
+        data->data2 = data->data2_len == 0 ? NULL : body + pos;
+        pos += data->data2_len;
+    }
+    if (pos != body_len) {
+        pool_free(call->batch);
+        return -1;
+    }
+    return 0;
+}
+
+/* Map the shared memory a same-host client offers, by name. The name is
+ * unlinked once opened, so nobody else can map it after the server.
+ * Returns NULL if the region cannot be used.
+ * */
+shm_region *shm_attach(const char *name, size_t name_len) {
+    char path[SHM_NAME_MAX];
+    size_t prefix_len = strlen(SHM_PREFIX);
+    if (name_len <= prefix_len || name_len >= SHM_NAME_MAX || strncmp(name, SHM_PREFIX, prefix_len) != 0 ||
+        memchr(name + 1, '/', name_len - 1) != NULL || memchr(name, '\0', name_len) != NULL) {
+        return NULL;
+    }
+    memcpy(path, name, name_len);
+    path[name_len] = '\0';
+    int fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    shm_unlink(path);
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(shm_region)) {
+        map = mmap(NULL, sizeof(shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    shm_region *shm = (shm_region *) map;
+    if (shm->magic != SHM_MAGIC || shm->ring_size != SHM_RING) {
+        munmap(map, sizeof(shm_region));
+        return NULL;
+    }
+    return shm;
+}
+
+/* Move everything in a shared-memory connection's request ring into the
+ * connection buffer, and let a client waiting for room know.
+ * Returns the number of bytes moved, or -1 if the ring is corrupt.
+ * */
+ssize_t shm_fill(rpc_conn *conn) {
+    ssize_t total = 0;
+    while (1) {
+        if (conn->in_cap - conn->in_len < READ_CHUNK) {
+            conn->in_cap = conn->in_len + READ_CHUNK;
+            conn->in = realloc(conn->in, conn->in_cap);
+            if (conn->in == NULL) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t num_bytes = ring_get(&conn->shm->requests, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+        if (num_bytes < 0) {
+            return -1;
+        }
+        if (num_bytes == 0) {
+            break;
+        }
+        conn->in_len += num_bytes;
+        total += num_bytes;
+    }
+    if (total > 0) {
+        atomic_fetch_add_explicit(&conn->bytes_in, total, memory_order_relaxed);
+        atomic_fetch_add_explicit(&wire_bytes, total, memory_order_relaxed);
+        shm_wake(&conn->shm->client_bell);
+    }
+    return total;
+}
+
+/* Read the bytes a shared-memory client sent on the socket to wake the
+ * loop. A short read means the socket is drained, unless it hung up.
+ * Returns -1 if the client has gone.
+ * */
+int shm_doorbell(rpc_conn *conn, int hangup) {
+    char buf[64];
+    while (1) {
+        ssize_t num_bytes = recv(conn->socket, buf, sizeof(buf), 0);
+        atomic_fetch_add_explicit(&io_syscalls, 1, memory_order_relaxed);
+        if (num_bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        } else if (num_bytes == 0) {
+            return -1;
+        }
+        if ((size_t) num_bytes < sizeof(buf) && !hangup) {
+            return 0;
+        }
+    }
+}
+
+/* Serve a shared-memory connection from its event loop: parse the frames
+ * the client wrote to the request ring, exactly as for a socket, and flush
+ * replies held for lack of room, with the next chunks of large results.
+ * Then tell the client the loop waits for a
+ * byte on the socket, looking at the rings once more in case it wrote
+ * just before, as it only sends the byte when told.
+ * Returns -1 if the connection should close.
+ * */
+int shm_serve(rpc_conn *conn) {
+    shm_region *shm = conn->shm;
+    while (1) {
+        uint64_t reading = trace_enabled() ? stats_clock() : 0;
+        ssize_t got = shm_fill(conn);
+        if (got < 0) {
+            return -1;
+        }
+        if (got > 0) {
+            conn->recv_start = reading;
+            conn->recv_end = reading != 0 ? stats_clock() : 0;
+            if (rpc_handle_client(conn->srv, conn) < 0) {
+                return -1;
+            }
+        }
+        conn_pump(conn);
+        pthread_mutex_lock(&conn->out_lock);
+        int s = conn_flush(conn);
+        int drained = conn->out_len == conn->out_off;
+        pthread_mutex_unlock(&conn->out_lock);
+        if (s < 0 || __atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+
+        /* Held results go on while the reply ring takes everything */
+        if (drained && conn->held != NULL) {
+            continue;
+        }
+
+        __atomic_store_n(&shm->loop_waiting, 1, __ATOMIC_SEQ_CST);
+        if (!ring_ready(&shm->requests, 0) &&
+            !(__atomic_load_n(&shm->replies_held, __ATOMIC_SEQ_CST) && ring_ready(&shm->replies, 1))) {
+            return 0;
+        }
+        __atomic_store_n(&shm->loop_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Move a same-host client's frames onto the shared memory it offers, once
+ * it has been told YESS on the socket. Only the first frame of a local
+ * connection may ask, so no reply can be on its way on the socket.
+ * Returns -1 if the client was told NULL and stays on the socket.
+ * */
+int shm_accept(rpc_conn *conn, uint32_t id, char *name, size_t name_len) {
+    shm_region *shm = NULL;
+    if (conn->local && conn->out_len == 0 && atomic_load(&conn->calls) == 0) {
+        shm = shm_attach(name, name_len);
+    }
+    if (shm == NULL) {
+        conn_signal(conn, id, OP_NULL);
+        return -1;
+    }
+    conn_signal(conn, id, OP_YESS);
+
+    /* A loop on io_uring only queued the reply, which must leave on the
+     * socket before frames move to the rings */
+    pthread_mutex_lock(&conn->out_lock);
+    conn_flush(conn);
+    pthread_mutex_unlock(&conn->out_lock);
+
+    pthread_mutex_lock(&conn->srv->stats_lock);
+    conn->shm = shm;
+    pthread_mutex_unlock(&conn->srv->stats_lock);
+    conn->in_len = 0;
+    return 0;
+}
+
+/* Server handles a client.
+ * Serves every complete frame buffered on the connection, looking
+ * functions up in the registry published when it started. A pinned loop
+ * looks them up in its own copy, made again whenever another registry is
+ * published.
+ * Returns -1 if the client sent an invalid frame.
+ * */
+int rpc_handle_client(rpc_server *srv, rpc_conn *conn) {
+    registry_reader *reader;
+    rpc_registry *reg = registry_enter(srv, &reader);
+    rpc_loop *loop = conn->loop;
+    if (current_loop == loop && loop->cpu >= 0) {
+        if (loop->snapshot.slots == NULL || loop->snapshot.generation != reg->generation) {
+            registry_free(&loop->snapshot);
+            registry_copy(&loop->snapshot, reg);
+        }
+        reg = &loop->snapshot;
+    }
+    int s = serve_frames(srv, conn, reg);
+    registry_exit(reader);
+    return s;
+}
+
+/* Sends the signal or data for every complete frame buffered on the
+ * connection, tagged with the call's request id. Clients may pipeline
+ * many calls; a partial frame stays buffered until the rest arrives.
+ * Returns -1 if the client sent an invalid frame.
+ * */
+int serve_frames(rpc_server *srv, rpc_conn *conn, rpc_registry *reg) {
+    size_t pos = 0;
+
+    while (pos < conn->in_len) {
+        frame_header hdr;
+        int hdr_len = parse_frame_header(conn->in + pos, conn->in_len - pos, &hdr);
+        if (hdr_len < 0) {
+            return -1;
+        }
+        if (hdr_len == 0 || conn->in_len - pos - hdr_len < hdr.len) {
+            break;
+        }
+        char *body = conn->in + pos + hdr_len;
+        pos += hdr_len + hdr.len;
+
+        /* If client called rpc_find, the body is the function name */
+        if (hdr.op == OP_FIND) {
+            rpc_entry *entry = registry_find(reg, body, hdr.len);
+
+            /* Send signal and function id to the client */
+            if (entry == NULL) {
+                conn_signal(conn, hdr.id, OP_NULL);
+                continue;
+            }
+            conn_yess(conn, hdr.id, (uint32_t) (entry - reg->entries), entry->flags, reg->generation);
+
+        /* If client called rpc_find with LIST, the body is the registry
+         * generation it already has, 0 for none */
+        } else if (hdr.op == OP_LIST) {
+            uint64_t known_nwb;
+            if (hdr.len != sizeof(uint64_t)) {
+                return -1;
+            }
+            memcpy(&known_nwb, body, sizeof(uint64_t));
+            conn_list(conn, reg, hdr.id, be64toh(known_nwb));
+
+        /* If client called rpc_call or rpc_call_batch, the body is the
+         * function id followed by the payload or the list of payloads */
+        } else if (hdr.op == OP_CALL || hdr.op == OP_BATCH) {
+            uint32_t func_id;
+            int id_len = decode_func_id(&hdr, body, hdr.len, &func_id);
+            if (id_len < 0) {
+                return -1;
+            }
+            body += id_len;
+            size_t body_len = hdr.len - id_len;
+
+            /* The client's deadline, from when the frame was parsed */
+            uint64_t deadline = hdr.budget != 0 ? stats_clock() + hdr.budget * 1000000ULL : 0;
+
+            if (hdr.op == OP_CALL && (hdr.flags & FLAG_LARGE)) {
+                if (begin_large_call(srv, conn, reg, hdr.id, func_id, body, body_len, deadline) < 0) {
+                    return -1;
+                }
+                if (conn->large->data.data2_len == 0) {
+                    receive_large_chunk(srv, conn, hdr.id, NULL, 0, 0);
+                }
+                continue;
+            }
+            if (hdr.op == OP_CALL && (hdr.flags & FLAG_FD)) {
+                if (begin_fd_call(srv, conn, reg, hdr.id, func_id, body, body_len, deadline) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+
+            /* A sampled request notes when each phase ends */
+            int traced = trace_enabled() && ((hdr.flags & FLAG_TRACE) || trace_sample());
+            uint64_t decoding = traced ? stats_clock() : 0;
+            rpc_request call = {.conn = conn, .id = hdr.id, .batch = NULL, .batch_len = 0, .body = NULL,
+                                .large = 0, .traced = traced, .cacheable = 0, .deadline = deadline};
+            size_t wire_len;
+            if (hdr.op == OP_CALL && (hdr.flags & FLAG_COMPRESSED)) {
+                /* data2_len is the size of data2 once decompressed */
+                if (!conn->compress || decode_body(&hdr, body, body_len, &call.data, &wire_len) < 0) {
+                    return -1;
+                }
+                call.body = pool_alloc(call.data.data2_len);
+                if (unzip_data2(call.data.data2, wire_len, call.body, call.data.data2_len, &call.unzipped) < 0) {
+                    pool_free(call.body);
+                    return -1;
+                }
+                call.data.data2 = call.body;
+            } else if (hdr.op == OP_CALL) {
+                if (decode_body(&hdr, body, body_len, &call.data, &wire_len) < 0) {
+                    return -1;
+                }
+            } else if (decode_batch(&call, body, body_len) < 0) {
+                return -1;
+            }
+            uint64_t decoded = traced ? stats_clock() : 0;
+
+            /* Handle does not exist, cannot finish a batch later, or
+             * streams its results to a call that does not expect a stream,
+             * or the other way round */
+            atomic_fetch_add_explicit(&conn->calls, 1, memory_order_relaxed);
+            if (func_id >= reg->num_entries || (hdr.op == OP_BATCH && reg->entries[func_id].async != NULL) ||
+                !(hdr.flags & FLAG_STREAM) != !(reg->entries[func_id].flags & FUNC_STREAM)) {
+                conn_signal(conn, hdr.id, OP_NULL);
+                pool_free(call.batch);
+                pool_free(call.body);
+                continue;
+            }
+            call.function = reg->entries[func_id].function;
+            call.async = reg->entries[func_id].async;
+            call.func_id = func_id;
+            call.func_flags = reg->entries[func_id].flags;
+
+            /* The stream's credit is tracked from now, before any GRANT
+             * for it can be parsed */
+            if (hdr.flags & FLAG_STREAM) {
+                call.flow = flow_open(conn, hdr.id);
+            }
+
+            /* A pure function's result may already be cached */
+            if (atomic_load_explicit(&srv->cache, memory_order_acquire) != NULL && hdr.op == OP_CALL &&
+                (call.func_flags & RPC_PURE)) {
+                call.cacheable = 1;
+                call.cache_hash = payload_hash(func_id, reg->entries[func_id].installed, &call.data);
+                if (cache_reply(srv, conn, hdr.id, func_id, &call.data, call.cache_hash)) {
+                    if (traced) {
+                        trace_span("recv", TRACE_SERVER, hdr.id, conn->id, conn->recv_start, conn->recv_end);
+                        trace_span("decode", TRACE_SERVER, hdr.id, conn->id, decoding, decoded);
+                        trace_span("cache", TRACE_SERVER, hdr.id, conn->id, decoded, stats_clock());
+                    }
+                    pool_free(call.body);
+                    continue;
+                }
+            }
+            if (traced) {
+                call.queued = stats_clock();
+                trace_span("recv", TRACE_SERVER, hdr.id, conn->id, conn->recv_start, conn->recv_end);
+                trace_span("decode", TRACE_SERVER, hdr.id, conn->id, decoding, decoded);
+                trace_span("lookup", TRACE_SERVER, hdr.id, conn->id, decoded, call.queued);
+            }
+            dispatch_call(srv, &call, body, body_len);
+
+        /* Client has room for more items of a streaming call, or wants no
+         * more of them if the body is 0 */
+        } else if (hdr.op == OP_GRANT) {
+            uint32_t credit_nwb;
+            if (hdr.len != sizeof(uint32_t)) {
+                return -1;
+            }
+            memcpy(&credit_nwb, body, sizeof(uint32_t));
+            flow_grant(conn, hdr.id, ntohl(credit_nwb));
+
+        /* Next part of the large CALL being received */
+        } else if (hdr.op == OP_CHUNK) {
+            if (receive_large_chunk(srv, conn, hdr.id, body, hdr.len, hdr.flags & FLAG_COMPRESSED) < 0) {
+                return -1;
+            }
+
+        /* Client offering the capabilities it supports, which the server
+         * may accept before any call. The reply holds those it accepted */
+        } else if (hdr.op == OP_HELLO) {
+            uint32_t caps_nwb;
+            if (hdr.len != sizeof(uint32_t) || atomic_load_explicit(&conn->calls, memory_order_relaxed) != 0) {
+                conn_signal(conn, hdr.id, OP_NULL);
+                continue;
+            }
+            memcpy(&caps_nwb, body, sizeof(uint32_t));
+            uint32_t caps = ntohl(caps_nwb) & (CAP_COMPRESS | CAP_COMPACT | CAP_LIST);
+            conn->compress = (caps & CAP_COMPRESS) != 0;
+            conn->compact = (caps & CAP_COMPACT) != 0;
+            conn_yess(conn, hdr.id, caps, 0, reg->generation);
+
+        /* Same-host client offering shared memory, body is its name. From
+         * now on the loop reads the frames from the request ring */
+        } else if (hdr.op == OP_SHM && conn->shm == NULL && pos == conn->in_len) {
+            if (shm_accept(conn, hdr.id, body, hdr.len) == 0) {
+                return 0;
+            }
+        } else {
+            return -1;
+        }
+    }
+
+    /* Keep the partial frame for the next read */
+    if (pos > 0) {
+        memmove(conn->in, conn->in + pos, conn->in_len - pos);
+        conn->in_len -= pos;
+    }
+    return 0;
+}
+
+/* Removes a client connection from the event loop.
+ * The socket is shut down now, and closed once no worker or io_uring
+ * request still uses it.
+ * */
+void conn_close(rpc_server *srv, rpc_conn *conn) {
+    if (conn->loop->ring != NULL) {
+        conn->closing = 1;
+        uring_cancel(conn->loop, conn);
+    } else {
+        epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    }
+    shutdown(conn->socket, SHUT_RDWR);
+    if (conn->shm != NULL) {
+        __atomic_store_n(&conn->shm->closed, 1, __ATOMIC_RELEASE);
+        shm_wake(&conn->shm->client_bell);
+        shm_wake(&conn->shm->server_bell);
+    }
+    flow_cancel_all(conn);
+    conn_release(conn);
+}
+
+/* Accept every pending connection on a listener and add it to the event
+ * loop, which keeps it from then on.
+ * */
+void accept_clients(rpc_loop *loop, int listen_fd) {
+    while (1) {
+        int new_socket_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        atomic_fetch_add_explicit(&io_syscalls, 1, memory_order_relaxed);
+        if (new_socket_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            /* EAGAIN: backlog drained. Anything else (e.g. EMFILE) is retried
+             * on the next readiness event. */
+            return;
+        }
+        conn_open(loop, new_socket_fd, listen_fd);
+    }
+}
+
+/* Set up a connection accepted on a listener and have the loop watch it.
+ * */
+void conn_open(rpc_loop *loop, int new_socket_fd, int listen_fd) {
+    rpc_server *srv = loop->srv;
+    rpc_conn *conn = calloc(1, sizeof(rpc_conn));
+    if (conn == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    conn->srv = srv;
+    conn->loop = loop;
+    conn->socket = new_socket_fd;
+    atomic_init(&conn->refs, 1);
+    pthread_mutex_init(&conn->out_lock, NULL);
+    pthread_mutex_init(&conn->flow_lock, NULL);
+    pthread_cond_init(&conn->credited, NULL);
+    conn->unix_socket = listen_fd == srv->unix_socket;
+
+    /* Note the peer for __stats */
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    char host[INET6_ADDRSTRLEN] = "?";
+    int peer_port = 0;
+    if (getpeername(new_socket_fd, (struct sockaddr *) &peer, &peer_len) == 0) {
+        if (peer.ss_family == AF_INET6) {
+            struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &peer;
+            inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+            peer_port = ntohs(in6->sin6_port);
+            conn->local = IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr) ||
+                          (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr) && in6->sin6_addr.s6_addr[12] == 127);
+        } else if (peer.ss_family == AF_INET) {
+            struct sockaddr_in *in4 = (struct sockaddr_in *) &peer;
+            inet_ntop(AF_INET, &in4->sin_addr, host, sizeof(host));
+            peer_port = ntohs(in4->sin_port);
+            conn->local = (ntohl(in4->sin_addr.s_addr) >> 24) == 127;
+        }
+    }
+    snprintf(conn->peer, sizeof(conn->peer), "[%s]:%d", host, peer_port);
+    if (conn->unix_socket) {
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(new_socket_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0) {
+            snprintf(conn->peer, sizeof(conn->peer), UNIX_PREFIX "pid=%d", (int) cred.pid);
+        } else {
+            snprintf(conn->peer, sizeof(conn->peer), UNIX_PREFIX "?");
+        }
+    }
+    pthread_mutex_lock(&srv->stats_lock);
+    conn->id = srv->next_conn_id++;
+    conn->next = srv->conns;
+    if (srv->conns != NULL) {
+        srv->conns->prev = conn;
+    }
+    srv->conns = conn;
+    pthread_mutex_unlock(&srv->stats_lock);
+
+    /* Every reply is a single write, so Nagle would only add delay */
+    if (!conn->unix_socket) {
+        int enable = 1;
+        setsockopt(new_socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+    }
+
+    if (loop->ring != NULL) {
+        uring_watch(loop, conn);
+    } else {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, new_socket_fd, &ev) < 0) {
+            conn_release(conn);
+            return;
+        }
+    }
+    atomic_fetch_add_explicit(&loop->accepted, 1, memory_order_relaxed);
+}
+
+/* Binds a Unix socket at path for rpc_serve_all to accept clients on, as
+ * well as the TCP socket. A socket left at path by an earlier server is
+ * replaced, but any other file is not.
+ * Returns -1 on failure.
+ * */
+int rpc_server_listen_unix(rpc_server *srv, char *path) {
+    struct sockaddr_un sun;
+    if (srv == NULL || path == NULL || srv->serving || srv->unix_socket != -1 ||
+        strlen(path) >= sizeof(sun.sun_path)) {
+        return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1) {
+        return -1;
+    }
+    if (bind(socket_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+    srv->unix_socket = socket_fd;
+    return 0;
+}
+
+/* Sets the bounds of the worker pool that runs handlers.
+ * Returns -1 with invalid bounds.
+ * */
+int rpc_server_set_workers(rpc_server *srv, int min_workers, int max_workers) {
+    if (srv == NULL || min_workers < 0 || max_workers < min_workers) {
+        return -1;
+    }
+    srv->min_workers = min_workers;
+    srv->max_workers = max_workers;
+    return 0;
+}
+
+/* Sets how many event loops rpc_serve_all runs, 0 for one per CPU.
+ * Returns -1 once the server is serving.
+ * */
+int rpc_server_set_loops(rpc_server *srv, int num_loops) {
+    if (srv == NULL || srv->serving || num_loops < 0) {
+        return -1;
+    }
+    srv->num_loops = num_loops;
+    return 0;
+}
+
+/* Sets the memory bound of the response cache of functions registered
+ * with RPC_PURE, before rpc_serve_all. 0 disables the cache.
+ * Returns -1 once the server is serving.
+ * */
+int rpc_server_set_cache(rpc_server *srv, size_t max_bytes) {
+    if (srv == NULL || srv->serving) {
+        return -1;
+    }
+    srv->cache_bytes = max_bytes;
+    return 0;
+}
+
+/* Sets how the server sheds load, before rpc_serve_all. Calls arriving
+ * while max_queued calls wait are answered BUSY at once, and so is a call
+ * that waited longer than target_ms once the queue has not drained for
+ * OVERLOAD_INTERVAL. 0 turns either off.
+ * Returns -1 once the server is serving.
+ * */
+int rpc_server_set_overload(rpc_server *srv, size_t max_queued, unsigned target_ms) {
+    if (srv == NULL || srv->serving) {
+        return -1;
+    }
+    srv->max_queued = max_queued;
+    srv->target_delay = target_ms * 1000000ULL;
+    return 0;
+}
+
+/* Allocates the response cache if any registered function is pure, and
+ * it is not allocated yet. Called with registry_lock held once serving.
+ * */
+void cache_init(rpc_server *srv) {
+    if (atomic_load_explicit(&srv->cache, memory_order_relaxed) != NULL) {
+        return;
+    }
+    int pure = 0;
+    for (size_t i = 0; i < srv->registry.num_entries; i++) {
+        pure |= (srv->registry.entries[i].flags & RPC_PURE) != 0;
+    }
+    if (!pure || srv->cache_bytes == 0) {
+        return;
+    }
+    cache_shard *cache = calloc(CACHE_SHARDS, sizeof(cache_shard));
+    if (cache == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache[i].lock, NULL);
+    }
+    atomic_store_explicit(&srv->cache, cache, memory_order_release);
+}
+
+/* Text being built by stats_report */
+typedef struct {
+    char *buf;                      // NUL-terminated text
+    size_t len;                     // length of the text
+    size_t cap;                     // capacity of buf
+} json_text;
+
+/* Append formatted text.
+ * */
+void json_printf(json_text *text, const char *fmt, ...) {
+    while (1) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(text->buf + text->len, text->cap - text->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t) n < text->cap - text->len) {
+            text->len += n;
+            return;
+        }
+        text->cap = (text->cap + n) * 2;
+        text->buf = realloc(text->buf, text->cap);
+        if (text->buf == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Append a function name as a JSON string.
+ * */
+void json_string(json_text *text, const char *name) {
+    json_printf(text, "\"");
+    for (const char *c = name; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            json_printf(text, "\\%c", *c);
+        } else if ((unsigned char) *c < 0x20) {
+            json_printf(text, "\\u%04x", (unsigned char) *c);
+        } else {
+            json_printf(text, "%c", *c);
+        }
+    }
+    json_printf(text, "\"");
+}
+
+/* Append the totals of compressed payloads in one direction, with the
+ * ratio of raw to wire bytes.
+ * */
+void json_zip(json_text *text, const char *name, const zip_stats *zs) {
+    json_printf(text, "\"%s\":{\"raw\":%llu,\"wire\":%llu,\"ratio\":%.3f,\"ns\":%llu}", name,
+                 (unsigned long long) zs->raw, (unsigned long long) zs->wire,
+                 zs->wire == 0 ? 0.0 : (double) zs->raw / zs->wire, (unsigned long long) zs->ns);
+}
+
+/* Handler registered as __stats. The worker recognises it and calls
+ * stats_report instead, which needs the server.
+ * */
+rpc_data *stats_handler(rpc_data *payload) {
+    return NULL;
+}
+
+/* Reply of __stats: data2 is a JSON document with the metrics of every
+ * handler, merged from all thread shards, and of every open connection.
+ * Latency histograms are listed as [highest value, count] pairs of their
+ * non-empty buckets, in nanoseconds. Only the shards' metrics and the
+ * connections are taken under stats_lock, so calls and accepts do not wait
+ * while they are merged and formatted.
+ * */
+rpc_data *stats_report(rpc_server *srv) {
+    json_text text = {.buf = NULL, .len = 0, .cap = 0};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double uptime = (now.tv_sec - srv->started.tv_sec) + (now.tv_nsec - srv->started.tv_nsec) / 1e9;
+    json_printf(&text, "{\"uptime_sec\":%.3f,\"workers\":%d,\"idle_workers\":%d,\"queue_depth\":%zu,"
+                 "\"async_pending\":%zu,", uptime, atomic_load(&srv->num_workers), atomic_load(&srv->idle_workers),
+                 queue_depth(&srv->queue), atomic_load_explicit(&srv->async_pending, memory_order_relaxed));
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    size_t cached = 0, cache_used = 0;
+    cache_shard *cache = atomic_load_explicit(&srv->cache, memory_order_acquire);
+    for (int i = 0; cache != NULL && i < CACHE_SHARDS; i++) {
+        cache_shard *shard = &cache[i];
+        pthread_mutex_lock(&shard->lock);
+        hits += shard->hits;
+        misses += shard->misses;
+        evictions += shard->evictions;
+        cached += shard->num_entries;
+        cache_used += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    uint64_t last_empty = atomic_load_explicit(&srv->last_empty, memory_order_relaxed);
+    json_printf(&text, "\"overload\":{\"max_queued\":%zu,\"target_ms\":%llu,\"overloaded\":%s,\"shed\":%llu,"
+                 "\"expired\":%llu},",
+                 srv->max_queued, (unsigned long long) (srv->target_delay / 1000000),
+                 srv->target_delay != 0 && queue_depth(&srv->queue) != 0 &&
+                 stats_clock() > last_empty + OVERLOAD_INTERVAL ? "true" : "false",
+                 (unsigned long long) atomic_load_explicit(&srv->shed, memory_order_relaxed),
+                 (unsigned long long) atomic_load_explicit(&srv->expired, memory_order_relaxed));
+    json_printf(&text, "\"loops\":[");
+    for (int i = 0; srv->loops != NULL && i < srv->num_loops; i++) {
+        json_printf(&text, "%s{\"cpu\":%d,\"io\":\"%s\",\"accepted\":%llu}", i == 0 ? "" : ",",
+                     srv->loops[i].cpu, srv->loops[i].ring != NULL ? "io_uring" : "epoll",
+                     (unsigned long long) atomic_load_explicit(&srv->loops[i].accepted, memory_order_relaxed));
+    }
+    json_printf(&text, "],");
+    json_printf(&text, "\"cache\":{\"max_bytes\":%zu,\"bytes\":%zu,\"entries\":%zu,\"hits\":%llu,"
+                 "\"misses\":%llu,\"evictions\":%llu},",
+                 cache != NULL ? srv->cache_bytes : 0, cache_used, cached, (unsigned long long) hits,
+                 (unsigned long long) misses, (unsigned long long) evictions);
+
+    registry_reader *reader;
+    rpc_registry *reg = registry_enter(srv, &reader);
+    size_t num_shards = 0, num_conns = 0;
+    pthread_mutex_lock(&srv->stats_lock);
+    for (stats_shard *shard = srv->shards; shard != NULL; shard = shard->next) {
+        num_shards++;
+    }
+    for (rpc_conn *conn = srv->conns; conn != NULL; conn = conn->next) {
+        num_conns++;
+    }
+    handler_stats **metrics = malloc(reg->num_entries * num_shards * sizeof(handler_stats *) + 1);
+    conn_stats *conns = malloc(num_conns * sizeof(conn_stats) + 1);
+    hist *latency = malloc(sizeof(hist));
+    if (metrics == NULL || conns == NULL || latency == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    /* A shard's handler metrics stay put once allocated, though stats_grow
+     * may move the array pointing to them */
+    size_t k = 0;
+    for (stats_shard *shard = srv->shards; shard != NULL; shard = shard->next, k++) {
+        for (size_t i = 0; i < reg->num_entries; i++) {
+            metrics[i * num_shards + k] = i < shard->num_handlers ?
+                                          atomic_load_explicit(&shard->handlers[i], memory_order_acquire) : NULL;
+        }
+    }
+    k = 0;
+    for (rpc_conn *conn = srv->conns; conn != NULL; conn = conn->next, k++) {
+        conn_stats *cs = &conns[k];
+        cs->id = conn->id;
+        memcpy(cs->peer, conn->peer, sizeof(cs->peer));
+        cs->loop = conn->loop->index;
+        cs->shm = conn->shm != NULL;
+        cs->calls = atomic_load_explicit(&conn->calls, memory_order_relaxed);
+        cs->errors = atomic_load_explicit(&conn->errors, memory_order_relaxed);
+        cs->bytes_in = atomic_load_explicit(&conn->bytes_in, memory_order_relaxed);
+        cs->bytes_out = atomic_load_explicit(&conn->bytes_out, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&srv->stats_lock);
+
+    json_printf(&text, "\"handlers\":[");
+    for (size_t i = 0; i < reg->num_entries; i++) {
+        rpc_entry *entry = &reg->entries[i];
+        uint64_t calls = 0, errors = 0, bytes_in = 0, bytes_out = 0;
+        zip_stats zip_in = {0, 0, 0}, zip_out = {0, 0, 0};
+        hist_init(latency);
+        for (k = 0; k < num_shards; k++) {
+            handler_stats *hs = metrics[i * num_shards + k];
+            if (hs == NULL) {
+                continue;
+            }
+            calls += __atomic_load_n(&hs->calls, __ATOMIC_RELAXED);
+            errors += __atomic_load_n(&hs->errors, __ATOMIC_RELAXED);
+            bytes_in += __atomic_load_n(&hs->bytes_in, __ATOMIC_RELAXED);
+            bytes_out += __atomic_load_n(&hs->bytes_out, __ATOMIC_RELAXED);
+            zip_in.raw += __atomic_load_n(&hs->zip_in.raw, __ATOMIC_RELAXED);
+            zip_in.wire += __atomic_load_n(&hs->zip_in.wire, __ATOMIC_RELAXED);
+            zip_in.ns += __atomic_load_n(&hs->zip_in.ns, __ATOMIC_RELAXED);
+            zip_out.raw += __atomic_load_n(&hs->zip_out.raw, __ATOMIC_RELAXED);
+            zip_out.wire += __atomic_load_n(&hs->zip_out.wire, __ATOMIC_RELAXED);
+            zip_out.ns += __atomic_load_n(&hs->zip_out.ns, __ATOMIC_RELAXED);
+            hist_merge(latency, &hs->latency);
+        }
+
+        json_printf(&text, "%s\n{\"name\":", i == 0 ? "" : ",");
+        json_string(&text, reg->names + entry->name_off);
+        json_printf(&text, ",\"id\":%zu,\"calls\":%llu,\"errors\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,",
+                     i, (unsigned long long) calls, (unsigned long long) errors,
+                     (unsigned long long) bytes_in, (unsigned long long) bytes_out);
+        json_printf(&text, "\"compression\":{");
+        json_zip(&text, "in", &zip_in);
+        json_printf(&text, ",");
+        json_zip(&text, "out", &zip_out);
+        json_printf(&text, "},");
+        json_printf(&text, "\"latency_ns\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,"
+                     "\"p99\":%llu,\"p999\":%llu,\"max\":%llu},\"histogram\":[",
+                     (unsigned long long) latency->total,
+                     latency->total == 0 ? 0.0 : (double) latency->sum / latency->total,
+                     (unsigned long long) hist_percentile(latency, 0.5),
+                     (unsigned long long) hist_percentile(latency, 0.9),
+                     (unsigned long long) hist_percentile(latency, 0.99),
+                     (unsigned long long) hist_percentile(latency, 0.999),
+                     (unsigned long long) latency->max);
+        int first = 1;
+        for (size_t b = 0; b < HIST_BUCKETS; b++) {
+            if (latency->counts[b] != 0) {
+                json_printf(&text, "%s[%llu,%llu]", first ? "" : ",",
+                             (unsigned long long) hist_bucket_max(b), (unsigned long long) latency->counts[b]);
+                first = 0;
+            }
+        }
+        json_printf(&text, "]}");
+    }
+    registry_exit(reader);
+    free(metrics);
+
+    json_printf(&text, "],\n\"connections\":[");
+    for (k = 0; k < num_conns; k++) {
+        conn_stats *cs = &conns[k];
+        json_printf(&text, "%s\n{\"id\":%llu,\"peer\":\"%s\",\"loop\":%d,\"shm\":%s,\"calls\":%llu,"
+                     "\"errors\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu}",
+                     k == 0 ? "" : ",", (unsigned long long) cs->id, cs->peer, cs->loop, cs->shm ? "true" : "false",
+                     (unsigned long long) cs->calls, (unsigned long long) cs->errors,
+                     (unsigned long long) cs->bytes_in, (unsigned long long) cs->bytes_out);
+    }
+    free(conns);
+    json_printf(&text, "]}\n");
+    free(latency);
+
+    rpc_data *result = rpc_data_alloc(0);
+    result->data2 = text.buf;
+    result->data2_len = text.len;
+    return result;
+}
+
+/* Handler registered as __trace. The worker recognises it and calls
+ * trace_report instead.
+ * */
+rpc_data *trace_handler(rpc_data *payload) {
+    return NULL;
+}
+
+/* Reply of __trace: data2 is the Chrome trace JSON of every span recorded
+ * in this process, as rpc_trace_dump writes it.
+ * */
+rpc_data *trace_report(void) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (out == NULL) {
+        return NULL;
+    }
+    int s = trace_write(out);
+    if (fclose(out) != 0 || s < 0) {
+        free(buf);
+        return NULL;
+    }
+
+    rpc_data *result = rpc_data_alloc(0);
+    result->data2 = buf;
+    result->data2_len = len;
+    return result;
+}
+
+/* Samples one in every `every` calls made or served by this process for
+ * tracing, or stops when every is 0.
+ * */
+void rpc_trace_sample(unsigned every) {
+    trace_configure();
+    trace_set_rate(every);
+}
+
+/* Writes the spans of recently traced calls to a file as Chrome trace JSON.
+ * Returns -1 if the file cannot be written.
+ * */
+int rpc_trace_dump(const char *path) {
+    if (path == NULL) {
+        return -1;
+    }
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    int s = trace_write(out);
+    if (fclose(out) != 0) {
+        return -1;
+    }
+    return s;
+}
+
+/* This function runs the server event loops.
+ * Sockets are non-blocking and registered edge-triggered with epoll, so a
+ * single thread multiplexes a listener and every client connection it
+ * accepts. With several loops each listens on its own SO_REUSEPORT socket.
+ * Decoded calls are handed to the worker pool.
+ * */
+void rpc_serve_all(rpc_server *srv) {
+    pthread_mutex_lock(&srv->registry_lock);
+    srv->serving = 1;
+    cache_init(srv);
+    registry_publish(srv);
+    pthread_mutex_unlock(&srv->registry_lock);
+    atomic_store(&srv->last_empty, stats_clock());
+
+    /* One loop per CPU the server may run on, unless set otherwise */
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &srv->cpus) != 0) {
+        CPU_ZERO(&srv->cpus);
+        CPU_SET(0, &srv->cpus);
+    }
+    int num_cpus = CPU_COUNT(&srv->cpus);
+    int num_loops = srv->num_loops != 0 ? srv->num_loops : num_cpus;
+    srv->num_loops = num_loops;
+    srv->loops = calloc(num_loops, sizeof(rpc_loop));
+    if (srv->loops == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_loops; i++) {
+        rpc_loop *loop = &srv->loops[i];
+        loop->srv = srv;
+        loop->index = i;
+        loop->epoll_fd = -1;
+        loop->listen_fd = i == 0 ? srv->srv_socket : listen_shard(srv->srv_socket);
+        loop->cpu = -1;
+        atomic_init(&loop->accepted, 0);
+
+        /* The i-th CPU allowed, wrapping around if loops outnumber them */
+        int nth = i % num_cpus;
+        for (int cpu = 0; num_loops > 1 && cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &srv->cpus) && nth-- == 0) {
+                loop->cpu = cpu;
+                break;
+            }
+        }
+    }
+
+    /* Server starts listening */
+    for (int i = 0; i < num_loops; i++) {
+        int socket_fd = srv->loops[i].listen_fd;
+        if (listen(socket_fd, LISTEN_BACKLOG) < 0) {
+            perror("server listen");
+            exit(EXIT_FAILURE);
+        }
+        if (fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK) < 0) {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (srv->unix_socket != -1) {
+        if (listen(srv->unix_socket, LISTEN_BACKLOG) < 0) {
+            perror("server listen");
+            exit(EXIT_FAILURE);
+        }
+        if (fcntl(srv->unix_socket, F_SETFL, fcntl(srv->unix_socket, F_GETFL) | O_NONBLOCK) < 0) {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < srv->min_workers; i++) {
+        start_worker(srv);
+    }
+
+    /* The first loop runs on this thread, the others on their own */
+    for (int i = 1; i < num_loops; i++) {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, loop_main, &srv->loops[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread_id);
+    }
+    loop_main(&srv->loops[0]);
+}
+
+/* Open another listener on the address of the server's TCP socket, for a
+ * loop of its own. SO_REUSEPORT lets the kernel spread new connections
+ * across all of them.
+ * */
+int listen_shard(int socket_fd) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int enable = 1;
+    if (getsockname(socket_fd, (struct sockaddr *) &addr, &addr_len) < 0 ||
+        setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+    int shard_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (shard_fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (setsockopt(shard_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0 ||
+        setsockopt(shard_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+    if (bind(shard_fd, (struct sockaddr *) &addr, addr_len) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    return shard_fd;
+}
+
+/* Run one event loop of rpc_serve_all: pin it to its CPU, then serve its
+ * listeners and the connections it accepts, forever, on io_uring or epoll.
+ * A pinned loop's lookups copy the registry into memory local to it.
+ * */
+void *loop_main(void *arg) {
+    rpc_loop *loop = (rpc_loop *) arg;
+    rpc_server *srv = loop->srv;
+    struct epoll_event events[MAX_EVENTS];
+
+    io_thread = 1;
+    if (loop->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(loop->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+    }
+    current_loop = loop;
+
+    /* On io_uring if asked for and this kernel has it, else on epoll */
+    if (srv->uring && uring_start(loop) == 0) {
+        uring_run(loop);
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = &srv->unix_socket;
+    if (loop->index == 0 && srv->unix_socket != -1 &&
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, srv->unix_socket, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        int num_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        atomic_fetch_add_explicit(&io_syscalls, 1, memory_order_relaxed);
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            rpc_conn *conn = events[i].data.ptr;
+
+            /* Listener is ready */
+            if (conn == NULL) {
+                accept_clients(loop, loop->listen_fd);
+                continue;
+            }
+            if (events[i].data.ptr == &srv->unix_socket) {
+                accept_clients(loop, srv->unix_socket);
+                continue;
+            }
+
+            /* Once frames go through shared memory, the socket only carries
+             * the client's wake-ups, and tells when it goes */
+            int closed = 0;
+            int hangup = (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+            if (conn->shm != NULL) {
+                if (((events[i].events & EPOLLIN) || hangup) &&
+                    (shm_doorbell(conn, hangup) < 0 || shm_serve(conn) < 0)) {
+                    conn_close(srv, conn);
+                }
+                continue;
+            }
+
+            /* Client is ready: read, handle complete commands, then reply */
+            if ((events[i].events & EPOLLIN) || hangup) {
+                int tracing = trace_enabled();
+                if (tracing) {
+                    conn->recv_start = stats_clock();
+                }
+                closed = conn_fill(conn, hangup) < 0;
+                if (tracing) {
+                    conn->recv_end = stats_clock();
+                }
+                if (rpc_handle_client(srv, conn) < 0) {
+                    closed = 1;
+                }
+            }
+            pthread_mutex_lock(&conn->out_lock);
+            if (conn_flush(conn) < 0) {
+                closed = 1;
+            }
+            pthread_mutex_unlock(&conn->out_lock);
+            if (!closed) {
+                conn_pump(conn);
+            }
+
+            /* The client may just have moved onto shared memory */
+            if (!closed && conn->shm != NULL && shm_serve(conn) < 0) {
+                closed = 1;
+            }
+            if (closed) {
+                conn_close(srv, conn);
+            }
+        }
+    }
+}
+
+/* Set up the loop's io_uring and its receive buffers, and start accepting
+ * on its listeners.
+ * Returns -1 if io_uring is unavailable, leaving the loop on epoll.
+ * */
+int uring_start(rpc_loop *loop) {
+    uring *ring = malloc(sizeof(uring));
+    if (ring == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    if (uring_init(ring, URING_ENTRIES) < 0) {
+        free(ring);
+        return -1;
+    }
+    if (uring_bufs_init(ring, &loop->bufs, URING_BGID, URING_BUFS, URING_BUF_LEN) < 0) {
+        uring_free(ring);
+        free(ring);
+        return -1;
+    }
+    loop->ring = ring;
+    uring_accept(loop, loop->listen_fd);
+    if (loop->index == 0 && loop->srv->unix_socket != -1) {
+        uring_accept(loop, loop->srv->unix_socket);
+    }
+    return 0;
+}
+
+/* Take a free SQE of the loop's ring, which only stays full if the ring
+ * is broken.
+ * */
+struct io_uring_sqe *uring_get(rpc_loop *loop) {
+    struct io_uring_sqe *sqe = uring_sqe(loop->ring);
+    if (sqe == NULL) {
+        perror("io_uring_enter");
+        exit(EXIT_FAILURE);
+    }
+    return sqe;
+}
+
+/* Accept connections on a listener for as long as the request lasts.
+ * */
+void uring_accept(rpc_loop *loop, int listen_fd) {
+    struct io_uring_sqe *sqe = uring_get(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t) listen_fd << URING_TAG_BITS | URING_ACCEPT;
+}
+
+/* Receive into the ring's buffers from a connection for as long as the
+ * request lasts.
+ * */
+void uring_recv(rpc_loop *loop, rpc_conn *conn) {
+    atomic_fetch_add(&conn->refs, 1);
+    struct io_uring_sqe *sqe = uring_get(loop);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t) conn | URING_RECV;
+}
+
+/* Poll a connection, edge-triggered, for room to send and for hang-ups,
+ * and on a Unix socket for input too, for as long as the request lasts.
+ * */
+void uring_poll(rpc_loop *loop, rpc_conn *conn) {
+    uint32_t events = POLLOUT | POLLRDHUP | EPOLLET | (conn->unix_socket ? POLLIN : 0);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = events << 16 | events >> 16;
+#endif
+    atomic_fetch_add(&conn->refs, 1);
+    struct io_uring_sqe *sqe = uring_get(loop);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->socket;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = (uintptr_t) conn | URING_POLL;
+}
+
+/* Start the requests the ring serves a new connection with. Bytes from a
+ * TCP client land in the ring's buffers; a Unix socket is read with
+ * recvmsg, for the descriptors passed along, whenever the poll says so.
+ * Each request holds a reference to the connection until it ends.
+ * */
+void uring_watch(rpc_loop *loop, rpc_conn *conn) {
+    if (!conn->unix_socket) {
+        uring_recv(loop, conn);
+    }
+    uring_poll(loop, conn);
+}
+
+/* Cancel every request of a closed connection. The cancellation holds a
+ * reference too, so the descriptor it names cannot be reused meanwhile.
+ * */
+void uring_cancel(rpc_loop *loop, rpc_conn *conn) {
+    atomic_fetch_add(&conn->refs, 1);
+    struct io_uring_sqe *sqe = uring_get(loop);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = conn->socket;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = (uintptr_t) conn | URING_CANCEL;
+}
+
+/* Hand the connection's queued output to the kernel as one SEND, unless
+ * one is already in flight. The output becomes the flight, which stays
+ * untouched until the SEND completes, while later replies queue behind it.
+ * */
+void uring_send(rpc_loop *loop, rpc_conn *conn) {
+    if (conn->closing || conn->shm != NULL) {
+        return;
+    }
+    pthread_mutex_lock(&conn->out_lock);
+    if (conn->flight_len == 0 && conn->out_off < conn->out_len) {
+        char *buf = conn->flight;
+        size_t cap = conn->flight_cap;
+        conn->flight = conn->out;
+        conn->flight_cap = conn->out_cap;
+        conn->flight_off = conn->out_off;
+        conn->flight_len = conn->out_len;
+        conn->out = buf;
+        conn->out_cap = cap;
+        conn->out_off = 0;
+        conn->out_len = 0;
+    }
+    if (!conn->sending && conn->flight_off < conn->flight_len) {
+        size_t len = conn->flight_len - conn->flight_off;
+        atomic_fetch_add(&conn->refs, 1);
+        struct io_uring_sqe *sqe = uring_get(loop);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->socket;
+        sqe->addr = (uintptr_t) (conn->flight + conn->flight_off);
+        sqe->len = len < UINT32_MAX ? len : UINT32_MAX;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = (uintptr_t) conn | URING_SEND;
+        conn->sending = 1;
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+}
+
+/* Copy bytes a receive put in one of the ring's buffers to the
+ * connection's input.
+ * */
+void conn_append(rpc_conn *conn, const char *bytes, size_t len) {
+    if (conn->in_cap - conn->in_len < len) {
+        conn->in_cap = conn->in_len + (len > READ_CHUNK ? len : READ_CHUNK);
+        conn->in = realloc(conn->in, conn->in_cap);
+        if (conn->in == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(conn->in + conn->in_len, bytes, len);
+    conn->in_len += len;
+    atomic_fetch_add_explicit(&conn->bytes_in, len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&wire_bytes, len, memory_order_relaxed);
+}
+
+/* Take what a receive of the connection returned and serve the frames it
+ * completes, then send the replies the loop made along the way.
+ * Returns 1 if the connection should close.
+ * */
+int uring_received(rpc_loop *loop, rpc_conn *conn, struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !conn->closing && conn->shm == NULL) {
+            conn_append(conn, uring_buf(&loop->bufs, bid), cqe->res);
+        }
+        uring_buf_recycle(&loop->bufs, bid);
+    }
+    if (conn->closing || cqe->res == -ENOBUFS) {
+        /* Out of buffers, the request ends and starts again */
+        return 0;
+    }
+
+    /* Once frames go through shared memory, the socket only carries the
+     * client's wake-ups, and tells when it goes */
+    if (cqe->res <= 0) {
+        return 1;
+    }
+    if (conn->shm != NULL) {
+        return shm_serve(conn) < 0;
+    }
+    if (trace_enabled()) {
+        conn->recv_start = stats_clock();
+        conn->recv_end = conn->recv_start;
+    }
+    if (rpc_handle_client(loop->srv, conn) < 0) {
+        return 1;
+    }
+    uring_send(loop, conn);
+
+    /* The client may just have moved onto shared memory */
+    return conn->shm != NULL && shm_serve(conn) < 0;
+}
+
+/* Act on a poll of the connection: send queued output the socket has room
+ * for again, and read a Unix socket that has input.
+ * Returns 1 if the connection should close.
+ * */
+int uring_polled(rpc_loop *loop, rpc_conn *conn, struct io_uring_cqe *cqe) {
+    if (conn->closing) {
+        return 0;
+    }
+    if (cqe->res < 0) {
+        return 1;
+    }
+    int hangup = (cqe->res & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+    if (conn->shm != NULL) {
+        return (cqe->res & POLLIN) || hangup;
+    }
+    if (conn->unix_socket && ((cqe->res & POLLIN) || hangup)) {
+        int tracing = trace_enabled();
+        if (tracing) {
+            conn->recv_start = stats_clock();
+        }
+        int closed = conn_fill(conn, hangup) < 0;
+        if (tracing) {
+            conn->recv_end = stats_clock();
+        }
+        if (rpc_handle_client(loop->srv, conn) < 0) {
+            closed = 1;
+        }
+        uring_send(loop, conn);
+        return closed;
+    }
+
+    /* A TCP client's receive sees the end of its stream */
+    conn_pump(conn);
+    uring_send(loop, conn);
+    return (cqe->res & (POLLHUP | POLLERR)) != 0;
+}
+
+/* Account for a finished SEND of the connection's flight, and hand the
+ * kernel what is left of it or was queued meanwhile.
+ * Returns 1 if the connection should close.
+ * */
+int uring_sent(rpc_loop *loop, rpc_conn *conn, struct io_uring_cqe *cqe) {
+    pthread_mutex_lock(&conn->out_lock);
+    conn->sending = 0;
+    if (cqe->res > 0) {
+        conn->flight_off += cqe->res;
+        if (conn->flight_off == conn->flight_len) {
+            conn->flight_off = 0;
+            conn->flight_len = 0;
+        }
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+    if (conn->closing || cqe->res == -EAGAIN) {
+        /* The poll resumes the flight once the socket has room */
+        return 0;
+    }
+    if (cqe->res <= 0) {
+        return 1;
+    }
+    conn_pump(conn);
+    uring_send(loop, conn);
+    return 0;
+}
+
+/* Handle one completion of the loop's ring. A request that ended is
+ * started again while its connection stays open, and otherwise drops its
+ * reference to it.
+ * */
+void uring_complete(rpc_loop *loop, struct io_uring_cqe *cqe) {
+    int tag = cqe->user_data & URING_TAGS;
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if (tag == URING_ACCEPT) {
+        int listen_fd = (int) (cqe->user_data >> URING_TAG_BITS);
+        if (cqe->res >= 0) {
+            conn_open(loop, cqe->res, listen_fd);
+        }
+        if (!more) {
+            uring_accept(loop, listen_fd);
+        }
+        return;
+    }
+
+    rpc_conn *conn = (rpc_conn *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_TAGS);
+    int closed = 0;
+    if (tag == URING_RECV) {
+        closed = uring_received(loop, conn, cqe);
+    } else if (tag == URING_POLL) {
+        closed = uring_polled(loop, conn, cqe);
+    } else if (tag == URING_SEND) {
+        closed = uring_sent(loop, conn, cqe);
+    }
+    if (closed && !conn->closing) {
+        conn_close(loop->srv, conn);
+    }
+    if (more) {
+        return;
+    }
+    if (!conn->closing && tag == URING_RECV) {
+        uring_recv(loop, conn);
+    } else if (!conn->closing && tag == URING_POLL) {
+        uring_poll(loop, conn);
+    }
+    conn_release(conn);
+}
+
+/* Run the loop on its io_uring. A batch of completions is read from the
+ * CQ without system calls, and the sends and requests it leads to go to
+ * the kernel in the same io_uring_enter that waits for the next batch.
+ * */
+void uring_run(rpc_loop *loop) {
+    while (1) {
+        if (uring_enter(loop->ring, 1) < 0) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        atomic_fetch_add_explicit(&io_syscalls, 1, memory_order_relaxed);
+
+        /* Copy each CQE out first, freeing its slot for what handling it
+         * leads to */
+        struct io_uring_cqe *next;
+        while ((next = uring_cqe(loop->ring)) != NULL) {
+            struct io_uring_cqe cqe = *next;
+            uring_cqe_seen(loop->ring);
+            uring_complete(loop, &cqe);
+        }
+    }
+}
+
+/* Connect to a server listening on a Unix socket path.
+ * Returns the socket, or -1 on failure.
+ * */
+int connect_unix(const char *path) {
+    struct sockaddr_un sun;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        return -1;
+    }
+    if (connect(sockfd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/* Connect to a server over TCP, returning its resolved address in
+ * servinfo and whether it is on this host in local.
+ * Returns the socket, or -1 on failure.
+ * */
+int connect_tcp(char *addr, int port, struct addrinfo **servinfo_out, int *local) {
+    int sockfd, s;
+    struct addrinfo hints, *servinfo, *rp;
+    char port_str[10];
+    sprintf(port_str, "%d", port);
+
+    /* Create address */
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+
+    s = getaddrinfo(addr, port_str, &hints, &servinfo);
+    if (s != 0) {
+        return -1;
+    }
+
+    /* Connect to first valid result */
+    for (rp = servinfo; rp != NULL; rp = rp->ai_next) {
+        sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sockfd == -1)
+            continue;
+        if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
+            break;
+        close(sockfd);
+    }
+    if (rp == NULL) {
+        freeaddrinfo(servinfo);
+        return -1;
+    }
+
+    /* Every request is a single write, so Nagle would only add delay */
+    int enable = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+    struct in6_addr *server_in6 = &((struct sockaddr_in6 *) rp->ai_addr)->sin6_addr;
+    *local = IN6_IS_ADDR_LOOPBACK(server_in6) ||
+             (IN6_IS_ADDR_V4MAPPED(server_in6) && server_in6->s6_addr[12] == 127);
+    *servinfo_out = servinfo;
+    return sockfd;
+}
+
+/* Open a connection to the server at addr and port, as one member of a
+ * client's pool. An address of the form unix:/path connects to a Unix
+ * socket instead, and the port is ignored.
+ * Returns NULL if the server cannot be reached.
+ * */
+rpc_client *client_connect(char *addr, int port) {
+    int sockfd;
+    struct addrinfo *servinfo = NULL;
+    int local = 0;
+    int unix_socket = strncmp(addr, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0;
+
+    if (unix_socket) {
+        sockfd = connect_unix(addr + strlen(UNIX_PREFIX));
+    } else {
+        sockfd = connect_tcp(addr, port, &servinfo, &local);
+    }
+    if (sockfd == -1) {
+        return NULL;
+    }
+
+    /* Create client */
+    rpc_client *client =  (rpc_client *) malloc(sizeof(rpc_client));
+    if (client == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    client->cli_socket = sockfd;
+    client->addr = strdup(addr);
+    client->port = port;
+    client->server_addr = servinfo;
+    client->in = NULL;
+    client->in_off = 0;
+    client->in_len = 0;
+    client->in_cap = 0;
+    pthread_mutex_init(&client->send_lock, NULL);
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->replied, NULL);
+    client->reading = 0;
+    client->broken = 0;
+    client->next_id = 0;
+    int enable = 1;
+    client->zerocopy = !unix_socket && setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(int)) == 0;
+    memset(client->pending, 0, sizeof(client->pending));
+    client->shm = NULL;
+    client->unix_socket = unix_socket;
+    memset(&client->fds, 0, sizeof(fd_queue));
+    atomic_init(&client->inflight, 0);
+    client->idle_since = stats_clock();
+    pthread_mutex_init(&client->pool_lock, NULL);
+    client->conns = NULL;
+    client->num_conns = 0;
+    client->conns_cap = 0;
+    client->min_conns = 0;
+    client->max_conns = 0;
+    client->connecting = 0;
+    client->compress = 0;
+    client->compact = 0;
+    client->list = 0;
+    client->generation = 0;
+    client->timeout = 0;
+    trace_configure();
+
+    /* A server on this host is asked to take calls over shared memory, if
+     * RPC_SHM opts in */
+    const char *use_shm = getenv("RPC_SHM");
+    if (local && use_shm != NULL && atoi(use_shm) == 1) {
+        client_use_shm(client);
+    }
+
+    /* Compact frames pay everywhere, compression only where the network is
+     * slower than the codec */
+    uint32_t caps = CAP_LIST;
+    const char *use_compact = getenv("RPC_COMPACT");
+    if (use_compact == NULL || strcmp(use_compact, "0") != 0) {
+        caps |= CAP_COMPACT;
+    }
+    const char *use_compress = getenv("RPC_COMPRESS");
+    if (!unix_socket && client->shm == NULL && (use_compress != NULL ? strcmp(use_compress, "0") != 0 : !local)) {
+        caps |= CAP_COMPRESS;
+    }
+    client_hello(client, caps);
+    return client;
+}
+
+/* Create and return a client with corresponding port number and address.
+ * The client is the first connection of its pool, which grows while calls
+ * from many threads keep every connection busy.
+ * */
+rpc_client *rpc_init_client(char *addr, int port) {
+    if (addr == NULL) {
+        return NULL;
+    }
+    rpc_client *client = client_connect(addr, port);
+    if (client == NULL) {
+        perror("failed to connect");
+        exit(EXIT_FAILURE);
+    }
+    client->min_conns = DEFAULT_MIN_CONNS;
+    client->max_conns = DEFAULT_MAX_CONNS;
+    client->conns_cap = DEFAULT_MAX_CONNS;
+    client->conns = malloc(client->conns_cap * sizeof(rpc_client *));
+    if (client->conns == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    client->conns[0] = client;
+    client->num_conns = 1;
+    return client;
+}
+
+/* The connection of a client's pool with the fewest calls in flight,
+ * preferring any that still works. Called with pool_lock held.
+ * */
+rpc_client *client_least_loaded(rpc_client *cl) {
+    rpc_client *best = NULL;
+    unsigned best_load = 0;
+    int best_broken = 1;
+    for (size_t i = 0; i < cl->num_conns; i++) {
+        rpc_client *conn = cl->conns[i];
+        unsigned load = atomic_load_explicit(&conn->inflight, memory_order_relaxed);
+        int broken = __atomic_load_n(&conn->broken, __ATOMIC_RELAXED);
+        if (best == NULL || broken < best_broken || (broken == best_broken && load < best_load)) {
+            best = conn;
+            best_load = load;
+            best_broken = broken;
+        }
+    }
+    return best;
+}
+
+/* Add a newly opened connection to a client's pool, or close it if the
+ * pool has no room left. Called with pool_lock held.
+ * Returns -1 if the connection was closed.
+ * */
+int client_pool_add(rpc_client *cl, rpc_client *conn) {
+    if (cl->num_conns >= (size_t) cl->max_conns) {
+        client_close_conn(conn);
+        return -1;
+    }
+    if (cl->num_conns == cl->conns_cap) {
+        cl->conns_cap *= 2;
+        cl->conns = realloc(cl->conns, cl->conns_cap * sizeof(rpc_client *));
+        if (cl->conns == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    conn->timeout = __atomic_load_n(&cl->timeout, __ATOMIC_RELAXED);
+    cl->conns[cl->num_conns++] = conn;
+    return 0;
+}
+
+/* Choose the connection of a client's pool for the next call, and count
+ * the call against it until client_done. The pool opens another connection
+ * while even the least loaded one has POOL_GROW_CALLS calls in flight, and
+ * closes one that failed, or that sat idle for POOL_IDLE_SEC while the pool
+ * is above min_conns, once no call uses it. The client itself is never
+ * closed, so calls fall back to it.
+ * */
+rpc_client *client_pick(rpc_client *cl) {
+    uint64_t now = stats_clock();
+    rpc_client *retired = NULL;
+
+    pthread_mutex_lock(&cl->pool_lock);
+    for (size_t i = 1; i < cl->num_conns && retired == NULL; i++) {
+        rpc_client *conn = cl->conns[i];
+        if (atomic_load(&conn->inflight) != 0) {
+            continue;
+        }
+        uint64_t idle = now - __atomic_load_n(&conn->idle_since, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&conn->broken, __ATOMIC_RELAXED) ||
+            (cl->num_conns > (size_t) cl->min_conns && idle >= POOL_IDLE_SEC * 1000000000ULL)) {
+            retired = conn;
+            cl->conns[i] = cl->conns[--cl->num_conns];
+        }
+    }
+    rpc_client *best = client_least_loaded(cl);
+    int grow = !cl->connecting && cl->num_conns < (size_t) cl->max_conns &&
+               (__atomic_load_n(&best->broken, __ATOMIC_RELAXED) ||
+                atomic_load_explicit(&best->inflight, memory_order_relaxed) >= POOL_GROW_CALLS);
+    if (grow) {
+        cl->connecting = 1;
+    } else {
+        atomic_fetch_add(&best->inflight, 1);
+    }
+    pthread_mutex_unlock(&cl->pool_lock);
+    if (retired != NULL) {
+        client_close_conn(retired);
+    }
+    if (!grow) {
+        return best;
+    }
+
+    /* Connect without holding up other calls */
+    rpc_client *conn = client_connect(cl->addr, cl->port);
+    pthread_mutex_lock(&cl->pool_lock);
+    cl->connecting = 0;
+    if (conn != NULL && client_pool_add(cl, conn) == 0) {
+        best = conn;
+    } else {
+        best = client_least_loaded(cl);
+    }
+    atomic_fetch_add(&best->inflight, 1);
+    pthread_mutex_unlock(&cl->pool_lock);
+    return best;
+}
+
+/* Finish a call counted against a connection by client_pick. The
+ * connection may be closed as soon as its count drops, so it is not
+ * touched afterwards.
+ * */
+void client_done(rpc_client *conn) {
+    __atomic_store_n(&conn->idle_since, stats_clock(), __ATOMIC_RELAXED);
+    atomic_fetch_sub(&conn->inflight, 1);
+}
+
+/* Sets the bounds of a client's connection pool, and opens connections
+ * up to min_conns now.
+ * Returns -1 with invalid bounds, or if a connection could not be opened.
+ * */
+int rpc_client_set_pool(rpc_client *cl, int min_conns, int max_conns) {
+    if (cl == NULL || cl->conns == NULL || min_conns < 1 || max_conns < min_conns) {
+        return -1;
+    }
+    pthread_mutex_lock(&cl->pool_lock);
+    cl->min_conns = min_conns;
+    cl->max_conns = max_conns;
+    size_t missing = cl->num_conns < (size_t) min_conns ? min_conns - cl->num_conns : 0;
+    pthread_mutex_unlock(&cl->pool_lock);
+
+    for (size_t i = 0; i < missing; i++) {
+        rpc_client *conn = client_connect(cl->addr, cl->port);
+        if (conn == NULL) {
+            return -1;
+        }
+        pthread_mutex_lock(&cl->pool_lock);
+        client_pool_add(cl, conn);
+        pthread_mutex_unlock(&cl->pool_lock);
+    }
+    return 0;
+}
+
+/* Offer the server shared memory to exchange frames through instead of the
+ * socket. The region is created under a fresh name, which the server
+ * unlinks once it has mapped it. The client stays on the socket if the
+ * server says NULL.
+ * */
+void client_use_shm(rpc_client *cl) {
+    static atomic_uint shm_seq;
+    char name[SHM_NAME_MAX];
+    snprintf(name, sizeof(name), SHM_PREFIX "%d-%u", (int) getpid(), atomic_fetch_add(&shm_seq, 1));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, sizeof(shm_region)) == 0) {
+        map = mmap(NULL, sizeof(shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name);
+        return;
+    }
+    shm_region *shm = (shm_region *) map;
+    shm->magic = SHM_MAGIC;
+    shm->ring_size = SHM_RING;
+
+    char frame[FRAME_HEADER_LEN];
+    frame_header hdr = {.len = strlen(name), .op = OP_SHM, .flags = 0};
+    struct iovec iov[2];
+    iov[0].iov_base = frame;
+    iov[0].iov_len = FRAME_HEADER_LEN;
+    iov[1].iov_base = name;
+    iov[1].iov_len = hdr.len;
+    rpc_future *f = client_send(cl, &hdr, iov, 2);
+    int accepted = 0;
+    if (f != NULL) {
+        pthread_mutex_lock(&cl->lock);
+        client_await(cl, f);
+        pthread_mutex_unlock(&cl->lock);
+        accepted = f->op == OP_YESS;
+        rpc_data_free(f->result);
+        pool_free(f);
+    }
+    shm_unlink(name);
+    if (!accepted) {
+        munmap(map, sizeof(shm_region));
+        return;
+    }
+    cl->shm = shm;
+    cl->zerocopy = 0;
+}
+
+/* Offer the server the capabilities in caps, and use those it accepts.
+ * If the server declines with NULL, none are used.
+ * */
+void client_hello(rpc_client *cl, uint32_t caps) {
+    char frame[FRAME_HEADER_LEN + sizeof(uint32_t)];
+    frame_header hdr = {.len = sizeof(uint32_t), .op = OP_HELLO, .flags = 0};
+    uint32_t caps_nwb = htonl(caps);
+    memcpy(frame + FRAME_HEADER_LEN, &caps_nwb, sizeof(uint32_t));
+    struct iovec iov = {.iov_base = frame, .iov_len = sizeof(frame)};
+    rpc_future *f = client_send(cl, &hdr, &iov, 1);
+    if (f == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cl->lock);
+    client_await(cl, f);
+    pthread_mutex_unlock(&cl->lock);
+    uint32_t accepted = f->op == OP_YESS ? f->func_id & caps : 0;
+    cl->compress = (accepted & CAP_COMPRESS) != 0;
+    cl->compact = (accepted & CAP_COMPACT) != 0;
+    cl->list = (accepted & CAP_LIST) != 0;
+    cl->generation = f->generation;
+    rpc_data_free(f->result);
+    pool_free(f);
+}
+
+/* Sets the timeout of every call started on the client from now on, and
+ * of rpc_find, or clears it with 0.
+ * */
+int rpc_client_set_timeout(rpc_client *cl, unsigned timeout_ms) {
+    if (cl == NULL || cl->conns == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&cl->pool_lock);
+    for (size_t i = 0; i < cl->num_conns; i++) {
+        __atomic_store_n(&cl->conns[i]->timeout, timeout_ms * 1000000ULL, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cl->pool_lock);
+    return 0;
+}
+
+/* Whether the server end of the socket is still open.
+ * */
+int client_alive(rpc_client *cl) {
+    char c;
+    ssize_t num_bytes = recv(cl->cli_socket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return num_bytes > 0 || (num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+}
+
+/* Read whatever reply bytes are available into buf, waiting for at least
+ * one, from the reply ring or else the socket. Descriptors passed on a
+ * Unix socket are kept for the frames they belong to. The wait ends at the
+ * deadline, unless it is 0.
+ * Returns the number of bytes read, 0 if the wait ended first, or -1 if
+ * the connection is closed.
+ * */
+ssize_t client_read(rpc_client *cl, char *buf, size_t len, uint64_t deadline) {
+    if (cl->shm == NULL) {
+        ssize_t num_bytes;
+        if (deadline != 0) {
+            uint64_t now = stats_clock();
+            struct pollfd pfd = {.fd = cl->cli_socket, .events = POLLIN};
+            if (now >= deadline || poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000)) <= 0) {
+                return 0;
+            }
+        }
+        do {
+            if (cl->unix_socket) {
+                num_bytes = recv_fds(cl->cli_socket, buf, len, 0, &cl->fds);
+            } else {
+                num_bytes = recv(cl->cli_socket, buf, len, 0);
+            }
+        } while (num_bytes < 0 && errno == EINTR);
+        return num_bytes <= 0 ? -1 : num_bytes;
+    }
+
+    shm_region *shm = cl->shm;
+    while (1) {
+        ssize_t num_bytes = ring_get(&shm->replies, buf, len);
+        if (num_bytes > 0) {
+            shm_wake(&shm->server_bell);
+            if (__atomic_load_n(&shm->replies_held, __ATOMIC_SEQ_CST)) {
+                client_wake_loop(cl);
+            }
+        }
+        if (num_bytes != 0) {
+            return num_bytes;
+        }
+        if (deadline != 0 && stats_clock() >= deadline) {
+            return 0;
+        }
+        int s = shm_wait(shm, &shm->client_bell, &shm->replies, 0, deadline);
+        if (s < 0 || (s > 0 && !client_alive(cl))) {
+            return -1;
+        }
+    }
+}
+
+/* Send every byte of a message, through the request ring or else the
+ * socket. Called with send_lock held.
+ * Returns the number of sendmsg calls made, or -1 on error.
+ * */
+int client_write(rpc_client *cl, struct iovec *iov, int iovcnt, int flags) {
+    if (cl->shm == NULL) {
+        return send_all(cl->cli_socket, iov, iovcnt, flags);
+    }
+
+    shm_region *shm = cl->shm;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t off = 0;
+        while (off < iov[i].iov_len) {
+            size_t num_bytes = ring_put(&shm->requests, (char *) iov[i].iov_base + off, iov[i].iov_len - off);
+            off += num_bytes;
+            if (num_bytes > 0) {
+                continue;
+            }
+
+            /* Ring full: have the server drain it */
+            client_wake_loop(cl);
+            int s = shm_wait(shm, &shm->client_bell, &shm->requests, 1, 0);
+            if (s < 0 || (s > 0 && !client_alive(cl))) {
+                return -1;
+            }
+        }
+    }
+    client_wake_loop(cl);
+    return 1;
+}
+
+/* Wake the server's event loop if it waits for the client, with a byte on
+ * the socket it sleeps on. Costs no system call while the loop is busy,
+ * and only one of several threads waking it at once sends the byte.
+ * */
+void client_wake_loop(rpc_client *cl) {
+    shm_region *shm = cl->shm;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->loop_waiting, __ATOMIC_RELAXED) == 0 ||
+        __atomic_exchange_n(&shm->loop_waiting, 0, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+    char byte = 0;
+    ssize_t num_bytes;
+    do {
+        num_bytes = send(cl->cli_socket, &byte, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (num_bytes < 0 && errno == EINTR);
+}
+
+/* Read the next frame from the server, waiting until the deadline unless
+ * it is 0. Frames are parsed out of large reads into the client's buffer;
+ * only a trailing partial frame is moved to the front when more room is
+ * needed, and it stays there for the next read if the wait ends first.
+ * The body stays valid until the next read.
+ * Returns 1 if no whole frame arrived by the deadline, or -1 if the
+ * connection is closed or the frame is invalid.
+ * */
+int read_frame(rpc_client *cl, frame_header *hdr, char **body, uint64_t deadline) {
+    while (1) {
+        size_t avail = cl->in_len - cl->in_off;
+        int hdr_len = parse_frame_header(cl->in + cl->in_off, avail, hdr);
+        if (hdr_len < 0) {
+            return -1;
+        }
+        if (hdr_len > 0 && avail - hdr_len >= hdr->len) {
+            *body = cl->in + cl->in_off + hdr_len;
+            cl->in_off += hdr_len + hdr->len;
+            return 0;
+        }
+
+        /* Make room for the rest of the frame */
+        if (cl->in_off > 0) {
+            memmove(cl->in, cl->in + cl->in_off, avail);
+            cl->in_off = 0;
+            cl->in_len = avail;
+        }
+        if (cl->in_cap - cl->in_len < READ_CHUNK) {
+            cl->in_cap = cl->in_len + READ_CHUNK;
+            cl->in = realloc(cl->in, cl->in_cap);
+            if (cl->in == NULL) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t num_bytes = client_read(cl, cl->in + cl->in_len, cl->in_cap - cl->in_len, deadline);
+        if (num_bytes < 0) {
+            return -1;
+        }
+        if (num_bytes == 0) {
+            return 1;
+        }
+        cl->in_len += num_bytes;
+    }
+}
+
+/* Decode a payload into a new rpc_data, copying data2.
+ * Sets used to the number of bytes the payload takes.
+ * Returns NULL if the payload is invalid or does not fit in avail bytes.
+ * */
+rpc_data *decode_payload(const char *buf, size_t avail, size_t *used) {
+    if (avail < PAYLOAD_HEADER_LEN) {
+        return NULL;
+    }
+    rpc_data* result = pool_alloc(sizeof(rpc_data));
+    if (decode_data(buf, result) == 1 || avail - PAYLOAD_HEADER_LEN < result->data2_len) {
+        pool_free(result);
+        return NULL;
+    }
+    if (result->data2_len != 0) {
+        result->data2 = pool_alloc(result->data2_len);
+        memcpy(result->data2, buf + PAYLOAD_HEADER_LEN, result->data2_len);
+    }
+    *used = PAYLOAD_HEADER_LEN + result->data2_len;
+    return result;
+}
+
+/* Decode the payload of a DATA reply into a new rpc_data, decompressing
+ * data2 if the frame is flagged FLAG_COMPRESSED.
+ * Returns NULL if the payload is invalid.
+ * */
+rpc_data *decode_result(frame_header *hdr, char *body) {
+    rpc_data data;
+    size_t wire_len;
+    if (decode_body(hdr, body, hdr->len, &data, &wire_len) < 0) {
+        return NULL;
+    }
+    rpc_data *result = pool_alloc(sizeof(rpc_data));
+    result->data1 = data.data1;
+    result->data2_len = data.data2_len;
+    result->data2 = data.data2_len == 0 ? NULL : pool_alloc(data.data2_len);
+    if (hdr->flags & FLAG_COMPRESSED) {
+        if (unzip_data2(data.data2, wire_len, result->data2, result->data2_len, NULL) < 0) {
+            rpc_data_free(result);
+            return NULL;
+        }
+    } else if (result->data2_len != 0) {
+        memcpy(result->data2, data.data2, result->data2_len);
+    }
+    return result;
+}
+
+/* Decode the payloads of a RSLT reply into a new array of rpc_data*,
+ * with NULL for the calls that failed.
+ * Returns -1 if the reply is invalid.
+ * */
+int decode_results(frame_header *hdr, char *body, rpc_data ***results, uint32_t *num_results) {
+    uint32_t count_nwb;
+    if (hdr->len < sizeof(uint32_t)) {
+        return -1;
+    }
+    memcpy(&count_nwb, body, sizeof(uint32_t));
+    uint32_t count = ntohl(count_nwb);
+    if (count > hdr->len - sizeof(uint32_t)) {
+        return -1;
+    }
+
+    rpc_data **items = pool_alloc(count * sizeof(rpc_data *));
+    memset(items, 0, count * sizeof(rpc_data *));
+    size_t pos = sizeof(uint32_t);
+    uint32_t i;
+    for (i = 0; i < count && pos < hdr->len; i++) {
+        if (body[pos++] != OP_DATA) {
+            continue;
+        }
+        size_t used;
+        items[i] = decode_payload(body + pos, hdr->len - pos, &used);
+        if (items[i] == NULL) {
+            break;
+        }
+        pos += used;
+    }
+
+    /* A malformed reply fails the whole batch */
+    if (i != count || pos != hdr->len) {
+        for (uint32_t j = 0; j < count; j++) {
+            rpc_data_free(items[j]);
+        }
+        pool_free(items);
+        return -1;
+    }
+    *results = items;
+    *num_results = count;
+    return 0;
+}
+
+/* Decode a TABLE reply into its registry generation and, unless the reply
+ * is only the generation, a new registry of the functions it lists, each
+ * at the index of its id.
+ * Returns -1 if the reply is invalid.
+ * */
+int decode_table(frame_header *hdr, char *body, uint64_t *generation, rpc_registry **table) {
+    uint64_t generation_nwb;
+    if (hdr->len < sizeof(uint64_t)) {
+        return -1;
+    }
+    memcpy(&generation_nwb, body, sizeof(uint64_t));
+    *generation = be64toh(generation_nwb);
+    *table = NULL;
+    if (hdr->len == sizeof(uint64_t)) {
+        return 0;
+    }
+
+    uint32_t count_nwb;
+    size_t pos = sizeof(uint64_t);
+    if (hdr->len - pos < sizeof(uint32_t)) {
+        return -1;
+    }
+    memcpy(&count_nwb, body + pos, sizeof(uint32_t));
+    uint32_t count = ntohl(count_nwb);
+    pos += sizeof(uint32_t);
+
+    rpc_registry *reg = malloc(sizeof(rpc_registry));
+    if (reg == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    registry_init(reg);
+    reg->generation = *generation;
+    char name[MAX_BYTES];
+    uint32_t i;
+    for (i = 0; i < count && hdr->len - pos >= TABLE_ENTRY_LEN; i++) {
+        uint32_t id_nwb, flags_nwb;
+        uint16_t name_len_nwb;
+        memcpy(&id_nwb, body + pos, sizeof(uint32_t));
+        memcpy(&flags_nwb, body + pos + sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&name_len_nwb, body + pos + 2 * sizeof(uint32_t), sizeof(uint16_t));
+        size_t name_len = ntohs(name_len_nwb);
+        pos += TABLE_ENTRY_LEN;
+        if (ntohl(id_nwb) != i || name_len == 0 || name_len >= MAX_BYTES || hdr->len - pos < name_len) {
+            break;
+        }
+        memcpy(name, body + pos, name_len);
+        name[name_len] = '\0';
+        registry_add(reg, name, name_len, NULL, ntohl(flags_nwb));
+        pos += name_len;
+    }
+
+    /* A malformed reply is not cached at all */
+    if (i != count || pos != hdr->len) {
+        registry_free(reg);
+        free(reg);
+        return -1;
+    }
+    *table = reg;
+    return 0;
+}
+
+/* Register a new call in flight. A result for rpc_call_into is received
+ * into the caller's rpc_data and buffer.
+ * Returns NULL if the connection is broken.
+ * */
+rpc_future *client_register(rpc_client *cl, rpc_data *into, void *into_buf, size_t into_len) {
+    rpc_future *f = pool_alloc(sizeof(rpc_future));
+    f->cl = cl;
+    f->op = 0;
+    f->result = NULL;
+    f->results = NULL;
+    f->num_results = 0;
+    f->generation = 0;
+    f->table = NULL;
+    f->into = into;
+    f->into_buf = into_buf;
+    f->into_len = into_len;
+    f->receiving = 0;
+    f->discard = 0;
+    f->large_off = 0;
+    f->traced = 0;
+    f->stream = 0;
+    f->items = NULL;
+    f->items_head = 0;
+    f->items_len = 0;
+    f->items_cap = 0;
+    f->consumed = 0;
+    uint64_t timeout = __atomic_load_n(&cl->timeout, __ATOMIC_RELAXED);
+    f->deadline = timeout != 0 ? stats_clock() + timeout : 0;
+
+    /* Register before sending, since any waiting thread may read the reply */
+    pthread_mutex_lock(&cl->lock);
+    if (cl->broken) {
+        pthread_mutex_unlock(&cl->lock);
+        pool_free(f);
+        return NULL;
+    }
+    f->id = cl->next_id++;
+    rpc_future **bucket = &cl->pending[f->id & (PENDING_BUCKETS - 1)];
+    f->next = *bucket;
+    *bucket = f;
+    pthread_mutex_unlock(&cl->lock);
+    return f;
+}
+
+/* Drop the result a call has received so far. Called with cl->lock held.
+ * */
+void client_drop_result(rpc_future *f) {
+    if (f->result != NULL && f->result != f->into) {
+        rpc_data_free(f->result);
+    }
+    f->result = NULL;
+    for (uint32_t i = 0; i < f->num_results; i++) {
+        rpc_data_free(f->results[i]);
+    }
+    pool_free(f->results);
+    f->results = NULL;
+    f->num_results = 0;
+    f->receiving = 0;
+}
+
+/* Fail a call whose request could not be sent, for rpc_wait to collect.
+ * */
+void client_fail(rpc_client *cl, rpc_future *f) {
+    pthread_mutex_lock(&cl->lock);
+    if (f->op == 0) {
+        client_drop_result(f);
+        f->op = OP_NULL;
+    }
+    pthread_mutex_unlock(&cl->lock);
+}
+
+/* Send the request frame of a registered call.
+ * iov[0] must start with frame_header_room bytes for the frame header,
+ * which is written here once the request id is known.
+ * Returns NULL if the call could not be registered.
+ * */
+rpc_future *client_transmit(rpc_client *cl, rpc_future *f, frame_header *hdr, struct iovec *iov, int iovcnt) {
+    if (f == NULL) {
+        return NULL;
+    }
+    hdr->id = f->id;
+    hdr->budget = call_budget(f);
+    encode_header_iov(iov, hdr);
+    uint64_t encoded = f->traced ? stats_clock() : 0;
+    pthread_mutex_lock(&cl->send_lock);
+    int s = client_write(cl, iov, iovcnt, 0);
+    pthread_mutex_unlock(&cl->send_lock);
+    if (f->traced) {
+        trace_span("encode", TRACE_CLIENT, f->id, 0, f->trace_start, encoded);
+        trace_span("send", TRACE_CLIENT, f->id, 0, encoded, stats_clock());
+    }
+    if (s < 0) {
+        client_fail(cl, f);
+    }
+    return f;
+}
+
+/* Send a request frame and register it as a call in flight.
+ * Returns NULL if the request could not be sent.
+ * */
+rpc_future *client_send(rpc_client *cl, frame_header *hdr, struct iovec *iov, int iovcnt) {
+    return client_transmit(cl, client_register(cl, NULL, NULL, 0), hdr, iov, iovcnt);
+}
+
+/* Wait until the kernel has released the buffers of sends made with
+ * MSG_ZEROCOPY, by reading their completions from the error queue.
+ * Zero-copy is turned off if the kernel had to copy anyway, as it does
+ * on loopback.
+ * Returns -1 if the connection is broken.
+ * */
+int zerocopy_wait(rpc_client *cl, uint32_t sends) {
+    uint32_t done = 0;
+    while (done < sends) {
+        struct pollfd pfd = {.fd = cl->cli_socket, .events = 0};
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(cl->cli_socket, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && !(pfd.revents & POLLHUP))) {
+                continue;
+            }
+            return -1;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            done += serr->ee_data - serr->ee_info + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                cl->zerocopy = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Send part of a file on the socket with sendfile, or through the request
+ * ring in pieces read with pread.
+ * Returns -1 on error, or if the file ends early.
+ * */
+int send_file(rpc_client *cl, int fd, off_t offset, size_t len) {
+    if (cl->shm != NULL) {
+        char buf[READ_CHUNK];
+        while (len > 0) {
+            ssize_t num_bytes = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+            if (num_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (num_bytes <= 0) {
+                return -1;
+            }
+            struct iovec iov = {.iov_base = buf, .iov_len = num_bytes};
+            if (client_write(cl, &iov, 1, 0) < 0) {
+                return -1;
+            }
+            offset += num_bytes;
+            len -= num_bytes;
+        }
+        return 0;
+    }
+    int socket = cl->cli_socket;
+    while (len > 0) {
+        ssize_t num_bytes = sendfile(socket, fd, &offset, len);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes <= 0) {
+            return -1;
+        }
+        len -= num_bytes;
+    }
+    return 0;
+}
+
+/* Read len bytes of a file at offset into buf.
+ * Returns -1 on error, or if the file ends early.
+ * */
+int read_chunk(int fd, char *buf, size_t len, off_t offset) {
+    for (size_t off = 0; off < len;) {
+        ssize_t num_bytes = pread(fd, buf + off, len - off, offset + off);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes <= 0) {
+            return -1;
+        }
+        off += num_bytes;
+    }
+    return 0;
+}
+
+/* Send the request of a registered call whose payload is larger than a
+ * frame on a Unix socket: a CALL flagged FLAG_FD, with a descriptor holding
+ * data2 passed alongside. data2 from buf is copied into a sealed memfd,
+ * and a regular file is passed as it is, so the server reads data2 itself
+ * instead of taking it through the socket.
+ * Returns -1 if no descriptor could be passed, and the payload should go
+ * in chunks.
+ * */
+int send_fd_call(rpc_client *cl, rpc_future *f, uint32_t func_id, int data1,
+                 const char *buf, int fd, off_t offset, size_t len) {
+    struct stat st;
+    if (buf != NULL) {
+        fd = memfd_from(buf, len);
+        offset = 0;
+    } else if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fd = -1;
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    char frame[FRAME_HEADER_LEN + sizeof(uint32_t) + FD_HEADER_LEN];
+    frame_header hdr = {.len = sizeof(uint32_t) + FD_HEADER_LEN, .op = OP_CALL, .flags = FLAG_FD,
+                        .budget = call_budget(f), .id = f->id};
+    encode_frame_header(frame, &hdr);
+    uint32_t func_id_nwb = htonl(func_id);
+    memcpy(frame + FRAME_HEADER_LEN, &func_id_nwb, sizeof(uint32_t));
+    encode_fd_header(data1, len, offset, frame + FRAME_HEADER_LEN + sizeof(uint32_t));
+    struct iovec iov = {.iov_base = frame, .iov_len = sizeof(frame)};
+
+    pthread_mutex_lock(&cl->send_lock);
+    ssize_t sent = send_fd(cl->cli_socket, &iov, 1, fd, 0);
+    if (sent > 0 && (size_t) sent < sizeof(frame)) {
+        iov.iov_base = frame + sent;
+        iov.iov_len = sizeof(frame) - sent;
+        sent = send_all(cl->cli_socket, &iov, 1, 0);
+    }
+    pthread_mutex_unlock(&cl->send_lock);
+    if (buf != NULL) {
+        close(fd);
+    }
+    if (sent < 0) {
+        client_fail(cl, f);
+    }
+    return 0;
+}
+
+/* Send the request of a registered call whose payload is larger than a
+ * frame: a CALL flagged FLAG_LARGE with the 64-bit data2 length, then data2
+ * in CHUNK frames. data2 is taken from buf, or with sendfile from fd at
+ * offset when buf is NULL, so it is never copied into a frame. Chunks from
+ * memory go out with MSG_ZEROCOPY where the socket supports it, and buf may
+ * be reused once this returns. If compress is set and the server takes
+ * compressed data2, each chunk is compressed on its own where that pays
+ * off, reading a file's chunks with pread instead.
+ * Returns NULL if the call could not be registered.
+ * */
+rpc_future *send_large(rpc_client *cl, rpc_future *f, uint32_t func_id, int data1,
+                       const char *buf, int fd, off_t offset, size_t len, int compress) {
+    if (f == NULL) {
+        return NULL;
+    }
+    compress = compress && cl->compress;
+    if (cl->unix_socket && send_fd_call(cl, f, func_id, data1, buf, fd, offset, len) == 0) {
+        return f;
+    }
+    char frame[FRAME_HEADER_LEN + sizeof(uint32_t) + LARGE_HEADER_LEN];
+    frame_header hdr = {.len = sizeof(uint32_t) + LARGE_HEADER_LEN, .op = OP_CALL, .flags = FLAG_LARGE,
+                        .budget = call_budget(f), .id = f->id};
+    encode_frame_header(frame, &hdr);
+    uint32_t func_id_nwb = htonl(func_id);
+    memcpy(frame + FRAME_HEADER_LEN, &func_id_nwb, sizeof(uint32_t));
+    encode_large(data1, len, frame + FRAME_HEADER_LEN + sizeof(uint32_t));
+
+    struct iovec iov[2];
+    iov[0].iov_base = frame;
+    iov[0].iov_len = sizeof(frame);
+    char chunk[FRAME_HEADER_LEN];
+    uint32_t zerocopy_sends = 0;
+    char *scratch = compress && buf == NULL ? pool_alloc(CHUNK_SIZE) : NULL;
+
+    pthread_mutex_lock(&cl->send_lock);
+    int s = client_write(cl, iov, 1, 0);
+    for (size_t off = 0, n; s >= 0 && off < len; off += n) {
+        n = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+        const char *raw = buf != NULL ? buf + off : NULL;
+        if (scratch != NULL) {
+            if (read_chunk(fd, scratch, n, offset + off) < 0) {
+                s = -1;
+                break;
+            }
+            raw = scratch;
+        }
+        char *zip = NULL;
+        size_t zip_len = compress ? zip_data2(raw, n, &zip, NULL) : 0;
+        frame_header chunk_hdr = {.len = zip_len != 0 ? zip_len : n, .op = OP_CHUNK,
+                                  .flags = zip_len != 0 ? FLAG_COMPRESSED : 0, .id = f->id};
+        encode_frame_header(chunk, &chunk_hdr);
+        iov[0].iov_base = chunk;
+        iov[0].iov_len = FRAME_HEADER_LEN;
+        if (raw == NULL) {
+            s = client_write(cl, iov, 1, MSG_MORE);
+            if (s >= 0) {
+                s = send_file(cl, fd, offset + off, n);
+            }
+            continue;
+        }
+        iov[1].iov_base = zip_len != 0 ? zip : (char *) raw;
+        iov[1].iov_len = chunk_hdr.len;
+
+        /* Compressed chunks are freed at once, so the kernel copies them,
+         * as it does the header, whose buffer the next chunk reuses */
+        int zerocopy = cl->zerocopy && zip_len == 0 && scratch == NULL;
+        if (zerocopy) {
+            s = client_write(cl, iov, 1, MSG_MORE);
+            if (s >= 0) {
+                s = client_write(cl, iov + 1, 1, MSG_ZEROCOPY);
+            }
+            if (s > 0) {
+                zerocopy_sends += s;
+            }
+        } else {
+            s = client_write(cl, iov, 2, 0);
+        }
+        pool_free(zip);
+    }
+    pool_free(scratch);
+    if (s >= 0 && zerocopy_sends > 0) {
+        s = zerocopy_wait(cl, zerocopy_sends);
+    }
+    if (s < 0) {
+        /* The server is left inside a partial payload, so fail every call */
+        shutdown(cl->cli_socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&cl->send_lock);
+    if (s < 0) {
+        client_fail(cl, f);
+    }
+    return f;
+}
+
+/* Milliseconds left until a call's deadline, to send with its request.
+ * Returns 0, for no deadline, if the call has none or it is beyond what a
+ * frame carries; the client still gives up on time.
+ * */
+uint16_t call_budget(rpc_future *f) {
+    if (f->deadline == 0) {
+        return 0;
+    }
+    uint64_t now = stats_clock();
+    uint64_t ms = f->deadline > now ? (f->deadline - now + 999999) / 1000000 : 1;
+    return ms > MAX_BUDGET_MS ? 0 : (uint16_t) ms;
+}
+
+/* Set errno for a call that failed by timing out, ETIMEDOUT, or by being
+ * shed by an overloaded server, EBUSY.
+ * */
+void call_errno(rpc_future *f) {
+    if (f->op == OP_EXPIRED) {
+        errno = ETIMEDOUT;
+    } else if (f->op == OP_BUSY) {
+        errno = EBUSY;
+    }
+}
+
+/* Remove a call from the client's calls in flight. Called with cl->lock held.
+ * */
+void client_forget(rpc_client *cl, rpc_future *f) {
+    rpc_future **link = &cl->pending[f->id & (PENDING_BUCKETS - 1)];
+    while (*link != NULL) {
+        if (*link == f) {
+            *link = f->next;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/* Add the results of one RSLT frame to those of the earlier frames of the
+ * same batch. Called with cl->lock held.
+ * */
+void client_append_results(rpc_future *f, rpc_data **results, uint32_t num_results) {
+    if (f->results == NULL) {
+        f->results = results;
+        f->num_results = num_results;
+        return;
+    }
+    if (results == NULL) {
+        return;
+    }
+    rpc_data **all = pool_alloc((f->num_results + num_results) * sizeof(rpc_data *));
+    memcpy(all, f->results, f->num_results * sizeof(rpc_data *));
+    memcpy(all + f->num_results, results, num_results * sizeof(rpc_data *));
+    pool_free(f->results);
+    pool_free(results);
+    f->results = all;
+    f->num_results += num_results;
+}
+
+/* Hand a decoded DATA result to its call. The result of rpc_call_into is
+ * copied into the caller's buffer, and fails if it does not fit.
+ * Returns the result the call completes with.
+ * */
+rpc_data *client_deliver(rpc_future *f, rpc_data *result) {
+    if (f->into == NULL || result == NULL) {
+        return result;
+    }
+    if (result->data2_len > f->into_len) {
+        rpc_data_free(result);
+        return NULL;
+    }
+    f->into->data1 = result->data1;
+    f->into->data2_len = result->data2_len;
+    f->into->data2 = result->data2_len == 0 ? NULL : f->into_buf;
+    if (result->data2_len != 0) {
+        memcpy(f->into_buf, result->data2, result->data2_len);
+    }
+    rpc_data_free(result);
+    return f->into;
+}
+
+/* Copy the next CHUNK of a large result into its buffer, decompressing it
+ * if it is flagged FLAG_COMPRESSED, completing the call once data2 is
+ * whole. Called with cl->lock held.
+ * */
+void client_large_chunk(rpc_future *f, const char *body, size_t len, int compressed) {
+    if (!f->receiving) {
+        client_drop_result(f);
+        f->op = OP_NULL;
+        return;
+    }
+    size_t remaining = f->result->data2_len - f->large_off;
+    if (compressed) {
+        size_t n = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+        if (n == 0 || (!f->discard &&
+                       unzip_data2(body, len, (char *) f->result->data2 + f->large_off, n, NULL) < 0)) {
+            client_drop_result(f);
+            f->op = OP_NULL;
+            return;
+        }
+        len = n;
+    } else if (remaining < len) {
+        client_drop_result(f);
+        f->op = OP_NULL;
+        return;
+    } else if (!f->discard) {
+        memcpy((char *) f->result->data2 + f->large_off, body, len);
+    }
+    f->large_off += len;
+    if (f->large_off == f->result->data2_len) {
+        if (f->discard) {
+            client_drop_result(f);
+        }
+        f->receiving = 0;
+        f->op = f->result != NULL ? OP_DATA : OP_NULL;
+    }
+}
+
+/* Start receiving a large DATA result. data2 goes into the caller's buffer
+ * for rpc_call_into, or else into a mapped buffer that rpc_data_free
+ * unmaps. A result that does not fit is read and dropped.
+ * Called with cl->lock held.
+ * */
+void client_begin_large(rpc_future *f, frame_header *hdr, const char *body) {
+    rpc_data head;
+    if (f->receiving || hdr->len != LARGE_HEADER_LEN || decode_large(body, &head) == 1) {
+        f->op = OP_NULL;
+        return;
+    }
+    if (f->into != NULL) {
+        f->result = f->into;
+        f->discard = head.data2_len > f->into_len;
+        head.data2 = head.data2_len == 0 || f->discard ? NULL : f->into_buf;
+    } else {
+        f->result = pool_alloc(sizeof(rpc_data));
+        head.data2 = large_alloc(head.data2_len);
+        f->discard = head.data2 == NULL && head.data2_len != 0;
+    }
+    *f->result = head;
+    f->receiving = 1;
+    f->large_off = 0;
+    client_large_chunk(f, NULL, 0, 0);
+}
+
+/* Decode a DATA result whose data2 was passed as the descriptor fd, which
+ * is closed.
+ * Returns NULL if the header is malformed or data2 cannot be read.
+ * */
+rpc_data *decode_fd_result(frame_header *hdr, char *body, int fd) {
+    rpc_data head;
+    uint64_t offset;
+    if (hdr->len != FD_HEADER_LEN || decode_fd_header(body, &head, &offset) == 1) {
+        close(fd);
+        return NULL;
+    }
+    head.data2 = fd_data2(fd, offset, head.data2_len);
+    close(fd);
+    if (head.data2 == NULL && head.data2_len != 0) {
+        return NULL;
+    }
+    rpc_data *result = pool_alloc(sizeof(rpc_data));
+    *result = head;
+    return result;
+}
+
+/* Read one reply and complete the call it belongs to, giving up at the
+ * deadline unless it is 0. Called by the reading thread without cl->lock
+ * held.
+ * */
+void client_receive(rpc_client *cl, uint64_t deadline) {
+    frame_header hdr;
+    char *body;
+    rpc_data *result = NULL;
+    rpc_data **results = NULL;
+    uint32_t num_results = 0;
+    uint32_t func_id = 0;
+    uint32_t func_flags = 0;
+    uint64_t generation = 0;
+    rpc_registry *table = NULL;
+
+    uint64_t reading = trace_enabled() ? stats_clock() : 0;
+    int s = read_frame(cl, &hdr, &body, deadline);
+    if (s > 0) {
+        return;
+    }
+    uint64_t read = reading != 0 ? stats_clock() : 0;
+    if (s == 0 && hdr.op == OP_DATA && (hdr.flags & FLAG_FD)) {
+        /* Without its descriptor every later frame would take the wrong one */
+        int fd = fd_queue_pop(&cl->fds);
+        if (fd < 0) {
+            s = -1;
+        } else {
+            result = decode_fd_result(&hdr, body, fd);
+        }
+    } else if (s == 0 && hdr.op == OP_DATA && !(hdr.flags & FLAG_LARGE)) {
+        result = decode_result(&hdr, body);
+    } else if (s == 0 && hdr.op == OP_RSLT) {
+        if (decode_results(&hdr, body, &results, &num_results) < 0) {
+            hdr.op = OP_NULL;
+        }
+    } else if (s == 0 && hdr.op == OP_YESS && hdr.len >= sizeof(uint32_t)) {
+        uint32_t id_nwb;
+        memcpy(&id_nwb, body, sizeof(uint32_t));
+        func_id = ntohl(id_nwb);
+        if (hdr.len >= 2 * sizeof(uint32_t)) {
+            uint32_t flags_nwb;
+            memcpy(&flags_nwb, body + sizeof(uint32_t), sizeof(uint32_t));
+            func_flags = ntohl(flags_nwb);
+        }
+        if (hdr.len >= YESS_LEN) {
+            uint64_t generation_nwb;
+            memcpy(&generation_nwb, body + 2 * sizeof(uint32_t), sizeof(uint64_t));
+            generation = be64toh(generation_nwb);
+        }
+    } else if (s == 0 && hdr.op == OP_TABLE) {
+        if (decode_table(&hdr, body, &generation, &table) < 0) {
+            hdr.op = OP_NULL;
+        }
+    }
+    uint64_t decoded = reading != 0 ? stats_clock() : 0;
+
+    pthread_mutex_lock(&cl->lock);
+    if (s < 0) {
+        /* Fail every call in flight */
+        __atomic_store_n(&cl->broken, 1, __ATOMIC_RELAXED);
+        for (int i = 0; i < PENDING_BUCKETS; i++) {
+            for (rpc_future *f = cl->pending[i]; f != NULL; f = f->next) {
+                if (f->op == 0) {
+                    client_drop_result(f);
+                    f->op = OP_NULL;
+                }
+            }
+        }
+    } else {
+        rpc_future *f = cl->pending[hdr.id & (PENDING_BUCKETS - 1)];
+        while (f != NULL && f->id != hdr.id) {
+            f = f->next;
+        }
+        if (f != NULL && f->op == 0) {
+            /* Items of a stream queue up until they are read, and the
+             * stream completes with its end. Large results complete once
+             * their last chunk arrives */
+            if (hdr.op == OP_DATA && (hdr.flags & FLAG_STREAM)) {
+                if (f->stream && result != NULL) {
+                    client_queue_item(f, result);
+                    result = NULL;
+                } else {
+                    client_drop_result(f);
+                    f->op = OP_NULL;
+                }
+            } else if (hdr.op == OP_DATA && (hdr.flags & FLAG_LARGE)) {
+                client_begin_large(f, &hdr, body);
+            } else if (hdr.op == OP_CHUNK) {
+                client_large_chunk(f, body, hdr.len, hdr.flags & FLAG_COMPRESSED);
+            } else if (hdr.op == OP_RSLT && (hdr.flags & FLAG_MORE)) {
+                client_append_results(f, results, num_results);
+                results = NULL;
+            } else {
+                if (f->traced) {
+                    trace_span("recv", TRACE_CLIENT, f->id, 0, reading, read);
+                    trace_span("decode", TRACE_CLIENT, f->id, 0, read, decoded);
+                }
+                f->op = hdr.op;
+                f->func_id = func_id;
+                f->func_flags = func_flags;
+                f->generation = generation;
+                f->table = table;
+                if (hdr.op != OP_RSLT) {
+                    /* A malformed part fails the whole batch */
+                    client_drop_result(f);
+                }
+                f->result = client_deliver(f, result);
+                client_append_results(f, results, num_results);
+                result = NULL;
+                results = NULL;
+                table = NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cl->lock);
+    if (table != NULL) {
+        registry_free(table);
+        free(table);
+    }
+    rpc_data_free(result);
+    for (uint32_t i = 0; results != NULL && i < num_results; i++) {
+        rpc_data_free(results[i]);
+    }
+    pool_free(results);
+}
+
+/* Block until a call's reply arrives, or its deadline passes, which
+ * completes it as EXPIRED. A reply arriving later is dropped. A streaming
+ * call also stops waiting once it has an item queued.
+ * While no other thread is reading, this thread reads replies, completing
+ * other threads' calls along the way. Called with cl->lock held.
+ * */
+void client_await(rpc_client *cl, rpc_future *f) {
+    while (f->op == 0 && f->items_len == 0) {
+        if (f->deadline != 0 && stats_clock() >= f->deadline) {
+            client_drop_result(f);
+            f->op = OP_EXPIRED;
+            break;
+        }
+        if (cl->reading && f->deadline != 0) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            uint64_t now = stats_clock();
+            uint64_t left = f->deadline > now ? f->deadline - now : 0;
+            until.tv_sec += left / 1000000000;
+            until.tv_nsec += left % 1000000000;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&cl->replied, &cl->lock, &until);
+            continue;
+        }
+        if (cl->reading) {
+            pthread_cond_wait(&cl->replied, &cl->lock);
+            continue;
+        }
+        cl->reading = 1;
+        pthread_mutex_unlock(&cl->lock);
+        client_receive(cl, f->deadline);
+        pthread_mutex_lock(&cl->lock);
+        cl->reading = 0;
+        pthread_cond_broadcast(&cl->replied);
+    }
+    if (f->op != 0) {
+        client_forget(cl, f);
+    }
+}
+
+/* Queue an item of a streaming call for rpc_stream_next. The ring starts
+ * with room for the window and grows only for servers that send ahead of
+ * their credit. Called with cl->lock held.
+ * */
+void client_queue_item(rpc_future *f, rpc_data *item) {
+    if (f->items_len == f->items_cap) {
+        uint32_t cap = f->items_cap == 0 ? STREAM_WINDOW : 2 * f->items_cap;
+        rpc_data **items = pool_alloc(cap * sizeof(rpc_data *));
+        for (uint32_t i = 0; i < f->items_len; i++) {
+            items[i] = f->items[(f->items_head + i) & (f->items_cap - 1)];
+        }
+        pool_free(f->items);
+        f->items = items;
+        f->items_head = 0;
+        f->items_cap = cap;
+    }
+    f->items[(f->items_head + f->items_len) & (f->items_cap - 1)] = item;
+    f->items_len++;
+}
+
+/* Send a GRANT frame giving a streaming call credit for more items, or
+ * cancelling it if credit is 0. A failed write shows up as a broken
+ * connection when replies are next read.
+ * */
+void client_grant(rpc_client *cl, uint32_t id, uint32_t credit) {
+    char frame[FRAME_HEADER_LEN + sizeof(uint32_t)];
+    frame_header hdr = {.len = sizeof(uint32_t), .op = OP_GRANT, .flags = 0, .id = id};
+    encode_frame_header(frame, &hdr);
+    uint32_t credit_nwb = htonl(credit);
+    memcpy(frame + FRAME_HEADER_LEN, &credit_nwb, sizeof(uint32_t));
+    struct iovec iov = {.iov_base = frame, .iov_len = sizeof(frame)};
+    pthread_mutex_lock(&cl->send_lock);
+    client_write(cl, &iov, 1, 0);
+    pthread_mutex_unlock(&cl->send_lock);
+}
+
+/* Functions of a server as its last TABLE reply listed them, shared by
+ * every client of the process connected to the same address */
+typedef struct handle_table {
+    char *addr;                     // address the server was reached at
+    int port;                       // port of a TCP server, 0 for a Unix socket
+    rpc_registry *registry;         // listed functions, of the generation TABLE reported
+    struct handle_table *next;      // next server
+} handle_table;
+
+static pthread_mutex_t handle_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static handle_table *handle_cache;
+
+/* The cached functions of the server a client is connected to.
+ * Called with handle_cache_lock held.
+ * Returns NULL if there are none.
+ * */
+handle_table *handle_cache_of(rpc_client *cl) {
+    int port = cl->unix_socket ? 0 : cl->port;
+    for (handle_table *t = handle_cache; t != NULL; t = t->next) {
+        if (t->port == port && strcmp(t->addr, cl->addr) == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/* Allocate a handle of a function, freed with a single free(3).
+ * */
+rpc_handle *handle_new(uint32_t id, uint32_t flags, const char *name, size_t name_len) {
+    rpc_handle *handle = (rpc_handle *) malloc(sizeof(rpc_handle) + name_len + 1);
+    if (handle == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    handle->id = id;
+    handle->flags = flags;
+    handle->name_len = name_len;
+    memcpy(handle->name, name, name_len);
+    handle->name[name_len] = '\0';
+    return handle;
+}
+
+/* Find a function in the handle cache, which is trusted while it holds
+ * the generation the server last reported. A name the cache lacks costs
+ * one LIST, answered with the generation alone if nothing changed.
+ * Returns -1 if the server could not list its functions, for rpc_find to
+ * ask for the name alone.
+ * */
+int client_list(rpc_client *cl, const char *name, size_t name_len, rpc_handle **handle) {
+    uint64_t known = 0;
+    pthread_mutex_lock(&handle_cache_lock);
+    handle_table *t = handle_cache_of(cl);
+    if (t != NULL) {
+        known = t->registry->generation;
+        rpc_entry *entry = known == cl->generation ? registry_find(t->registry, name, name_len) : NULL;
+        if (entry != NULL) {
+            *handle = handle_new(entry - t->registry->entries, entry->flags, name, name_len);
+            pthread_mutex_unlock(&handle_cache_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&handle_cache_lock);
+
+    /* Ask for the functions, unless the cached ones are still current */
+    char frame[FRAME_HEADER_LEN + sizeof(uint64_t)];
+    frame_header hdr = {.len = sizeof(uint64_t), .op = OP_LIST, .flags = 0};
+    uint64_t known_nwb = htobe64(known);
+    memcpy(frame + FRAME_HEADER_LEN, &known_nwb, sizeof(uint64_t));
+    struct iovec iov = {.iov_base = frame, .iov_len = sizeof(frame)};
+    rpc_client *conn = client_pick(cl);
+    rpc_future *f = client_send(conn, &hdr, &iov, 1);
+    if (f == NULL) {
+        client_done(conn);
+        return -1;
+    }
+    pthread_mutex_lock(&conn->lock);
+    client_await(conn, f);
+    pthread_mutex_unlock(&conn->lock);
+    int listed = f->op == OP_TABLE;
+    uint64_t generation = f->generation;
+    rpc_registry *table = f->table;
+    rpc_data_free(f->result);
+    pool_free(f);
+    client_done(conn);
+    if (!listed) {
+        return -1;
+    }
+
+    /* Another thread may have cached a different generation meanwhile */
+    int found = -1;
+    pthread_mutex_lock(&handle_cache_lock);
+    t = handle_cache_of(cl);
+    if (table != NULL) {
+        if (t == NULL) {
+            t = malloc(sizeof(handle_table));
+            if (t == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            t->addr = strdup(cl->addr);
+            t->port = cl->unix_socket ? 0 : cl->port;
+            t->registry = NULL;
+            t->next = handle_cache;
+            handle_cache = t;
+        } else {
+            registry_free(t->registry);
+            free(t->registry);
+        }
+        t->registry = table;
+    }
+    cl->generation = generation;
+    if (t != NULL && t->registry->generation == generation) {
+        rpc_entry *entry = registry_find(t->registry, name, name_len);
+        *handle = entry == NULL ? NULL : handle_new(entry - t->registry->entries, entry->flags, name, name_len);
+        found = 0;
+    }
+    pthread_mutex_unlock(&handle_cache_lock);
+    return found;
+}
+
+/* Client find a server function with corresponding name.
+ * Returns a handle if the function exists in server.
+ * A server that answers LIST is asked for all of its functions at once,
+ * which later lookups by any client of the process find in the handle
+ * cache without a round trip.
+ * */
+rpc_handle *rpc_find(rpc_client *cl, char *name) {
+    if (cl == NULL || name == NULL) {
+        return NULL;
+    }
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len >= MAX_BYTES) {
+        return NULL;
+    }
+    rpc_handle *handle;
+    if (cl->list && client_list(cl, name, name_len, &handle) == 0) {
+        return handle;
+    }
+
+    /* Sending command and function name to server */
+    char frame[FRAME_HEADER_LEN];
+    frame_header hdr = {.len = name_len, .op = OP_FIND, .flags = 0};
+    struct iovec iov[2];
+    iov[0].iov_base = frame;
+    iov[0].iov_len = FRAME_HEADER_LEN;
+    iov[1].iov_base = name;
+    iov[1].iov_len = name_len;
+    rpc_client *conn = client_pick(cl);
+    rpc_future *f = client_send(conn, &hdr, iov, 2);
+    if (f == NULL) {
+        client_done(conn);
+        return NULL;
+    }
+
+    /* Receiving signal and function id from server */
+    pthread_mutex_lock(&conn->lock);
+    client_await(conn, f);
+    pthread_mutex_unlock(&conn->lock);
+    int found = f->op == OP_YESS;
+    uint32_t func_id = f->func_id;
+    uint32_t func_flags = f->func_flags;
+    rpc_data_free(f->result);
+    pool_free(f);
+    client_done(conn);
+    if (!found) {
+        return NULL;
+    }
+    return handle_new(func_id, func_flags, name, name_len);
+}
+
+/* Start a call, with the result going into the caller's buffer if into
+ * is set, or coming back as a stream of items if stream is set. A payload
+ * larger than MAX_DATA goes out in chunks, except to a stream.
+ * Returns NULL if the call could not be started.
+ * */
+rpc_future *start_call(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                       rpc_data *into, void *into_buf, size_t into_len, int stream) {
+    /* Safety handling */
+    if (cl == NULL || h == NULL || payload == NULL) {
+        return NULL;
+    }
+    if ((payload->data2 == NULL && payload->data2_len != 0) || (payload->data2 != NULL && payload->data2_len == 0)) {
+        return NULL;
+    }
+    if (payload->data2_len > MAX_LARGE_DATA || (stream && payload->data2_len > MAX_DATA)) {
+        return NULL;
+    }
+    uint64_t started = trace_enabled() ? stats_clock() : 0;
+    rpc_client *conn = client_pick(cl);
+    rpc_future *f = client_register(conn, into, into_buf, into_len);
+    if (f == NULL) {
+        client_done(conn);
+        return NULL;
+    }
+    if (stream) {
+        /* The reader only queues items for a call marked before it is sent */
+        pthread_mutex_lock(&conn->lock);
+        f->stream = 1;
+        pthread_mutex_unlock(&conn->lock);
+    }
+    if (payload->data2_len > MAX_DATA) {
+        return send_large(conn, f, h->id, payload->data1, payload->data2, -1, 0, payload->data2_len,
+                          !(h->flags & RPC_NO_COMPRESS));
+    }
+
+    /* A sampled call is flagged so the server traces it too */
+    if (started != 0 && trace_sample()) {
+        f->traced = 1;
+        f->trace_start = started;
+    }
+
+    /* data2 is compressed if the server takes it and that pays off */
+    char *zip = NULL;
+    size_t zip_len = 0;
+    if (conn->compress && !(h->flags & RPC_NO_COMPRESS)) {
+        zip_len = zip_data2(payload->data2, payload->data2_len, &zip, NULL);
+    }
+
+    /* Sending call command, function id and payload, compactly if the
+     * server takes it */
+    char frame[COMPACT_HEADER_MAX + COMPACT_BODY_MAX];
+    frame_header hdr = {.op = OP_CALL, .flags = (f->traced ? FLAG_TRACE : 0) | (zip_len != 0 ? FLAG_COMPRESSED : 0) |
+                                               (stream ? FLAG_STREAM : 0),
+                        .compact = conn->compact};
+    size_t room = frame_header_room(&hdr);
+    size_t wire_len = zip_len != 0 ? zip_len : payload->data2_len;
+
+    struct iovec iov[2];
+    iov[0].iov_base = frame;
+    iov[0].iov_len = room + encode_body(&hdr, frame + room, h->id, payload->data1, payload->data2_len, wire_len);
+    iov[1].iov_base = zip_len != 0 ? zip : payload->data2;
+    iov[1].iov_len = wire_len;
+    f = client_transmit(conn, f, &hdr, iov, wire_len != 0 ? 2 : 1);
+    pool_free(zip);
+    return f;
+}
+
+/* Client starts calling a server function with given data.
+ * The request goes out as one frame in a single sendmsg, and the client
+ * does not wait for the reply, so many calls can be in flight at once.
+ * Returns a future to collect the result with rpc_wait.
+ * */
+rpc_future *rpc_call_async(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+    return start_call(cl, h, payload, NULL, NULL, 0, 0);
+}
+
+/* Wait for the result of a call started with rpc_call_async.
+ * Frees the future.
+ * Returns a data if the procedure is called successfully.
+ * */
+rpc_data *rpc_wait(rpc_future *f) {
+    if (f == NULL) {
+        return NULL;
+    }
+    rpc_client *cl = f->cl;
+    pthread_mutex_lock(&cl->lock);
+    client_await(cl, f);
+    pthread_mutex_unlock(&cl->lock);
+
+    if (f->traced) {
+        trace_span("call", TRACE_CLIENT, f->id, 0, f->trace_start, stats_clock());
+    }
+    rpc_data *result = f->result;
+    call_errno(f);
+    pool_free(f);
+    client_done(cl);
+    return result;
+}
+
+/* Client call a server function with given data.
+ * Returns a data if the procedure is called successfully.
+ * */
+rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+    return rpc_wait(rpc_call_async(cl, h, payload));
+}
+
+/* Client call a server function, receiving the result into the caller's
+ * rpc_data with data2 in buf, instead of newly allocated memory.
+ * Returns -1 if the call failed or the result's data2 exceeds buf_len.
+ * */
+int rpc_call_into(rpc_client *cl, rpc_handle *h, rpc_data *payload, rpc_data *result, void *buf, size_t buf_len) {
+    if (result == NULL || (buf == NULL && buf_len != 0)) {
+        return -1;
+    }
+    return rpc_wait(start_call(cl, h, payload, result, buf, buf_len, 0)) == result ? 0 : -1;
+}
+
+/* Client call a server function with data2 read from len bytes of a file
+ * at offset. The file is sent with sendfile and never read into memory.
+ * Returns a data if the procedure is called successfully.
+ * */
+rpc_data *rpc_call_file(rpc_client *cl, rpc_handle *h, int data1, int fd, off_t offset, size_t len) {
+    if (cl == NULL || h == NULL || fd < 0 || offset < 0 || len > MAX_LARGE_DATA) {
+        return NULL;
+    }
+    rpc_client *conn = client_pick(cl);
+    rpc_future *f = client_register(conn, NULL, NULL, 0);
+    if (f == NULL) {
+        client_done(conn);
+        return NULL;
+    }
+    return rpc_wait(send_large(conn, f, h->id, data1, NULL, fd, offset, len, !(h->flags & RPC_NO_COMPRESS)));
+}
+
+/* Client starts a call of a streaming server function.
+ * Returns a stream to read the function's results from with
+ * rpc_stream_next, or NULL if the function does not stream.
+ * */
+rpc_stream *rpc_call_stream(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+    if (h == NULL || !(h->flags & FUNC_STREAM)) {
+        return NULL;
+    }
+    return (rpc_stream *) start_call(cl, h, payload, NULL, NULL, 0, 1);
+}
+
+/* Read the next item of a stream, waiting for it to arrive. Each time half
+ * the window has been read, the server is granted credit for as many more.
+ * Returns NULL at the end of the stream, with errno 0 if it ended normally.
+ * */
+rpc_data *rpc_stream_next(rpc_stream *s) {
+    if (s == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    rpc_future *f = (rpc_future *) s;
+    rpc_client *cl = f->cl;
+
+    /* The client's timeout bounds the wait for each item */
+    uint64_t timeout = __atomic_load_n(&cl->timeout, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&cl->lock);
+    if (timeout != 0 && f->op == 0) {
+        f->deadline = stats_clock() + timeout;
+    }
+    client_await(cl, f);
+    rpc_data *item = NULL;
+    uint32_t grant = 0;
+    if (f->items_len != 0) {
+        item = f->items[f->items_head];
+        f->items_head = (f->items_head + 1) & (f->items_cap - 1);
+        f->items_len--;
+        if (f->op == 0 && ++f->consumed >= STREAM_WINDOW / 2) {
+            grant = f->consumed;
+            f->consumed = 0;
+        }
+    }
+    uint8_t op = f->op;
+    pthread_mutex_unlock(&cl->lock);
+
+    if (grant != 0) {
+        client_grant(cl, f->id, grant);
+    }
+    if (item == NULL) {
+        errno = op == OP_END ? 0 : EIO;
+        call_errno(f);
+    }
+    return item;
+}
+
+/* Close a stream, cancelling it on the server unless it has ended, and
+ * free the items not read.
+ * */
+void rpc_stream_close(rpc_stream *s) {
+    if (s == NULL) {
+        return;
+    }
+    rpc_future *f = (rpc_future *) s;
+    rpc_client *cl = f->cl;
+    pthread_mutex_lock(&cl->lock);
+    int cancel = f->op == 0;
+    client_forget(cl, f);
+    for (; f->items_len != 0; f->items_len--) {
+        rpc_data_free(f->items[f->items_head]);
+        f->items_head = (f->items_head + 1) & (f->items_cap - 1);
+    }
+    pthread_mutex_unlock(&cl->lock);
+
+    /* Items still on their way are dropped when they arrive */
+    if (cancel) {
+        client_grant(cl, f->id, 0);
+    }
+    if (f->traced) {
+        trace_span("call", TRACE_CLIENT, f->id, 0, f->trace_start, stats_clock());
+    }
+    rpc_data_free(f->result);
+    pool_free(f->items);
+    pool_free(f);
+    client_done(cl);
+}
+
+/* Send payloads [start, end) to a server function as one BATCH frame.
+ * Returns NULL if the request could not be sent.
+ * */
+rpc_future *send_batch(rpc_client *cl, rpc_handle *h, rpc_data *payloads, size_t start, size_t end) {
+    size_t len = 2 * sizeof(uint32_t);
+    for (size_t i = start; i < end; i++) {
+        len += PAYLOAD_HEADER_LEN + payloads[i].data2_len;
+    }
+    char *frame = pool_alloc(FRAME_HEADER_LEN + len);
+
+    /* Function id, number of payloads, then each payload */
+    char *p = frame + FRAME_HEADER_LEN;
+    uint32_t func_id_nwb = htonl(h->id);
+    uint32_t count_nwb = htonl((uint32_t) (end - start));
+    memcpy(p, &func_id_nwb, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), &count_nwb, sizeof(uint32_t));
+    p += 2 * sizeof(uint32_t);
+    for (size_t i = start; i < end; i++) {
+        encode_data(&payloads[i], p);
+        p += PAYLOAD_HEADER_LEN;
+        if (payloads[i].data2_len != 0) {
+            memcpy(p, payloads[i].data2, payloads[i].data2_len);
+            p += payloads[i].data2_len;
+        }
+    }
+
+    frame_header hdr = {.len = len, .op = OP_BATCH, .flags = 0};
+    struct iovec iov = {.iov_base = frame, .iov_len = FRAME_HEADER_LEN + len};
+    rpc_future *f = client_send(cl, &hdr, &iov, 1);
+    pool_free(frame);
+    return f;
+}
+
+/* Client call a server function once for each of n payloads.
+ * The payloads travel in as few BATCH frames as the frame size allows,
+ * all sent before waiting, and the server runs each frame in one dispatch.
+ * Returns an array of n results, with NULL for calls that failed.
+ * */
+rpc_data **rpc_call_batch(rpc_client *cl, rpc_handle *h, rpc_data *payloads, size_t n) {
+    /* Safety handling */
+    if (cl == NULL || h == NULL || payloads == NULL || n == 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        rpc_data *payload = &payloads[i];
+        if ((payload->data2 == NULL && payload->data2_len != 0) || (payload->data2 != NULL && payload->data2_len == 0)) {
+            return NULL;
+        }
+        if (payload->data2_len > MAX_DATA) {
+            return NULL;
+        }
+    }
+
+    /* Split into frames and send them all on one connection */
+    rpc_client *conn = client_pick(cl);
+    size_t *starts = pool_alloc((n + 1) * sizeof(size_t));
+    rpc_future **futures = pool_alloc(n * sizeof(rpc_future *));
+    size_t num_frames = 0;
+    size_t i = 0;
+    while (i < n) {
+        size_t len = 2 * sizeof(uint32_t);
+        starts[num_frames] = i;
+        while (i < n && (i == starts[num_frames] ||
+                         len + PAYLOAD_HEADER_LEN + payloads[i].data2_len <= MAX_FRAME)) {
+            len += PAYLOAD_HEADER_LEN + payloads[i].data2_len;
+            i++;
+        }
+        futures[num_frames] = send_batch(conn, h, payloads, starts[num_frames], i);
+        num_frames++;
+    }
+    starts[num_frames] = n;
+
+    /* Collect the results in order */
+    rpc_data **results = calloc(n, sizeof(rpc_data *));
+    if (results == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (size_t k = 0; k < num_frames; k++) {
+        rpc_future *f = futures[k];
+        if (f == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&conn->lock);
+        client_await(conn, f);
+        pthread_mutex_unlock(&conn->lock);
+        call_errno(f);
+
+        size_t count = starts[k + 1] - starts[k];
+        for (uint32_t j = 0; j < f->num_results; j++) {
+            if (j < count) {
+                results[starts[k] + j] = f->results[j];
+            } else {
+                rpc_data_free(f->results[j]);
+            }
+        }
+        rpc_data_free(f->result);
+        pool_free(f->results);
+        pool_free(f);
+    }
+    pool_free(starts);
+    pool_free(futures);
+    client_done(conn);
+    return results;
+}
+
+/* This function closes every connection of the client's pool.
+ * */
+void rpc_close_client(rpc_client *cl) {
+    if (cl == NULL) {
+        return;
+    }
+    for (size_t i = 1; i < cl->num_conns; i++) {
+        client_close_conn(cl->conns[i]);
+    }
+    free(cl->conns);
+    client_close_conn(cl);
+}
+
+/* Closes one connection's socket and frees the client address.
+ * */
+void client_close_conn(rpc_client *cl) {
+    /* Tell server threads waiting on a shared-memory connection to stop */
+    if (cl->shm != NULL) {
+        __atomic_store_n(&cl->shm->closed, 1, __ATOMIC_RELEASE);
+        shm_wake(&cl->shm->server_bell);
+    }
+
+    /* Close client socket */
+    if (cl->cli_socket != -1) {
+        close(cl->cli_socket);
+    }
+    if (cl->shm != NULL) {
+        munmap(cl->shm, sizeof(shm_region));
+    }
+
+    /* Free client address */
+    if (cl->addr != NULL) {
+        free(cl->addr);
     }
 
     if (cl->server_addr != NULL) {
         freeaddrinfo(cl->server_addr);
     }
-    /* Free structure */
-    free(cl);
+    fd_queue_clear(&cl->fds);
+    free(cl->in);
+    pthread_mutex_destroy(&cl->send_lock);
+    pthread_mutex_destroy(&cl->lock);
+    pthread_cond_destroy(&cl->replied);
+    pthread_mutex_destroy(&cl->pool_lock);
+
+    /* Free structure */
+    free(cl);
+}
+
+/* Free block of a pool, linked through its first bytes */
+typedef struct pool_block {
+    struct pool_block *next;        // next free block
+} pool_block;
+
+/* Blocks of one size shared by all threads. Each size is carved from its
+ * own slice of one reserved region, so the size of a block is known from
+ * its address alone. */
+typedef struct {
+    pthread_mutex_t lock;           // guards the fields below
+    pool_block *free;               // blocks given back by threads with full caches
+    size_t num_free;                // number of blocks in free
+    size_t carved;                  // bytes of the slice handed out so far
+} pool_class;
+
+/* Free blocks kept by one thread, taken and given back without locking */
+typedef struct {
+    pool_block *free[POOL_CLASSES]; // free blocks of each size
+    size_t num_free[POOL_CLASSES];  // number of blocks in each list
+    int registered;                 // flushed to the shared pools at thread exit
+} pool_cache;
+
+static char *pool_base;
+static pool_class pool_classes[POOL_CLASSES];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static __thread pool_cache pool_local;
+static atomic_size_t heap_allocs;
+
+/* Give every block a thread still caches back to the shared pools.
+ * */
+void pool_flush(void *arg) {
+    pool_cache *cache = (pool_cache *) arg;
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        pool_block *block = cache->free[c];
+        if (block == NULL) {
+            continue;
+        }
+        pool_block *tail = block;
+        while (tail->next != NULL) {
+            tail = tail->next;
+        }
+        pthread_mutex_lock(&pool_classes[c].lock);
+        tail->next = pool_classes[c].free;
+        pool_classes[c].free = block;
+        pool_classes[c].num_free += cache->num_free[c];
+        pthread_mutex_unlock(&pool_classes[c].lock);
+        cache->free[c] = NULL;
+        cache->num_free[c] = 0;
+    }
+}
+
+/* Reserve the address space of the pools. Pages are only committed as
+ * blocks are first used.
+ * */
+void pool_init(void) {
+    void *base = mmap(NULL, POOL_CLASSES * POOL_REGION, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        pthread_mutex_init(&pool_classes[c].lock, NULL);
+    }
+    pthread_key_create(&pool_key, pool_flush);
+    pool_base = base == MAP_FAILED ? NULL : base;
+}
+
+/* Number of free blocks of a size class a thread may keep.
+ * */
+size_t pool_cache_limit(int c) {
+    size_t limit = POOL_CACHE_BYTES >> (c + POOL_MIN_SHIFT);
+    if (limit > POOL_CACHE_BLOCKS) {
+        return POOL_CACHE_BLOCKS;
+    }
+    return limit < 2 ? 2 : limit;
+}
+
+/* Refill a thread's cache of a size class with half a cache's worth of
+ * blocks, from the shared free list or else freshly carved.
+ * */
+void pool_refill(pool_cache *cache, int c) {
+    pool_class *pc = &pool_classes[c];
+    size_t size = (size_t) 1 << (c + POOL_MIN_SHIFT);
+    size_t want = pool_cache_limit(c) / 2;
+
+    pthread_mutex_lock(&pc->lock);
+    while (want > 0 && pc->free != NULL) {
+        pool_block *block = pc->free;
+        pc->free = block->next;
+        pc->num_free--;
+        block->next = cache->free[c];
+        cache->free[c] = block;
+        cache->num_free[c]++;
+        want--;
+    }
+    if (cache->free[c] == NULL) {
+        while (want > 0 && pc->carved + size <= POOL_REGION) {
+            pool_block *block = (pool_block *) (pool_base + c * POOL_REGION + pc->carved);
+            pc->carved += size;
+            block->next = cache->free[c];
+            cache->free[c] = block;
+            cache->num_free[c]++;
+            atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+            want--;
+        }
+    }
+    pthread_mutex_unlock(&pc->lock);
+}
+
+/* Take a buffer of at least len bytes from the calling thread's pool.
+ * Buffers too large for the pools, or allocated once the pools are used
+ * up, come from the heap.
+ * */
+void *pool_alloc(size_t len) {
+    pthread_once(&pool_once, pool_init);
+    int c = len <= (1 << POOL_MIN_SHIFT) ? 0 : 64 - __builtin_clzll(len - 1) - POOL_MIN_SHIFT;
+    if (pool_base != NULL && c < POOL_CLASSES) {
+        pool_cache *cache = &pool_local;
+        if (!cache->registered) {
+            pthread_setspecific(pool_key, cache);
+            cache->registered = 1;
+        }
+        if (cache->free[c] == NULL) {
+            pool_refill(cache, c);
+        }
+        pool_block *block = cache->free[c];
+        if (block != NULL) {
+            cache->free[c] = block->next;
+            cache->num_free[c]--;
+            return block;
+        }
+    }
+
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    void *ptr = malloc(len);
+    if (ptr == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+/* Bytes of a memory page, looked up once.
+ * */
+size_t page_size(void) {
+    static size_t size;
+    size_t cached = __atomic_load_n(&size, __ATOMIC_RELAXED);
+    if (cached == 0) {
+        cached = (size_t) sysconf(_SC_PAGESIZE);
+        __atomic_store_n(&size, cached, __ATOMIC_RELAXED);
+    }
+    return cached;
+}
+
+/* Whether a buffer was carved from the pools.
+ * */
+int pool_owns(void *ptr) {
+    return pool_base != NULL && (char *) ptr >= pool_base && (char *) ptr < pool_base + POOL_CLASSES * POOL_REGION;
+}
+
+/* Return a buffer to the calling thread's pool, or to the heap if it did
+ * not come from the pools. A thread whose cache is full gives half of it
+ * back to the shared pool, so buffers freed by other threads than the one
+ * that took them keep circulating.
+ * */
+void pool_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (!pool_owns(ptr)) {
+        free(ptr);
+        return;
+    }
+    int c = ((char *) ptr - pool_base) / POOL_REGION;
+    pool_cache *cache = &pool_local;
+    if (!cache->registered) {
+        pthread_setspecific(pool_key, cache);
+        cache->registered = 1;
+    }
+    pool_block *block = (pool_block *) ptr;
+    block->next = cache->free[c];
+    cache->free[c] = block;
+    cache->num_free[c]++;
+
+    size_t limit = pool_cache_limit(c);
+    if (cache->num_free[c] > limit) {
+        pool_block *head = cache->free[c];
+        pool_block *tail = head;
+        size_t give = limit / 2;
+        for (size_t i = 1; i < give; i++) {
+            tail = tail->next;
+        }
+        cache->free[c] = tail->next;
+        cache->num_free[c] -= give;
+
+        pool_class *pc = &pool_classes[c];
+        pthread_mutex_lock(&pc->lock);
+        tail->next = pc->free;
+        pc->free = head;
+        pc->num_free += give;
+        pthread_mutex_unlock(&pc->lock);
+    }
+}
+
+/* Returns how many system calls servers in this process have made to wait
+ * for events, accept connections, and receive and send frames.
+ * */
+size_t rpc_syscall_count(void) {
+    return atomic_load_explicit(&io_syscalls, memory_order_relaxed);
+}
+
+/* Returns how many bytes servers in this process have received and sent
+ * on client connections, frame headers included.
+ * */
+size_t rpc_wire_bytes(void) {
+    return atomic_load_explicit(&wire_bytes, memory_order_relaxed);
+}
+
+/* Returns how many buffers the library has taken from the heap or carved
+ * afresh, rather than reused from its pools.
+ * */
+size_t rpc_alloc_count(void) {
+    return atomic_load_explicit(&heap_allocs, memory_order_relaxed);
+}
+
+/* Allocates a rpc_data and its data2 from the pools.
+ * */
+rpc_data *rpc_data_alloc(size_t data2_len) {
+    rpc_data *data = pool_alloc(sizeof(rpc_data));
+    data->data1 = 0;
+    data->data2_len = data2_len;
+    data->data2 = data2_len == 0 ? NULL : pool_alloc(data2_len);
+    return data;
+}
+
+/* Buffers mapped for large payloads, so they can be told apart from
+ * malloc'd data2 when freed. Every mapping's data2 is page-aligned, which
+ * heap buffers almost never are, so only the rare aligned pointer looks
+ * itself up, in an open-addressing set keyed by data2 */
+typedef struct {
+    void *addr;                     // data2 in the mapping, NULL for an empty slot
+    void *base;                     // start of the mapping
+    size_t len;                     // length of the mapping
+} large_map;
+
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+static large_map *large_maps;
+static size_t num_large_maps;
+static size_t large_maps_cap;       // slots of large_maps, a power of two
+
+/* Slot of large_maps where the probe for addr starts. Called with
+ * large_lock held.
+ * */
+static inline size_t large_slot(void *addr) {
+    uint64_t hash = (uint64_t) (uintptr_t) addr * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (hash >> 32) & (large_maps_cap - 1);
+}
+
+/* Map a buffer for the data2 of a large payload. Pages are only committed
+ * as the payload is written into them.
+ * Returns NULL if len is 0 or the mapping fails.
+ * */
+void *large_alloc(size_t len) {
+    if (len == 0) {
+        return NULL;
+    }
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    large_track(addr, addr, len);
+    return addr;
+}
+
+/* Note a mapping of len bytes at base, which free_data2 unmaps when given
+ * addr, the data2 inside it, which must be page-aligned. The set doubles
+ * once half full.
+ * */
+void large_track(void *base, void *addr, size_t len) {
+    pthread_mutex_lock(&large_lock);
+    if (2 * (num_large_maps + 1) > large_maps_cap) {
+        large_map *old = large_maps;
+        size_t old_cap = large_maps_cap;
+        large_maps_cap = large_maps_cap == 0 ? 16 : large_maps_cap * 2;
+        large_maps = calloc(large_maps_cap, sizeof(large_map));
+        if (large_maps == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].addr != NULL) {
+                size_t slot = large_slot(old[i].addr);
+                while (large_maps[slot].addr != NULL) {
+                    slot = (slot + 1) & (large_maps_cap - 1);
+                }
+                large_maps[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t slot = large_slot(addr);
+    while (large_maps[slot].addr != NULL) {
+        slot = (slot + 1) & (large_maps_cap - 1);
+    }
+    large_maps[slot].addr = addr;
+    large_maps[slot].base = base;
+    large_maps[slot].len = len;
+    num_large_maps++;
+    pthread_mutex_unlock(&large_lock);
+}
+
+/* Remove the mapping of data2 from the set, shifting back the entries
+ * probed past it so every probe still reaches its entry. Called with
+ * large_lock held.
+ * Returns -1 if data2 is not in a mapping.
+ * */
+int large_untrack(void *data2, large_map *map) {
+    if (large_maps_cap == 0) {
+        return -1;
+    }
+    size_t slot = large_slot(data2);
+    while (large_maps[slot].addr != data2) {
+        if (large_maps[slot].addr == NULL) {
+            return -1;
+        }
+        slot = (slot + 1) & (large_maps_cap - 1);
+    }
+    *map = large_maps[slot];
+    size_t hole = slot;
+    for (size_t next = (slot + 1) & (large_maps_cap - 1); large_maps[next].addr != NULL;
+         next = (next + 1) & (large_maps_cap - 1)) {
+        size_t home = large_slot(large_maps[next].addr);
+        if (((next - home) & (large_maps_cap - 1)) >= ((next - hole) & (large_maps_cap - 1))) {
+            large_maps[hole] = large_maps[next];
+            hole = next;
+        }
+    }
+    large_maps[hole].addr = NULL;
+    num_large_maps--;
+    return 0;
+}
+
+/* Free the data2 of a payload, whether pooled, mapped or malloc'd.
+ * */
+void free_data2(void *data2) {
+    if (data2 == NULL) {
+        return;
+    }
+    if (pool_owns(data2)) {
+        pool_free(data2);
+        return;
+    }
+    if ((uintptr_t) data2 & (page_size() - 1)) {
+        free(data2);
+        return;
+    }
+    large_map map;
+    pthread_mutex_lock(&large_lock);
+    int mapped = large_untrack(data2, &map) == 0;
+    pthread_mutex_unlock(&large_lock);
+    if (mapped) {
+        munmap(map.base, map.len);
+    } else {
+        free(data2);
+    }
 }
 
 /* Frees data2 and data */
@@ -473,70 +6504,759 @@ void rpc_data_free(rpc_data *data) {
     if (data == NULL) {
         return;
     }
-    if (data->data2 != NULL) {
-        free(data->data2);
+    free_data2(data->data2);
+    pool_free(data);
+}
+
+/* Check that data2 is set exactly when data2_len is, and fits in a frame.
+ * */
+int data_valid(rpc_data *payload) {
+    if ((payload->data2 == NULL && payload->data2_len != 0) || (payload->data2 != NULL && payload->data2_len == 0)) {
+        return 0;
     }
-    free(data);
+    return payload->data2_len <= MAX_DATA;
 }
 
-/* Convert a data to network byte order and send the data
+/* Convert the payload header (data1 and data2 length) to network byte order.
+ * The caller sends data2 itself.
  * */
-int send_data(int socket, rpc_data *payload, char *command) {
+int encode_data(rpc_data *payload, char *buf) {
+    if (!data_valid(payload)) {
+        return 1;
+    }
 
-    /* Safety handling */
-    if ((payload->data2 == NULL && payload->data2_len != 0) || (payload->data2 != NULL && payload->data2_len == 0)) {
+    uint64_t data1_nwb = htobe64((uint64_t) payload->data1);
+    uint32_t data2_len_nwb = htonl((uint32_t) payload->data2_len);
+    memcpy(buf, &data1_nwb, sizeof(uint64_t));
+    memcpy(buf + sizeof(uint64_t), &data2_len_nwb, sizeof(uint32_t));
+    return 0;
+}
+
+/* Read a payload header in network byte order.
+ * data2 is left for the caller since it follows the header.
+ * */
+int decode_data(const char *buf, rpc_data *result) {
+    uint64_t data1_nwb;
+    uint32_t data2_len_nwb;
+    memcpy(&data1_nwb, buf, sizeof(uint64_t));
+    memcpy(&data2_len_nwb, buf + sizeof(uint64_t), sizeof(uint32_t));
+
+    result->data1 = (int) be64toh(data1_nwb);
+    result->data2_len = (size_t) ntohl(data2_len_nwb);
+    result->data2 = NULL;
+    if (result->data2_len > MAX_DATA) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Write the header of a large payload (data1 and a 64-bit data2 length)
+ * in network byte order.
+ * */
+void encode_large(int data1, uint64_t len, char *buf) {
+    uint64_t data1_nwb = htobe64((uint64_t) data1);
+    uint64_t len_nwb = htobe64(len);
+    memcpy(buf, &data1_nwb, sizeof(uint64_t));
+    memcpy(buf + sizeof(uint64_t), &len_nwb, sizeof(uint64_t));
+}
+
+/* Read the header of a large payload in network byte order.
+ * data2 is left for the caller since it follows in CHUNK frames.
+ * */
+int decode_large(const char *buf, rpc_data *result) {
+    uint64_t data1_nwb;
+    uint64_t len_nwb;
+    memcpy(&data1_nwb, buf, sizeof(uint64_t));
+    memcpy(&len_nwb, buf + sizeof(uint64_t), sizeof(uint64_t));
+
+    uint64_t len = be64toh(len_nwb);
+    result->data1 = (int) be64toh(data1_nwb);
+    result->data2 = NULL;
+    if (len > MAX_LARGE_DATA || len > SIZE_MAX) {
+        return 1;
+    }
+    result->data2_len = (size_t) len;
+    return 0;
+}
+
+/* Write the header of a payload passed as a descriptor (data1, data2
+ * length and its offset in the file) in network byte order.
+ * */
+void encode_fd_header(int data1, uint64_t len, uint64_t offset, char *buf) {
+    encode_large(data1, len, buf);
+    uint64_t offset_nwb = htobe64(offset);
+    memcpy(buf + LARGE_HEADER_LEN, &offset_nwb, sizeof(uint64_t));
+}
+
+/* Read the header of a payload passed as a descriptor in network byte order.
+ * data2 is left for the caller since it is read from the descriptor.
+ * */
+int decode_fd_header(const char *buf, rpc_data *result, uint64_t *offset) {
+    uint64_t offset_nwb;
+    memcpy(&offset_nwb, buf + LARGE_HEADER_LEN, sizeof(uint64_t));
+    *offset = be64toh(offset_nwb);
+    if (*offset > (uint64_t) INT64_MAX) {
         return 1;
     }
+    return decode_large(buf, result);
+}
+
+static size_t compress_min = DEFAULT_COMPRESS_MIN;
+
+/* Compress data2 for a frame on a connection that negotiated compression,
+ * if it is at least compress_min bytes. The attempt is counted in zs
+ * unless it is NULL, whether or not it paid off.
+ * Returns the compressed length with *out set to a pooled buffer holding
+ * it, or 0 if data2 should go as it is.
+ * */
+size_t zip_data2(const void *data2, size_t len, char **out, zip_stats *zs) {
+    size_t min = __atomic_load_n(&compress_min, __ATOMIC_RELAXED);
+    if (min == 0 || len < min || len == 0) {
+        return 0;
+    }
+    uint64_t start = zs != NULL ? stats_clock() : 0;
+    *out = pool_alloc(len - len / COMPRESS_SAVING);
+    size_t zipped = lz_compress(data2, len, *out, len - len / COMPRESS_SAVING);
+    if (zipped == 0) {
+        pool_free(*out);
+        *out = NULL;
+    }
+    if (zs != NULL) {
+        zs->raw += len;
+        zs->wire += zipped != 0 ? zipped : len;
+        zs->ns += stats_clock() - start;
+    }
+    return zipped;
+}
 
-    if (command != NULL) {
-        write(socket, command, strlen(command));
+/* Decompress the body of a frame flagged FLAG_COMPRESSED into the len
+ * bytes of data2, counting it in zs unless it is NULL.
+ * Returns -1 if the body is corrupt.
+ * */
+int unzip_data2(const char *body, size_t body_len, void *data2, size_t len, zip_stats *zs) {
+    uint64_t start = zs != NULL ? stats_clock() : 0;
+    if (len == 0 || lz_decompress(body, body_len, data2, len) < 0) {
+        return -1;
     }
+    if (zs != NULL) {
+        zs->raw += len;
+        zs->wire += body_len;
+        zs->ns += stats_clock() - start;
+    }
+    return 0;
+}
+
+/* Sets the smallest data2 that is compressed.
+ * */
+void rpc_compress_threshold(size_t bytes) {
+    __atomic_store_n(&compress_min, bytes, __ATOMIC_RELAXED);
+}
 
-    /* Send data 1 */
-    int data1_copy = payload->data1;
-    uint64_t data1_nwb = (uint64_t) data1_copy;
-    data1_nwb = htobe64(data1_nwb);
-    write(socket, &data1_nwb, sizeof(uint64_t));
+/* Write a frame header in network byte order.
+ * */
+void encode_frame_header(char *buf, frame_header *hdr) {
+    uint32_t len_nwb = htonl(hdr->len);
+    memcpy(buf, &len_nwb, sizeof(uint32_t));
+    buf[4] = hdr->op;
+    buf[5] = hdr->flags;
+    uint16_t budget_nwb = htons(hdr->budget);
+    memcpy(buf + 6, &budget_nwb, sizeof(uint16_t));
+    uint32_t id_nwb = htonl(hdr->id);
+    memcpy(buf + 8, &id_nwb, sizeof(uint32_t));
+}
+
+/* Read a frame header in network byte order.
+ * */
+void decode_frame_header(const char *buf, frame_header *hdr) {
+    uint32_t len_nwb;
+    memcpy(&len_nwb, buf, sizeof(uint32_t));
+    hdr->len = ntohl(len_nwb);
+    hdr->op = buf[4];
+    hdr->flags = buf[5];
+    uint16_t budget_nwb;
+    memcpy(&budget_nwb, buf + 6, sizeof(uint16_t));
+    hdr->budget = ntohs(budget_nwb);
+    uint32_t id_nwb;
+    memcpy(&id_nwb, buf + 8, sizeof(uint32_t));
+    hdr->id = ntohl(id_nwb);
+    hdr->compact = 0;
+}
 
-    /* Send data2 len */
-    size_t data2_len_copy = payload->data2_len;
-    uint32_t data2_len_nwb = (uint32_t) data2_len_copy;
-    data2_len_nwb = htonl(data2_len_nwb);
-    write(socket, &data2_len_nwb, sizeof(uint32_t));
+/* Write v as a varint: 7 bits per byte, least significant first, with the
+ * top bit set on every byte but the last.
+ * Returns the number of bytes written.
+ * */
+size_t put_varint(char *buf, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (char) (v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (char) v;
+    return n;
+}
 
-    /* Send data2 */
-    if (data2_len_copy != 0) {
-        write(socket, payload->data2, payload->data2_len);
+/* Read a varint from the avail bytes at buf.
+ * Returns the number of bytes read, or 0 if it is incomplete or too long.
+ * */
+size_t get_varint(const char *buf, size_t avail, uint64_t *v) {
+    uint64_t result = 0;
+    for (size_t n = 0; n < avail && n < VARINT_MAX; n++) {
+        uint8_t byte = (uint8_t) buf[n];
+        result |= (uint64_t) (byte & 0x7f) << (7 * n);
+        if (!(byte & 0x80)) {
+            *v = result;
+            return n + 1;
+        }
     }
     return 0;
 }
 
-/* Receive a data in network byte order and convert to local host byte order.
+/* Zigzag-encode data1, so that small negative numbers stay short varints.
  * */
-int receive_data(int socket, rpc_data* result) {
+uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
 
-    /* Receive data 1 */
-    uint64_t data1_nwb;
-    read(socket, &data1_nwb, sizeof(uint64_t));
-    data1_nwb = be64toh(data1_nwb);
-    int data1_rcv = (int) data1_nwb;
+int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
 
-    /* Receive data 2 length */
-    uint32_t data2_len_nwb;
-    read(socket, &data2_len_nwb, sizeof(uint32_t));
-    data2_len_nwb = ntohl(data2_len_nwb);
-    size_t data2_len_rcv = (size_t) data2_len_nwb;
-
-    /* Receive data 2 */
-    if (data2_len_rcv != 0) {
-        void* data2_rcv = malloc(data2_len_rcv);
-        read(socket, data2_rcv, data2_len_rcv);
-        result->data2 = data2_rcv;
+/* Write the header of a compact CALL or DATA frame: a byte holding the op
+ * and flags, then varints of the length of the rest of the frame, the
+ * request id and, if there is one, the deadline budget.
+ * Returns the number of bytes written, at most COMPACT_HEADER_MAX.
+ * */
+size_t encode_compact_header(char *buf, frame_header *hdr) {
+    char fields[2 * VARINT_MAX];
+    size_t fields_len = put_varint(fields, hdr->id);
+    if (hdr->budget != 0) {
+        fields_len += put_varint(fields + fields_len, hdr->budget);
+    }
+    buf[0] = (char) (COMPACT_MARK | (hdr->op == OP_DATA ? COMPACT_DATA : 0) |
+                     (hdr->budget != 0 ? COMPACT_BUDGET : 0) | (hdr->flags & COMPACT_FLAGS));
+    size_t n = 1 + put_varint(buf + 1, fields_len + hdr->len);
+    memcpy(buf + n, fields, fields_len);
+    return n + fields_len;
+}
+
+/* Read the header of the frame at buf, of which avail bytes have arrived,
+ * in either encoding. A compact header starts with COMPACT_MARK, which the
+ * first byte of a fixed one, the top of a length of at most MAX_FRAME,
+ * never has.
+ * Returns the length of the header, 0 if it has not all arrived, or -1 if
+ * it is invalid.
+ * */
+int parse_frame_header(const char *buf, size_t avail, frame_header *hdr) {
+    if (avail == 0) {
+        return 0;
+    }
+    uint8_t first = (uint8_t) buf[0];
+    if (!(first & COMPACT_MARK)) {
+        if (avail < FRAME_HEADER_LEN) {
+            return 0;
+        }
+        decode_frame_header(buf, hdr);
+        return hdr->len > MAX_FRAME ? -1 : FRAME_HEADER_LEN;
+    }
+    if (first & ~(COMPACT_MARK | COMPACT_DATA | COMPACT_BUDGET | COMPACT_FLAGS)) {
+        return -1;
+    }
+
+    /* Fields past the length varint are complete once each ends in time */
+    uint64_t len, id, budget = 0;
+    size_t n = 1;
+    size_t used = get_varint(buf + n, avail - n, &len);
+    if (used == 0) {
+        return avail - n < VARINT_MAX ? 0 : -1;
+    }
+    n += used;
+    if (len > MAX_FRAME) {
+        return -1;
+    }
+    size_t end = n + len;
+    used = get_varint(buf + n, (avail < end ? avail : end) - n, &id);
+    if (used == 0) {
+        return avail < end ? 0 : -1;
+    }
+    n += used;
+    if (first & COMPACT_BUDGET) {
+        used = get_varint(buf + n, (avail < end ? avail : end) - n, &budget);
+        if (used == 0) {
+            return avail < end ? 0 : -1;
+        }
+        n += used;
+    }
+    if (id > UINT32_MAX || budget > MAX_BUDGET_MS) {
+        return -1;
+    }
+    hdr->len = (uint32_t) (end - n);
+    hdr->op = (first & COMPACT_DATA) ? OP_DATA : OP_CALL;
+    hdr->flags = first & COMPACT_FLAGS;
+    hdr->budget = (uint16_t) budget;
+    hdr->id = (uint32_t) id;
+    hdr->compact = 1;
+    return (int) n;
+}
+
+/* Returns the room to leave in front of a frame's body for its header.
+ * */
+size_t frame_header_room(frame_header *hdr) {
+    return hdr->compact ? COMPACT_HEADER_MAX : FRAME_HEADER_LEN;
+}
+
+/* Write a frame header into the room left for it at the start of iov[0].
+ * A compact header, shorter than its room, is written to end where the
+ * body starts, and iov[0] is moved up to start with it.
+ * */
+void encode_header_iov(struct iovec *iov, frame_header *hdr) {
+    if (!hdr->compact) {
+        encode_frame_header(iov->iov_base, hdr);
+        return;
+    }
+    char header[COMPACT_HEADER_MAX];
+    size_t n = encode_compact_header(header, hdr);
+    size_t skip = COMPACT_HEADER_MAX - n;
+    memcpy((char *) iov->iov_base + skip, header, n);
+    iov->iov_base = (char *) iov->iov_base + skip;
+    iov->iov_len -= skip;
+}
+
+/* Write the start of the body of a CALL or DATA frame whose flags are
+ * set: a CALL's function id, then the payload header, followed on the
+ * wire by wire_len bytes of data2. A compact body holds varints of the
+ * function id and the zigzagged data1, and of data2_len only if data2 is
+ * compressed, since otherwise the rest of the frame is data2. Sets the
+ * body length in hdr.
+ * Returns the number of bytes written, at most COMPACT_BODY_MAX.
+ * */
+size_t encode_body(frame_header *hdr, char *buf, uint32_t func_id, int data1, size_t data2_len, size_t wire_len) {
+    size_t n = 0;
+    if (hdr->compact) {
+        if (hdr->op == OP_CALL) {
+            n += put_varint(buf, func_id);
+        }
+        n += put_varint(buf + n, zigzag(data1));
+        if (hdr->flags & FLAG_COMPRESSED) {
+            n += put_varint(buf + n, data2_len);
+        }
     } else {
-        result->data2 = NULL;
+        if (hdr->op == OP_CALL) {
+            uint32_t func_id_nwb = htonl(func_id);
+            memcpy(buf, &func_id_nwb, sizeof(uint32_t));
+            n += sizeof(uint32_t);
+        }
+        uint64_t data1_nwb = htobe64((uint64_t) data1);
+        uint32_t data2_len_nwb = htonl((uint32_t) data2_len);
+        memcpy(buf + n, &data1_nwb, sizeof(uint64_t));
+        memcpy(buf + n + sizeof(uint64_t), &data2_len_nwb, sizeof(uint32_t));
+        n += PAYLOAD_HEADER_LEN;
+    }
+    hdr->len = n + wire_len;
+    return n;
+}
+
+/* Read the function id at the start of a CALL body.
+ * Returns the number of bytes it takes, or -1 if it is invalid.
+ * */
+int decode_func_id(frame_header *hdr, const char *body, size_t body_len, uint32_t *func_id) {
+    if (hdr->compact) {
+        uint64_t v;
+        size_t used = get_varint(body, body_len, &v);
+        if (used == 0 || v > UINT32_MAX) {
+            return -1;
+        }
+        *func_id = (uint32_t) v;
+        return (int) used;
     }
+    uint32_t func_id_nwb;
+    if (body_len < sizeof(uint32_t)) {
+        return -1;
+    }
+    memcpy(&func_id_nwb, body, sizeof(uint32_t));
+    *func_id = ntohl(func_id_nwb);
+    return sizeof(uint32_t);
+}
 
-    result->data1 = data1_rcv;
-    result->data2_len = data2_len_rcv;
+/* Read the payload of a CALL body past its function id, or of a DATA
+ * body, in the frame's encoding. data2 is left pointing at its wire_len
+ * bytes in the body, and data2_len is its size once decompressed if the
+ * frame is flagged FLAG_COMPRESSED.
+ * Returns -1 if the payload is invalid.
+ * */
+int decode_body(frame_header *hdr, const char *body, size_t body_len, rpc_data *data, size_t *wire_len) {
+    int compressed = (hdr->flags & FLAG_COMPRESSED) != 0;
+    size_t used;
+    if (hdr->compact) {
+        uint64_t data1, data2_len;
+        used = get_varint(body, body_len, &data1);
+        if (used == 0) {
+            return -1;
+        }
+        data->data1 = (int) unzigzag(data1);
+        if (compressed) {
+            size_t n = get_varint(body + used, body_len - used, &data2_len);
+            if (n == 0) {
+                return -1;
+            }
+            used += n;
+        } else {
+            data2_len = body_len - used;
+        }
+        if (data2_len > MAX_DATA) {
+            return -1;
+        }
+        data->data2_len = data2_len;
+    } else {
+        if (body_len < PAYLOAD_HEADER_LEN || decode_data(body, data) == 1) {
+            return -1;
+        }
+        used = PAYLOAD_HEADER_LEN;
+        if (!compressed && data->data2_len != body_len - used) {
+            return -1;
+        }
+    }
+    if (compressed && data->data2_len == 0) {
+        return -1;
+    }
+    *wire_len = body_len - used;
+    data->data2 = *wire_len == 0 ? NULL : (char *) body + used;
     return 0;
-}
\ No newline at end of file
+}
+
+/* Send every byte of a message on a blocking socket.
+ * One sendmsg covers the whole message unless the kernel takes it in parts.
+ * Returns the number of sendmsg calls made, or -1 on error.
+ * */
+int send_all(int socket, struct iovec *iov, int iovcnt, int flags) {
+    int calls = 0;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t num_bytes = sendmsg(socket, &msg, MSG_NOSIGNAL | flags);
+        if (num_bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        calls++;
+
+        /* Skip what was sent */
+        while (msg.msg_iovlen > 0 && (size_t) num_bytes >= msg.msg_iov->iov_len) {
+            num_bytes -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + num_bytes;
+            msg.msg_iov->iov_len -= num_bytes;
+        }
+    }
+    return calls;
+}
+
+/* Send a message with a descriptor attached to its first byte.
+ * Returns the number of bytes sent, or -1 on error.
+ * */
+ssize_t send_fd(int socket, struct iovec *iov, int iovcnt, int fd, int flags) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+    ssize_t num_bytes;
+    do {
+        num_bytes = sendmsg(socket, &msg, MSG_NOSIGNAL | flags);
+    } while (num_bytes < 0 && errno == EINTR);
+    return num_bytes;
+}
+
+/* Receive bytes from a Unix socket, adding any descriptors that arrive
+ * with them to q. The kernel ends a read where descriptors were attached,
+ * so a short read does not mean the socket is drained.
+ * Returns the number of bytes received, or -1 on error.
+ * */
+ssize_t recv_fds(int socket, char *buf, size_t len, int flags, fd_queue *q) {
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t num_bytes = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC | flags);
+    if (num_bytes < 0) {
+        return -1;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t num_fds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < num_fds; i++) {
+            if (q->head + q->len == q->cap) {
+                if (q->head > 0) {
+                    memmove(q->fds, q->fds + q->head, q->len * sizeof(int));
+                    q->head = 0;
+                } else {
+                    q->cap = q->cap == 0 ? MAX_PASSED_FDS : q->cap * 2;
+                    q->fds = realloc(q->fds, q->cap * sizeof(int));
+                    if (q->fds == NULL) {
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            }
+            memcpy(&q->fds[q->head + q->len], CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            q->len++;
+        }
+    }
+
+    /* Descriptors that did not fit were closed, so frames would take the
+     * wrong ones */
+    if (msg.msg_flags & MSG_CTRUNC) {
+        errno = EPROTO;
+        return -1;
+    }
+    return num_bytes;
+}
+
+/* Take the oldest descriptor received.
+ * Returns -1 if none is held.
+ * */
+int fd_queue_pop(fd_queue *q) {
+    if (q->len == 0) {
+        return -1;
+    }
+    int fd = q->fds[q->head++];
+    if (--q->len == 0) {
+        q->head = 0;
+    }
+    return fd;
+}
+
+/* Close every descriptor held and free the queue.
+ * */
+void fd_queue_clear(fd_queue *q) {
+    for (size_t i = 0; i < q->len; i++) {
+        close(q->fds[q->head + i]);
+    }
+    free(q->fds);
+    memset(q, 0, sizeof(fd_queue));
+}
+
+/* Copy data2 into a memfd and seal it, so the receiver can map it knowing
+ * it will neither change nor shrink under the mapping.
+ * Returns the memfd, or -1 on failure.
+ * */
+int memfd_from(const void *buf, size_t len) {
+    int fd = memfd_create("rpc-data2", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t off = 0;
+    while (off < len) {
+        ssize_t num_bytes = write(fd, (const char *) buf + off, len - off);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes <= 0) {
+            close(fd);
+            return -1;
+        }
+        off += num_bytes;
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Take the len bytes of data2 at offset in a passed descriptor. A sealed
+ * memfd is mapped copy-on-write, and anything else is read into a mapped
+ * buffer, since another process could shrink it under a mapping, as is a
+ * memfd whose offset is not on a page. Either way rpc_data_free unmaps
+ * data2. The descriptor stays open.
+ * Returns NULL if len is 0 or the file does not hold the bytes.
+ * */
+void *fd_data2(int fd, uint64_t offset, size_t len) {
+    struct stat st;
+    if (len == 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        offset > (uint64_t) st.st_size || len > (uint64_t) st.st_size - offset) {
+        return NULL;
+    }
+
+    /* Mapped data2 must start on a page, so an unaligned offset is read */
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) && offset % page_size() == 0) {
+        void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t) offset);
+        if (base != MAP_FAILED) {
+            large_track(base, base, len);
+            return base;
+        }
+    }
+
+    char *data2 = large_alloc(len);
+    if (data2 == NULL) {
+        return NULL;
+    }
+    for (size_t off = 0; off < len;) {
+        ssize_t num_bytes = pread(fd, data2 + off, len - off, (off_t) (offset + off));
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes <= 0) {
+            free_data2(data2);
+            return NULL;
+        }
+        off += num_bytes;
+    }
+    return data2;
+}
+
+static uint64_t shm_spin_ns;
+
+/* Lets a spinning thread yield the core's pipeline to its sibling.
+ * */
+static inline void spin_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* Copy up to len bytes into a ring, as many as it has room for, and
+ * publish them to the consumer.
+ * Returns the number of bytes copied.
+ * */
+size_t ring_put(shm_ring *ring, const char *src, size_t len) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= SHM_RING) {
+        return 0;
+    }
+    size_t room = SHM_RING - (head - tail);
+    if (len > room) {
+        len = room;
+    }
+    size_t off = head & (SHM_RING - 1);
+    size_t first = SHM_RING - off < len ? SHM_RING - off : len;
+    memcpy(ring->data + off, src, first);
+    memcpy(ring->data, src + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/* Copy up to len bytes out of a ring, as many as it holds, and hand their
+ * room back to the producer.
+ * Returns the number of bytes copied, or -1 if the peer corrupted the ring.
+ * */
+ssize_t ring_get(shm_ring *ring, char *dst, size_t len) {
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head - tail > SHM_RING) {
+        return -1;
+    }
+    if (len > head - tail) {
+        len = head - tail;
+    }
+    size_t off = tail & (SHM_RING - 1);
+    size_t first = SHM_RING - off < len ? SHM_RING - off : len;
+    memcpy(dst, ring->data + off, first);
+    memcpy(dst + first, ring->data, len - first);
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/* Whether a ring holds bytes to read, or has room to write when space is
+ * set.
+ * */
+int ring_ready(shm_ring *ring, int space) {
+    uint64_t used = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return space ? used < SHM_RING : used != 0;
+}
+
+/* Wake every thread sleeping on a side's doorbell. Costs no system call
+ * while the side is busy.
+ * */
+void shm_wake(shm_bell *b) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&b->waiting, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    __atomic_add_fetch(&b->bell, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &b->bell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Wait until a ring holds bytes to read, or has room to write when space
+ * is set: spin for the busy-poll time, then sleep on the side's doorbell.
+ * Also returns whenever the doorbell rings, so callers check again.
+ * A sleep ends by the deadline, unless it is 0.
+ * Returns -1 once the connection is closed, and 1 after sleeping for
+ * SHM_WAIT_MS with nothing happening.
+ * */
+int shm_wait(shm_region *shm, shm_bell *b, shm_ring *ring, int space, uint64_t deadline) {
+    uint64_t spin = __atomic_load_n(&shm_spin_ns, __ATOMIC_RELAXED);
+    if (spin != 0) {
+        uint64_t until = stats_clock() + spin;
+        do {
+            for (int i = 0; i < 64; i++) {
+                if (ring_ready(ring, space)) {
+                    return 0;
+                }
+                spin_pause();
+            }
+        } while (stats_clock() < until);
+    }
+
+    /* Announce the sleep before checking once more, so a wake in between
+     * changes the bell and the futex returns at once */
+    __atomic_add_fetch(&b->waiting, 1, __ATOMIC_SEQ_CST);
+    uint32_t seen = __atomic_load_n(&b->bell, __ATOMIC_SEQ_CST);
+    int s = 0;
+    if (!ring_ready(ring, space) && !__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE)) {
+        struct timespec timeout = {.tv_sec = 0, .tv_nsec = SHM_WAIT_MS * 1000000L};
+        if (deadline != 0) {
+            uint64_t now = stats_clock();
+            uint64_t left = deadline > now ? deadline - now : 0;
+            if (left < (uint64_t) timeout.tv_nsec) {
+                timeout.tv_nsec = (long) left;
+            }
+        }
+        if (syscall(SYS_futex, &b->bell, FUTEX_WAIT, seen, &timeout, NULL, 0) < 0 && errno == ETIMEDOUT) {
+            s = 1;
+        }
+    }
+    __atomic_sub_fetch(&b->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE) && !ring_ready(ring, space)) {
+        return -1;
+    }
+    return s;
+}
+
+/* Sets how long a thread waiting on a shared-memory connection spins
+ * before it sleeps. With a single CPU the peer could not make progress
+ * meanwhile, so waits never spin.
+ * */
+void rpc_shm_busy_poll(unsigned usec) {
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        usec = 0;
+    }
+    __atomic_store_n(&shm_spin_ns, (uint64_t) usec * 1000, __ATOMIC_RELAXED);
+}
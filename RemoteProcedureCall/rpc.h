@@ -1,10 +1,10 @@
 /* Header for RPC system */
-/* Please do not modify this file */
 
 #ifndef RPC_H
 #define RPC_H
 
 #include <stddef.h>
+#include <sys/types.h>
 
 /* Server state */
 typedef struct rpc_server rpc_server;
@@ -21,50 +21,289 @@ typedef struct {
 /* Handle for remote function */
 typedef struct rpc_handle rpc_handle;
 
+/* Handle for a call in flight */
+typedef struct rpc_future rpc_future;
+
+/* Handle for the results of a streaming call */
+typedef struct rpc_stream rpc_stream;
+
+/* Flag of rpc_register_flags: payloads and results of the function are
+ * never compressed, for data that is already compressed or encrypted */
+#define RPC_NO_COMPRESS 0x01
+
+/* Flag of rpc_register_flags: the function's result depends only on data1
+ * and data2 of its payload, which it does not modify. Results are cached,
+ * and a call with a payload seen before is answered without running the
+ * handler. Large payloads and batches always run it */
+#define RPC_PURE 0x02
+
 /* Handler for remote functions, which takes rpc_data* as input and produces
  * rpc_data* as output */
 typedef rpc_data *(*rpc_handler)(rpc_data *);
 
+/* A call an asynchronous handler has started and not yet finished */
+typedef struct rpc_token rpc_token;
+
+/* Handler for remote functions registered with rpc_register_async. It
+ * starts the call and returns without a result, and the call is finished
+ * later by passing the token to rpc_complete. The payload stays valid
+ * until then */
+typedef void (*rpc_async_handler)(rpc_data *payload, rpc_token *token);
+
 /* ---------------- */
 /* Server functions */
 /* ---------------- */
 
 /* Initialises server state */
+/* With RPC_URING set to 1, the event loops wait, accept, receive and send
+ * through io_uring, and fall back to epoll where the kernel lacks it */
 /* RETURNS: rpc_server* on success, NULL on error */
 rpc_server *rpc_init_server(int port);
 
-/* Registers a function (mapping from name to handler) */
+/* Registers a function (mapping from name to handler), or replaces the
+ * handler of the function registered under name. Any thread may register
+ * while rpc_serve_all runs: calls already received finish with the
+ * handler they arrived for, later ones run the new one, and dispatch never
+ * waits for a registration. A function that streams stays one that does,
+ * and one that does not stays one that does not, once serving */
 /* RETURNS: -1 on failure */
 int rpc_register(rpc_server *srv, char *name, rpc_handler handler);
 
+/* Registers a function with flags: RPC_NO_COMPRESS, RPC_PURE or both.
+ * Results cached for a pure function's previous handler are not reused */
+/* RETURNS: -1 on failure, or on an unknown flag */
+int rpc_register_flags(rpc_server *srv, char *name, rpc_handler handler, unsigned flags);
+
+/* Registers a function whose handler finishes its calls later with
+ * rpc_complete, so a call waiting on a disk or another service holds no
+ * server thread. Flags are as for rpc_register_flags. A BATCH of calls to
+ * it is answered NULL */
+/* RETURNS: -1 on failure */
+int rpc_register_async(rpc_server *srv, char *name, rpc_async_handler handler, unsigned flags);
+
+/* Finishes a call started by an asynchronous handler, from any thread,
+ * sending result to the client, or NULL if the call failed. The result is
+ * freed as a handler's would be, and the token may not be used again */
+void rpc_complete(rpc_token *token, rpc_data *result);
+
+/* Registers a function whose handler sends its results as a stream of
+ * items with rpc_stream_send, and ends the stream with rpc_stream_end.
+ * Like an asynchronous handler, it may return before the stream ends, and
+ * the payload stays valid until then. Flags are as for rpc_register_flags,
+ * except RPC_PURE. Only rpc_call_stream calls it, and other calls to it
+ * are answered NULL */
+/* RETURNS: -1 on failure */
+int rpc_register_stream(rpc_server *srv, char *name, rpc_async_handler handler, unsigned flags);
+
+/* Sends the next item of a streaming call, from one thread at a time. The
+ * client grants credit for a window of items it has room for, and this
+ * waits for credit before sending, except on the server's own threads,
+ * as when handlers run on the event loop, which send regardless. The
+ * item, whose data2_len may be at most 100000, is freed as a handler's
+ * result would be, even on failure */
+/* RETURNS: -1 if the item is invalid, or the client closed the stream or
+ * went away, after which the handler should end the stream */
+int rpc_stream_send(rpc_token *token, rpc_data *item);
+
+/* Ends a streaming call, normally if ok is set or as failed otherwise, and
+ * the token may not be used again. rpc_complete also ends a stream,
+ * sending a result as its last item, or failing it on NULL */
+void rpc_stream_end(rpc_token *token, int ok);
+
+/* Binds a Unix socket at path, which rpc_serve_all accepts clients on as
+ * well as the TCP port. A socket left at path by an earlier server is
+ * replaced. Call before rpc_serve_all */
+/* RETURNS: -1 on failure */
+int rpc_server_listen_unix(rpc_server *srv, char *path);
+
 /* Start serving requests */
 void rpc_serve_all(rpc_server *srv);
 
+/* Sets how many worker threads run handlers, before rpc_serve_all */
+/* The pool starts with min_workers, grows up to max_workers while calls
+ * queue up, and shrinks back after workers sit idle. With max_workers of 0
+ * handlers run on the event loop thread */
+/* RETURNS: -1 on failure */
+int rpc_server_set_workers(rpc_server *srv, int min_workers, int max_workers);
+
+/* Sets how many event loops rpc_serve_all runs, 0 for one per CPU the
+ * server may run on. The default of 1 multiplexes every connection on the
+ * thread that called rpc_serve_all. With more, each loop runs on its own
+ * thread pinned to a CPU and accepts on its own SO_REUSEPORT listener, so
+ * the kernel spreads new connections across them, and serves only the
+ * connections it accepted */
+/* RETURNS: -1 on failure */
+int rpc_server_set_loops(rpc_server *srv, int num_loops);
+
+/* Sets how many bytes the cache of results of RPC_PURE functions may hold,
+ * before rpc_serve_all. The least recently used results are evicted first.
+ * Defaults to 64 MiB, and 0 turns the cache off. __stats reports its hits,
+ * misses and evictions */
+/* RETURNS: -1 on failure */
+int rpc_server_set_cache(rpc_server *srv, size_t max_bytes);
+
+/* Caps how many calls may wait for a worker at once, and how long, in
+ * milliseconds, they may keep waiting while the server is overloaded,
+ * before rpc_serve_all. Calls beyond either limit are answered BUSY at
+ * once rather than run late. Either limit is off when 0, as both are by
+ * default. Calls whose deadline passes while queued are dropped regardless */
+/* RETURNS: -1 on failure */
+int rpc_server_set_overload(rpc_server *srv, size_t max_queued, unsigned target_ms);
+
 /* ---------------- */
 /* Client functions */
 /* ---------------- */
 
 /* Initialises client state */
+/* An addr of the form unix:/path connects to a server's Unix socket, and
+ * port is ignored. Payloads with data2_len above 100000 then pass to and
+ * from the server as file descriptors instead of through the socket */
+/* With RPC_SHM set to 1, a server on the same host reached over TCP is
+ * asked to exchange calls through shared memory rather than the loopback
+ * socket */
+/* Over TCP to another host, data2 is compressed both ways where that
+ * shrinks it. RPC_COMPRESS set to 0 turns this off, and set to 1 turns it
+ * on for a server on the same host that is not using shared memory */
+/* Calls and results are framed compactly where the server supports it,
+ * unless RPC_COMPACT is set to 0 */
 /* RETURNS: rpc_client* on success, NULL on error */
 rpc_client *rpc_init_client(char *addr, int port);
 
-/* Finds a remote function by name */
+/* Sets how many connections to the server the client pools. Calls from
+ * any number of threads share the pool: each goes to the connection with
+ * the fewest calls in flight, another connection is opened while all of
+ * them are busy, up to max_conns, and connections above min_conns close
+ * after sitting idle. The pool starts at 1 connection and grows to 4 */
+/* RETURNS: -1 on invalid bounds, or if a connection could not be opened */
+int rpc_client_set_pool(rpc_client *cl, int min_conns, int max_conns);
+
+/* Sets how long each call started on the client from now on may take, in
+ * milliseconds, or 0 (the default) to wait as long as it takes. The
+ * server drops a call whose time ran out before its handler started */
+/* RETURNS: -1 on failure */
+int rpc_client_set_timeout(rpc_client *cl, unsigned timeout_ms);
+
+/* Finds a remote function by name. The first lookup on a server fetches
+ * every function it has, and later lookups by any client of the process
+ * are answered from that cache while the server's functions are unchanged */
 /* RETURNS: rpc_handle* on success, NULL on error */
 /* rpc_handle* will be freed with a single call to free(3) */
 rpc_handle *rpc_find(rpc_client *cl, char *name);
 
 /* Calls remote function using handle */
-/* RETURNS: rpc_data* on success, NULL on error */
+/* Payloads with data2_len above 100000 are streamed in chunks, and a large
+ * result's data2 is memory-mapped; rpc_data_free releases either kind */
+/* RETURNS: rpc_data* on success, NULL on error, with errno ETIMEDOUT if
+ * the call timed out or EBUSY if the server was overloaded */
 rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload);
 
+/* Calls remote function using handle, receiving the result into *result
+ * with its data2 stored in buf, which holds up to buf_len bytes */
+/* RETURNS: 0 on success, -1 on error or if data2 does not fit */
+/* Nothing is allocated, so result is not passed to rpc_data_free */
+int rpc_call_into(rpc_client *cl, rpc_handle *h, rpc_data *payload, rpc_data *result, void *buf, size_t buf_len);
+
+/* Calls remote function using handle, with data1 and len bytes of the file
+ * fd at offset as data2. The file is sent with sendfile(2) */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_call_file(rpc_client *cl, rpc_handle *h, int data1, int fd, off_t offset, size_t len);
+
+/* Starts calling remote function using handle, without waiting for the
+ * result. Many calls can be in flight on one client, from any number of
+ * threads, and the server may answer them in any order */
+/* RETURNS: rpc_future* on success, NULL on error */
+rpc_future *rpc_call_async(rpc_client *cl, rpc_handle *h, rpc_data *payload);
+
+/* Waits for the result of a call started with rpc_call_async */
+/* RETURNS: rpc_data* on success, NULL on error, with errno set as for
+ * rpc_call */
+/* The rpc_future* is freed, even on error */
+rpc_data *rpc_wait(rpc_future *f);
+
+/* Starts calling a function registered with rpc_register_stream, whose
+ * results are read one item at a time with rpc_stream_next. Neither side
+ * holds more than a window of items at once, however many the function
+ * sends. data2_len of the payload may be at most 100000 */
+/* RETURNS: rpc_stream* on success, NULL on error or if the function does
+ * not stream */
+rpc_stream *rpc_call_stream(rpc_client *cl, rpc_handle *h, rpc_data *payload);
+
+/* Waits for the next item of a stream. The client's timeout bounds the
+ * wait for each item */
+/* RETURNS: rpc_data* for each item in turn, then NULL once the stream is
+ * over, with errno 0 if it ended normally, or set as for rpc_call, or to
+ * EIO, if it failed */
+/* Each item is freed with rpc_data_free */
+rpc_data *rpc_stream_next(rpc_stream *s);
+
+/* Closes a stream, telling the server to stop it if it has not ended, and
+ * frees it along with any items not read */
+void rpc_stream_close(rpc_stream *s);
+
+/* Calls remote function using handle once for each of n payloads, in a
+ * single round trip */
+/* RETURNS: array of n rpc_data* on success, NULL on error, with errno set
+ * as for rpc_call */
+/* An entry is NULL if its call failed. Each entry is freed with
+ * rpc_data_free and the array with free(3) */
+rpc_data **rpc_call_batch(rpc_client *cl, rpc_handle *h, rpc_data *payloads, size_t n);
+
 /* Cleans up client state and closes client */
+/* Every call started with rpc_call_async must be waited for first, and
+ * every stream closed */
 void rpc_close_client(rpc_client *cl);
 
 /* ---------------- */
 /* Shared functions */
 /* ---------------- */
 
+/* Allocates a rpc_data with room for data2_len bytes of data2, from the
+ * library's buffer pools. Handlers that build their results with it let
+ * the server reuse the memory for later calls */
+/* RETURNS: rpc_data* with data2 NULL when data2_len is 0 */
+/* rpc_data* will be freed with rpc_data_free */
+rpc_data *rpc_data_alloc(size_t data2_len);
+
 /* Frees a rpc_data struct */
+/* Pooled buffers go back to the pools, anything else to free(3) */
 void rpc_data_free(rpc_data *data);
 
+/* RETURNS: number of buffers the library has taken from the heap rather
+ * than reused from its pools. It stops growing once calls reach a steady
+ * state, apart from the array rpc_call_batch returns */
+size_t rpc_alloc_count(void);
+
+/* RETURNS: number of system calls servers in this process have made to
+ * wait for events, accept connections, and receive and send frames */
+size_t rpc_syscall_count(void);
+
+/* RETURNS: number of bytes servers in this process have received and sent
+ * on client connections, frame headers included */
+size_t rpc_wire_bytes(void);
+
+/* Sets how many microseconds a thread waiting on a shared-memory
+ * connection spins before it sleeps on a futex, 0 (the default) to sleep
+ * at once. Spinning trades a core for lower round-trip latency, and is
+ * ignored on a single CPU */
+void rpc_shm_busy_poll(unsigned usec);
+
+/* Sets the smallest data2, in bytes, that is compressed on connections
+ * that use compression, 0 to send everything uncompressed. Defaults to
+ * 4096. Large payloads are compressed a chunk at a time */
+void rpc_compress_threshold(size_t bytes);
+
+/* Samples one in every `every` calls this process makes or serves for
+ * tracing, or stops sampling when every is 0. The RPC_TRACE environment
+ * variable sets the initial rate. A client flags the calls it samples, so
+ * the server traces them too. Each traced call records a span for every
+ * phase: encode, send, recv, decode and the whole call on the client, and
+ * recv, decode, lookup, queue, handler, encode and send on the server */
+void rpc_trace_sample(unsigned every);
+
+/* Writes the spans of recently traced calls to path as Chrome trace event
+ * JSON, for chrome://tracing or Perfetto. Servers also return it from the
+ * built-in function __trace */
+/* RETURNS: -1 on failure */
+int rpc_trace_dump(const char *path);
+
 #endif
@@ -51,10 +51,8 @@ rpc_data *add2_i8(rpc_data *in) {
     int res = n1 + n2;
 
     /* Prepare response */
-    rpc_data *out = malloc(sizeof(rpc_data));
+    rpc_data *out = rpc_data_alloc(0);
     assert(out != NULL);
     out->data1 = res;
-    out->data2_len = 0;
-    out->data2 = NULL;
     return out;
 }
@@ -0,0 +1,723 @@
+#include "rpc.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_PORT 6200
+#define INLINE_PORT 6201            // server running handlers on its event loop
+#define SINGLE_PORT 6202            // server with a single worker
+#define ELASTIC_PORT 6203           // server whose workers all exit while idle
+#define STEADY_PORT 6204            // server with one worker that never exits
+#define WORKER_IDLE_USEC 2500000    // longer than a surplus worker waits before it exits
+#define HUGE_RESULT (64 << 20)      // data2_len of the result of huge, more than socket buffers hold
+#define BIG_RESULT 100000           // data2_len of every result of big
+#define BIG_BATCH 170               // results of big that overflow one reply frame
+#define LARGE_CALLS 40              // large results held at once
+#define STEADY_CALLS 1000           // calls of a round that must not take buffers from the heap
+#define STEADY_WARMUP 20            // rounds before calls must reach a steady state
+#define ASYNC_CALLS 64              // calls completed by other threads at once
+#define STREAM_ITEMS 1000           // items of a stream read to its end
+#define STREAM_READ 5               // items of a stream read before closing it
+#define HOT_THREADS 4               // threads calling a function while it is replaced
+#define HOT_SWAPS 200               // times the function is replaced
+#define IDLE_CONNS 32               // connections opened and left idle
+
+rpc_data *echo(rpc_data *);
+rpc_data *big(rpc_data *);
+rpc_data *huge(rpc_data *);
+rpc_data *hot_one(rpc_data *);
+rpc_data *hot_two(rpc_data *);
+void later(rpc_data *, rpc_token *);
+void count(rpc_data *, rpc_token *);
+
+/* Streams of count that stopped early because the client closed them */
+static int streams_cancelled;
+
+/* Server on TEST_PORT, whose functions are replaced while it serves */
+static rpc_server *test_server;
+
+/* Fails the test it is called from, saying where */
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1;                                                            \
+        }                                                                        \
+    } while (0)
+
+/* Runs the in-process server until the tests exit */
+void *serve(void *arg) {
+    rpc_serve_all((rpc_server *) arg);
+    return NULL;
+}
+
+/* Starts a server in this process on port with the given workers */
+rpc_server *start_server(int port, int min_workers, int max_workers) {
+    rpc_server *server = rpc_init_server(port);
+    if (server == NULL || rpc_register(server, "echo", echo) == -1 || rpc_register(server, "big", big) == -1 ||
+        rpc_register(server, "huge", huge) == -1 || rpc_register(server, "hot", hot_one) == -1 ||
+        rpc_register_async(server, "later", later, 0) == -1 || rpc_register_stream(server, "count", count, 0) == -1 ||
+        rpc_server_set_workers(server, min_workers, max_workers) == -1) {
+        fprintf(stderr, "Failed to start server\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_t server_thread;
+    if (pthread_create(&server_thread, NULL, serve, server) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(server_thread);
+    return server;
+}
+
+/* Connects a client to the server on port over the loopback socket, or
+ * through shared memory with shm set */
+rpc_client *connect_port(int port, int shm) {
+    setenv("RPC_SHM", shm ? "1" : "0", 1);
+    return rpc_init_client("::1", port);
+}
+
+/* Connects a client to the main test server */
+rpc_client *connect_client(int shm) {
+    return connect_port(TEST_PORT, shm);
+}
+
+/* Returns the number of threads in this process, or -1 if unknown */
+int count_threads(void) {
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == NULL) {
+        return -1;
+    }
+    int n = 0;
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+        n += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+    return n;
+}
+
+/* Starts a call of huge on port and does not read its result, then checks
+ * that another client of the same server is still answered. stalled is
+ * the timeout of the call left unread, 0 for none */
+int check_stalled_reader(int port, int shm, unsigned stalled) {
+    rpc_client *slow = connect_port(port, shm);
+    rpc_client *cl = connect_port(port, shm);
+    CHECK(slow != NULL && cl != NULL);
+    CHECK(rpc_client_set_timeout(slow, stalled) == 0);
+    CHECK(rpc_client_set_timeout(cl, 5000) == 0);
+    rpc_handle *h_huge = rpc_find(slow, "huge");
+    rpc_handle *h_echo = rpc_find(cl, "echo");
+    CHECK(h_huge != NULL && h_echo != NULL);
+
+    rpc_data payload = {.data1 = 1, .data2_len = 0, .data2 = NULL};
+    rpc_future *f = rpc_call_async(slow, h_huge, &payload);
+    CHECK(f != NULL);
+    usleep(100000);
+    rpc_data *result = rpc_call(cl, h_echo, &payload);
+    CHECK(result != NULL);
+    CHECK(result->data1 == 1);
+    rpc_data_free(result);
+
+    /* Whether the reply arrived whole or was given up on */
+    result = rpc_wait(f);
+    CHECK(result == NULL || result->data2_len == HUGE_RESULT);
+    rpc_data_free(result);
+    free(h_huge);
+    free(h_echo);
+    rpc_close_client(slow);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* A large reply to a client that stops reading does not hold up the
+ * other connections of a server running handlers on its event loop */
+int test_stalled_reader_inline(int shm) {
+    return check_stalled_reader(INLINE_PORT, shm, 0);
+}
+
+/* A large reply to a client that stops reading frees the only worker once
+ * the call's deadline passes */
+int test_stalled_reader_worker(int shm) {
+    return check_stalled_reader(SINGLE_PORT, shm, 300);
+}
+
+/* Large results made on the event loop, the handler's own and a payload
+ * sent back, arrive whole behind one another, and a small call made after
+ * them is answered between their chunks */
+int test_large_inline(int shm) {
+    rpc_client *cl = connect_port(INLINE_PORT, shm);
+    CHECK(cl != NULL);
+    CHECK(rpc_client_set_timeout(cl, 10000) == 0);
+    rpc_handle *h_huge = rpc_find(cl, "huge");
+    rpc_handle *h_echo = rpc_find(cl, "echo");
+    CHECK(h_huge != NULL && h_echo != NULL);
+
+    static char bytes[3 * (1 << 20) + 5];
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = (char) (i * 7);
+    }
+    rpc_data none = {.data1 = 1, .data2_len = 0, .data2 = NULL};
+    rpc_data payload = {.data1 = 2, .data2_len = sizeof(bytes), .data2 = bytes};
+    rpc_future *f_huge = rpc_call_async(cl, h_huge, &none);
+    rpc_future *f_echo = rpc_call_async(cl, h_echo, &payload);
+    rpc_future *f_small = rpc_call_async(cl, h_echo, &none);
+    CHECK(f_huge != NULL && f_echo != NULL && f_small != NULL);
+
+    rpc_data *result = rpc_wait(f_small);
+    CHECK(result != NULL && result->data1 == 1);
+    rpc_data_free(result);
+    result = rpc_wait(f_echo);
+    CHECK(result != NULL && result->data1 == 2);
+    CHECK(result->data2_len == sizeof(bytes) && memcmp(result->data2, bytes, sizeof(bytes)) == 0);
+    rpc_data_free(result);
+    result = rpc_wait(f_huge);
+    CHECK(result != NULL && result->data2_len == HUGE_RESULT);
+    CHECK(((char *) result->data2)[0] == 'h' && ((char *) result->data2)[HUGE_RESULT - 1] == 'h');
+    rpc_data_free(result);
+    free(h_huge);
+    free(h_echo);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* __stats lists the handlers with the calls they ran, and the open
+ * connections, on servers running handlers on workers and on the loop */
+int test_stats(int shm) {
+    int ports[] = {TEST_PORT, INLINE_PORT};
+    for (int p = 0; p < 2; p++) {
+        rpc_client *cl = connect_port(ports[p], shm);
+        CHECK(cl != NULL);
+        rpc_handle *h_echo = rpc_find(cl, "echo");
+        rpc_handle *h_stats = rpc_find(cl, "__stats");
+        CHECK(h_echo != NULL && h_stats != NULL);
+        rpc_data payload = {.data1 = 1, .data2_len = 0, .data2 = NULL};
+        rpc_data *result = rpc_call(cl, h_echo, &payload);
+        CHECK(result != NULL);
+        rpc_data_free(result);
+
+        result = rpc_call(cl, h_stats, &payload);
+        CHECK(result != NULL && result->data2_len != 0);
+        char *json = strndup(result->data2, result->data2_len);
+        CHECK(json != NULL);
+        char *echo = strstr(json, "{\"name\":\"echo\"");
+        CHECK(echo != NULL && strncmp(strstr(echo, "\"calls\":"), "\"calls\":0,", 10) != 0);
+        CHECK(strstr(json, "\"connections\":[\n{\"id\":") != NULL);
+        free(json);
+        rpc_data_free(result);
+        free(h_echo);
+        free(h_stats);
+        rpc_close_client(cl);
+    }
+    return 0;
+}
+
+/* A single call comes back with its payload */
+int test_call(int shm) {
+    rpc_client *cl = connect_client(shm);
+    CHECK(cl != NULL);
+    rpc_handle *h = rpc_find(cl, "echo");
+    CHECK(h != NULL);
+
+    char byte = 5;
+    rpc_data payload = {.data1 = 3, .data2_len = 1, .data2 = &byte};
+    rpc_data *result = rpc_call(cl, h, &payload);
+    CHECK(result != NULL);
+    CHECK(result->data1 == 3);
+    CHECK(result->data2_len == 1 && ((char *) result->data2)[0] == 5);
+    rpc_data_free(result);
+    free(h);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* A server whose workers have all exited while idle starts one for the
+ * next call */
+int test_idle_workers(int shm) {
+    rpc_client *cl = connect_port(ELASTIC_PORT, shm);
+    CHECK(cl != NULL);
+    CHECK(rpc_client_set_timeout(cl, 5000) == 0);
+    rpc_handle *h = rpc_find(cl, "echo");
+    CHECK(h != NULL);
+
+    rpc_data payload = {.data1 = 4, .data2_len = 0, .data2 = NULL};
+    for (int i = 0; i < 2; i++) {
+        rpc_data *result = rpc_call(cl, h, &payload);
+        CHECK(result != NULL);
+        CHECK(result->data1 == 4);
+        rpc_data_free(result);
+        if (i == 0) {
+            usleep(WORKER_IDLE_USEC);
+        }
+    }
+    free(h);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* Batches of echo calls come back in order, with NULL for payloads the
+ * handler refuses */
+int test_batch(int shm) {
+    rpc_client *cl = connect_client(shm);
+    CHECK(cl != NULL);
+    rpc_handle *h = rpc_find(cl, "echo");
+    CHECK(h != NULL);
+
+    char bytes[64];
+    memset(bytes, 'b', sizeof(bytes));
+    rpc_data payloads[64];
+    for (int i = 0; i < 64; i++) {
+        payloads[i].data1 = i;
+        payloads[i].data2_len = i;
+        payloads[i].data2 = i == 0 ? NULL : bytes;
+    }
+    payloads[7].data1 = -1;
+    rpc_data **results = rpc_call_batch(cl, h, payloads, 64);
+    CHECK(results != NULL);
+    for (int i = 0; i < 64; i++) {
+        if (i == 7) {
+            CHECK(results[i] == NULL);
+            continue;
+        }
+        CHECK(results[i] != NULL);
+        CHECK(results[i]->data1 == i);
+        CHECK(results[i]->data2_len == (size_t) i);
+        CHECK(i == 0 || memcmp(results[i]->data2, bytes, i) == 0);
+        rpc_data_free(results[i]);
+    }
+    free(results);
+    free(h);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* A batch of small payloads whose results add up to more than one frame
+ * holds gets every result back */
+int test_batch_oversized(int shm) {
+    rpc_client *cl = connect_client(shm);
+    CHECK(cl != NULL);
+    rpc_handle *h = rpc_find(cl, "big");
+    CHECK(h != NULL);
+
+    rpc_data payloads[BIG_BATCH];
+    for (int i = 0; i < BIG_BATCH; i++) {
+        payloads[i].data1 = i;
+        payloads[i].data2_len = 0;
+        payloads[i].data2 = NULL;
+    }
+    rpc_data **results = rpc_call_batch(cl, h, payloads, BIG_BATCH);
+    CHECK(results != NULL);
+    for (int i = 0; i < BIG_BATCH; i++) {
+        CHECK(results[i] != NULL);
+        CHECK(results[i]->data1 == i);
+        CHECK(results[i]->data2_len == BIG_RESULT);
+        CHECK(((char *) results[i]->data2)[BIG_RESULT - 1] == (char) i);
+        rpc_data_free(results[i]);
+    }
+    free(results);
+    free(h);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* Many large results, each in its own mapping, are held at once and
+ * freed out of order */
+int test_large_results(int shm) {
+    rpc_client *cl = connect_client(shm);
+    CHECK(cl != NULL);
+    rpc_handle *h = rpc_find(cl, "big");
+    CHECK(h != NULL);
+
+    static char bytes[3 * BIG_RESULT];
+    rpc_data *results[LARGE_CALLS];
+    rpc_future *futures[LARGE_CALLS];
+    for (int i = 0; i < LARGE_CALLS; i++) {
+        rpc_data payload = {.data1 = i, .data2_len = sizeof(bytes), .data2 = bytes};
+        futures[i] = rpc_call_async(cl, h, &payload);
+        CHECK(futures[i] != NULL);
+    }
+    for (int i = 0; i < LARGE_CALLS; i++) {
+        results[i] = rpc_wait(futures[i]);
+        CHECK(results[i] != NULL);
+        CHECK(results[i]->data2_len == sizeof(bytes));
+        CHECK(((char *) results[i]->data2)[sizeof(bytes) - 1] == (char) i);
+    }
+    for (int step = 7; step > 0; step--) {
+        for (int i = step - 1; i < LARGE_CALLS; i += 7) {
+            rpc_data_free(results[i]);
+        }
+    }
+    free(h);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* Makes rounds of STEADY_CALLS echo calls of a few sizes.
+ * Returns the buffers taken from the heap meanwhile, or -1 if a call failed */
+long alloc_round(rpc_client *cl, rpc_handle *h) {
+    static const size_t sizes[] = {0, 16, 256, 4096};
+    static char bytes[4096];
+    size_t allocs = rpc_alloc_count();
+    for (int i = 0; i < STEADY_CALLS; i++) {
+        size_t len = sizes[i % 4];
+        rpc_data payload = {.data1 = i, .data2_len = len, .data2 = len == 0 ? NULL : bytes};
+        rpc_data *result = rpc_call(cl, h, &payload);
+        if (result == NULL || result->data1 != i || result->data2_len != len) {
+            return -1;
+        }
+        rpc_data_free(result);
+    }
+    return (long) (rpc_alloc_count() - allocs);
+}
+
+/* Calls in a steady state reuse pooled buffers and take none from the
+ * heap. Buffers freed on other threads than took them need a few rounds
+ * to settle in the pools first. The server has a single worker that
+ * never exits, since a new worker starts with no buffers of its own and
+ * the caches of several fill in no fixed order */
+int test_alloc_steady(int shm) {
+    rpc_client *cl = connect_port(STEADY_PORT, shm);
+    CHECK(cl != NULL);
+    rpc_handle *h = rpc_find(cl, "echo");
+    CHECK(h != NULL);
+
+    long allocs = -1;
+    for (int i = 0; i < STEADY_WARMUP && allocs != 0; i++) {
+        allocs = alloc_round(cl, h);
+        CHECK(allocs >= 0);
+    }
+    CHECK(allocs == 0);
+    for (int i = 0; i < 3; i++) {
+        CHECK(alloc_round(cl, h) == 0);
+    }
+    free(h);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* Calls whose handler hands them to other threads, which finish them with
+ * rpc_complete, all come back with their own result */
+int test_complete_elsewhere(int shm) {
+    rpc_client *cl = connect_client(shm);
+    CHECK(cl != NULL);
+    rpc_handle *h = rpc_find(cl, "later");
+    CHECK(h != NULL);
+
+    rpc_future *futures[ASYNC_CALLS];
+    for (int i = 0; i < ASYNC_CALLS; i++) {
+        rpc_data payload = {.data1 = i, .data2_len = 0, .data2 = NULL};
+        futures[i] = rpc_call_async(cl, h, &payload);
+        CHECK(futures[i] != NULL);
+    }
+    for (int i = 0; i < ASYNC_CALLS; i++) {
+        rpc_data *result = rpc_wait(futures[i]);
+        CHECK(result != NULL);
+        CHECK(result->data1 == 2 * i);
+        rpc_data_free(result);
+    }
+    free(h);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* A stream read to its end delivers every item in order, then NULL with
+ * errno 0 */
+int test_stream(int shm) {
+    rpc_client *cl = connect_client(shm);
+    CHECK(cl != NULL);
+    rpc_handle *h = rpc_find(cl, "count");
+    CHECK(h != NULL);
+
+    rpc_data payload = {.data1 = STREAM_ITEMS, .data2_len = 0, .data2 = NULL};
+    rpc_stream *st = rpc_call_stream(cl, h, &payload);
+    CHECK(st != NULL);
+    for (int i = 0; i < STREAM_ITEMS; i++) {
+        rpc_data *item = rpc_stream_next(st);
+        CHECK(item != NULL);
+        CHECK(item->data1 == i);
+        rpc_data_free(item);
+    }
+    errno = EINVAL;
+    CHECK(rpc_stream_next(st) == NULL);
+    CHECK(errno == 0);
+    rpc_stream_close(st);
+    free(h);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* Closing a stream after a few items stops its handler, which would
+ * otherwise run forever, and leaves the client usable */
+int test_stream_close(int shm) {
+    rpc_client *cl = connect_client(shm);
+    CHECK(cl != NULL);
+    rpc_handle *h_count = rpc_find(cl, "count");
+    rpc_handle *h_echo = rpc_find(cl, "echo");
+    CHECK(h_count != NULL && h_echo != NULL);
+
+    int cancelled = __atomic_load_n(&streams_cancelled, __ATOMIC_ACQUIRE);
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    rpc_stream *st = rpc_call_stream(cl, h_count, &payload);
+    CHECK(st != NULL);
+    for (int i = 0; i < STREAM_READ; i++) {
+        rpc_data *item = rpc_stream_next(st);
+        CHECK(item != NULL);
+        CHECK(item->data1 == i);
+        rpc_data_free(item);
+    }
+    rpc_stream_close(st);
+    for (int i = 0; i < 500 && __atomic_load_n(&streams_cancelled, __ATOMIC_ACQUIRE) == cancelled; i++) {
+        usleep(10000);
+    }
+    CHECK(__atomic_load_n(&streams_cancelled, __ATOMIC_ACQUIRE) == cancelled + 1);
+
+    payload.data1 = 9;
+    rpc_data *result = rpc_call(cl, h_echo, &payload);
+    CHECK(result != NULL);
+    CHECK(result->data1 == 9);
+    rpc_data_free(result);
+    free(h_count);
+    free(h_echo);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* Settings and outcome of a thread calling hot */
+typedef struct {
+    pthread_t thread;
+    int shm;                        // connect through shared memory
+    volatile int *stop;             // set once the function stops being replaced
+    int failed;                     // a call failed or returned neither handler's result
+    long calls;                     // calls made
+} hot_caller;
+
+/* Calls hot until told to stop */
+void *call_hot(void *arg) {
+    hot_caller *hc = (hot_caller *) arg;
+    rpc_client *cl = connect_client(hc->shm);
+    rpc_handle *h = cl == NULL ? NULL : rpc_find(cl, "hot");
+    if (h == NULL) {
+        hc->failed = 1;
+        rpc_close_client(cl);
+        return NULL;
+    }
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    while (!*hc->stop) {
+        rpc_data *result = rpc_call(cl, h, &payload);
+        if (result == NULL || (result->data1 != 1 && result->data1 != 2)) {
+            hc->failed = 1;
+        }
+        rpc_data_free(result);
+        hc->calls++;
+    }
+    free(h);
+    rpc_close_client(cl);
+    return NULL;
+}
+
+/* Replacing a function's handler while clients call it never fails a
+ * call, and calls made afterwards run the last handler */
+int test_hot_register(int shm) {
+    volatile int stop = 0;
+    hot_caller callers[HOT_THREADS];
+    for (int i = 0; i < HOT_THREADS; i++) {
+        callers[i] = (hot_caller) {.shm = shm, .stop = &stop, .failed = 0, .calls = 0};
+        CHECK(pthread_create(&callers[i].thread, NULL, call_hot, &callers[i]) == 0);
+    }
+    int registered = 1;
+    for (int i = 0; i < HOT_SWAPS; i++) {
+        registered &= rpc_register(test_server, "hot", i % 2 == 0 ? hot_two : hot_one) != -1;
+        usleep(1000);
+    }
+    stop = 1;
+    long calls = 0;
+    int failed = 0;
+    for (int i = 0; i < HOT_THREADS; i++) {
+        pthread_join(callers[i].thread, NULL);
+        failed |= callers[i].failed;
+        calls += callers[i].calls;
+    }
+    CHECK(registered);
+    CHECK(!failed);
+    CHECK(calls > 0);
+
+    rpc_client *cl = connect_client(shm);
+    CHECK(cl != NULL);
+    rpc_handle *h = rpc_find(cl, "hot");
+    CHECK(h != NULL);
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    rpc_data *result = rpc_call(cl, h, &payload);
+    CHECK(result != NULL);
+    CHECK(result->data1 == 1);
+    rpc_data_free(result);
+    free(h);
+    rpc_close_client(cl);
+    return 0;
+}
+
+/* Idle connections, shared-memory ones included, cost the server no
+ * threads, and the last one opened is still answered */
+int test_idle_connections(int shm) {
+    int before = count_threads();
+    CHECK(before > 0);
+    rpc_client *clients[IDLE_CONNS];
+    for (int i = 0; i < IDLE_CONNS; i++) {
+        clients[i] = connect_client(shm);
+        CHECK(clients[i] != NULL);
+    }
+    usleep(100000);
+    CHECK(count_threads() <= before);
+
+    rpc_handle *h = rpc_find(clients[IDLE_CONNS - 1], "echo");
+    CHECK(h != NULL);
+    rpc_data payload = {.data1 = 6, .data2_len = 0, .data2 = NULL};
+    rpc_data *result = rpc_call(clients[IDLE_CONNS - 1], h, &payload);
+    CHECK(result != NULL);
+    CHECK(result->data1 == 6);
+    rpc_data_free(result);
+    free(h);
+    for (int i = 0; i < IDLE_CONNS; i++) {
+        rpc_close_client(clients[i]);
+    }
+    return 0;
+}
+
+/* Runs one test and reports it */
+int run(const char *name, int (*test)(int), int shm) {
+    int failed = test(shm);
+    printf("%s %s%s\n", failed ? "FAIL" : "ok  ", name, shm ? " (shm)" : "");
+    fflush(stdout);
+    return failed;
+}
+
+/* Regression tests: each runs against a server in this process, over the
+ * loopback socket and again through shared memory where that matters.
+ * Exits non-zero if any test failed */
+int main(void) {
+    test_server = start_server(TEST_PORT, 2, 64);
+    start_server(INLINE_PORT, 0, 0);
+    start_server(SINGLE_PORT, 1, 1);
+    start_server(ELASTIC_PORT, 0, 4);
+    start_server(STEADY_PORT, 1, 1);
+    usleep(100000);
+
+    int failed = 0;
+    for (int shm = 0; shm <= 1; shm++) {
+        failed += run("call", test_call, shm);
+        failed += run("idle_workers", test_idle_workers, shm);
+        failed += run("idle_connections", test_idle_connections, shm);
+        failed += run("batch", test_batch, shm);
+        failed += run("batch_oversized", test_batch_oversized, shm);
+        failed += run("large_results", test_large_results, shm);
+        failed += run("large_inline", test_large_inline, shm);
+        failed += run("alloc_steady", test_alloc_steady, shm);
+        failed += run("complete_elsewhere", test_complete_elsewhere, shm);
+        failed += run("stream", test_stream, shm);
+        failed += run("stream_close", test_stream_close, shm);
+        failed += run("stalled_reader_inline", test_stalled_reader_inline, shm);
+        failed += run("stalled_reader_worker", test_stalled_reader_worker, shm);
+        failed += run("hot_register", test_hot_register, shm);
+        failed += run("stats", test_stats, shm);
+    }
+    printf("%d failed\n", failed);
+    return failed != 0;
+}
+
+/* Sends the payload straight back, or fails on data1 of -1 */
+rpc_data *echo(rpc_data *in) {
+    if (in->data1 == -1) {
+        return NULL;
+    }
+    return in;
+}
+
+/* Returns BIG_RESULT bytes of data1, or as many as data2 holds if that
+ * is more */
+rpc_data *big(rpc_data *in) {
+    size_t len = in->data2_len > BIG_RESULT ? in->data2_len : BIG_RESULT;
+    rpc_data *out = rpc_data_alloc(len);
+    if (out == NULL) {
+        return NULL;
+    }
+    out->data1 = in->data1;
+    memset(out->data2, in->data1, len);
+    return out;
+}
+
+/* Returns HUGE_RESULT bytes, sent in chunks */
+rpc_data *huge(rpc_data *in) {
+    rpc_data *out = rpc_data_alloc(HUGE_RESULT);
+    if (out == NULL) {
+        return NULL;
+    }
+    out->data1 = in->data1;
+    memset(out->data2, 'h', HUGE_RESULT);
+    return out;
+}
+
+/* Returns 1, until replaced by hot_two */
+rpc_data *hot_one(rpc_data *in) {
+    rpc_data *out = rpc_data_alloc(0);
+    out->data1 = 1;
+    return out;
+}
+
+/* Returns 2, until replaced by hot_one */
+rpc_data *hot_two(rpc_data *in) {
+    rpc_data *out = rpc_data_alloc(0);
+    out->data1 = 2;
+    return out;
+}
+
+/* Call of later handed to another thread */
+typedef struct {
+    rpc_token *token;
+    int data1;
+} later_call;
+
+/* Finishes a call of later after a short wait, from a thread of its own */
+void *finish_later(void *arg) {
+    later_call *call = (later_call *) arg;
+    usleep(1000 + call->data1 % 7 * 1000);
+    rpc_data *out = rpc_data_alloc(0);
+    out->data1 = 2 * call->data1;
+    rpc_complete(call->token, out);
+    free(call);
+    return NULL;
+}
+
+/* Doubles data1 on another thread, holding no server thread meanwhile */
+void later(rpc_data *in, rpc_token *token) {
+    later_call *call = malloc(sizeof(later_call));
+    pthread_t thread;
+    if (call == NULL) {
+        rpc_complete(token, NULL);
+        return;
+    }
+    call->token = token;
+    call->data1 = in->data1;
+    if (pthread_create(&thread, NULL, finish_later, call) != 0) {
+        free(call);
+        rpc_complete(token, NULL);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* Streams items numbered from 0, data1 of them, or without end when data1
+ * is 0 until the client closes the stream */
+void count(rpc_data *in, rpc_token *token) {
+    int n = in->data1;
+    for (int i = 0; n == 0 || i < n; i++) {
+        rpc_data *item = rpc_data_alloc(0);
+        item->data1 = i;
+        if (rpc_stream_send(token, item) < 0) {
+            __atomic_add_fetch(&streams_cancelled, 1, __ATOMIC_RELEASE);
+            rpc_stream_end(token, 0);
+            return;
+        }
+    }
+    rpc_stream_end(token, 1);
+}
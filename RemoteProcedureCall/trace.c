@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* One phase of a traced request. Every field is read and written with
+ * relaxed atomics; seq tells a reader whether it copied a whole span */
+typedef struct {
+    uint64_t seq;                   // 2 * position + 2 once written, odd while being written
+    const char *name;               // phase
+    uint64_t start;                 // monotonic nanoseconds
+    uint64_t end;                   // monotonic nanoseconds
+    uint64_t conn;                  // server connection number, 0 on a client
+    uint32_t id;                    // request id
+    uint32_t side;                  // TRACE_CLIENT or TRACE_SERVER
+    uint32_t tid;                   // thread that recorded it
+} trace_rec;
+
+/* Spans of one thread, overwritten oldest first. A ring is handed to a new
+ * thread once its previous thread exits, and is never freed */
+typedef struct trace_ring {
+    trace_rec spans[TRACE_RING];
+    uint64_t head;                  // spans written so far, by the owner only
+    uint32_t tid;                   // kernel id of the owning thread
+    int in_use;                     // owned by a live thread
+    struct trace_ring *next;        // next ring of the process
+} trace_ring;
+
+static unsigned trace_rate;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static trace_ring *trace_rings;
+static __thread trace_ring *trace_local;
+static __thread unsigned trace_countdown;
+
+/* Sets the sampling rate.
+ * */
+void trace_set_rate(unsigned every) {
+    __atomic_store_n(&trace_rate, every, __ATOMIC_RELAXED);
+}
+
+/* Hands a thread's ring to the next thread that records spans.
+ * */
+static void trace_release(void *arg) {
+    trace_ring *ring = (trace_ring *) arg;
+    pthread_mutex_lock(&trace_lock);
+    ring->in_use = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Reads RPC_TRACE and prepares the thread rings.
+ * */
+static void trace_init(void) {
+    pthread_key_create(&trace_key, trace_release);
+    const char *env = getenv("RPC_TRACE");
+    if (env != NULL) {
+        trace_set_rate((unsigned) strtoul(env, NULL, 10));
+    }
+}
+
+/* Sets the sampling rate from the environment, once.
+ * */
+void trace_configure(void) {
+    pthread_once(&trace_once, trace_init);
+}
+
+/* Whether tracing is on.
+ * */
+int trace_enabled(void) {
+    return __atomic_load_n(&trace_rate, __ATOMIC_RELAXED) != 0;
+}
+
+/* Count a request against the calling thread's sampling countdown, so
+ * sampling takes no shared counter.
+ * */
+int trace_sample(void) {
+    unsigned rate = __atomic_load_n(&trace_rate, __ATOMIC_RELAXED);
+    if (rate == 0) {
+        return 0;
+    }
+    if (trace_countdown == 0 || trace_countdown > rate) {
+        trace_countdown = rate;
+    }
+    return --trace_countdown == 0;
+}
+
+/* Ring of the calling thread, claiming one left by an exited thread or
+ * adding one on the thread's first span.
+ * */
+static trace_ring *trace_ring_local(void) {
+    if (trace_local != NULL) {
+        return trace_local;
+    }
+    trace_configure();
+    pthread_mutex_lock(&trace_lock);
+    trace_ring *ring;
+    for (ring = trace_rings; ring != NULL && ring->in_use; ring = ring->next) {
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(trace_ring));
+        if (ring == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    ring->in_use = 1;
+    ring->tid = gettid();
+    pthread_mutex_unlock(&trace_lock);
+    pthread_setspecific(trace_key, ring);
+    trace_local = ring;
+    return ring;
+}
+
+/* Records a span in the calling thread's ring.
+ * */
+void trace_span(const char *name, char side, uint32_t id, uint64_t conn, uint64_t start, uint64_t end) {
+    /* A phase that began before tracing was turned on is left out */
+    if (start == 0 || end < start) {
+        return;
+    }
+    trace_ring *ring = trace_ring_local();
+    uint64_t pos = ring->head;
+    trace_rec *rec = &ring->spans[pos & (TRACE_RING - 1)];
+
+    __atomic_store_n(&rec->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&rec->name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->end, end, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->conn, conn, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->id, id, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->side, (uint32_t) side, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->tid, ring->tid, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->seq, 2 * pos + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy the span at a position of a ring, unless it has been overwritten.
+ * Returns -1 if the span was not whole.
+ * */
+static int trace_copy(trace_ring *ring, uint64_t pos, trace_rec *copy) {
+    trace_rec *rec = &ring->spans[pos & (TRACE_RING - 1)];
+    uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (seq != 2 * pos + 2) {
+        return -1;
+    }
+    copy->name = __atomic_load_n(&rec->name, __ATOMIC_RELAXED);
+    copy->start = __atomic_load_n(&rec->start, __ATOMIC_RELAXED);
+    copy->end = __atomic_load_n(&rec->end, __ATOMIC_RELAXED);
+    copy->conn = __atomic_load_n(&rec->conn, __ATOMIC_RELAXED);
+    copy->id = __atomic_load_n(&rec->id, __ATOMIC_RELAXED);
+    copy->side = __atomic_load_n(&rec->side, __ATOMIC_RELAXED);
+    copy->tid = __atomic_load_n(&rec->tid, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq ? 0 : -1;
+}
+
+/* Write every span as a complete ("X") event, with timestamps in
+ * microseconds as the format requires. Spans carry the request id, and
+ * the connection number on the server, to match both sides of a request.
+ * */
+int trace_write(FILE *out) {
+    int pid = getpid();
+    int first = 1;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    pthread_mutex_lock(&trace_lock);
+    for (trace_ring *ring = trace_rings; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t pos = head > TRACE_RING ? head - TRACE_RING : 0;
+        for (; pos < head; pos++) {
+            trace_rec rec;
+            if (trace_copy(ring, pos, &rec) < 0) {
+                continue;
+            }
+            fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%u,\"args\":{\"id\":%u",
+                    first ? "" : ",", rec.name, rec.side == TRACE_CLIENT ? "client" : "server",
+                    rec.start / 1e3, (rec.end - rec.start) / 1e3, pid, rec.tid, rec.id);
+            if (rec.side == TRACE_SERVER) {
+                fprintf(out, ",\"conn\":%llu", (unsigned long long) rec.conn);
+            }
+            fprintf(out, "}}");
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    fprintf(out, "\n]}\n");
+    return ferror(out) ? -1 : 0;
+}
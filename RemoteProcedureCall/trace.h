@@ -0,0 +1,39 @@
+/* Header for request tracing */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Spans kept per thread before the oldest are overwritten, a power of two */
+#define TRACE_RING 8192
+
+/* Side of the connection a span was recorded on */
+#define TRACE_CLIENT 'c'
+#define TRACE_SERVER 's'
+
+/* Sets the sampling rate: one in every `every` requests is traced, none
+ * when every is 0 */
+void trace_set_rate(unsigned every);
+
+/* Sets the sampling rate from the RPC_TRACE environment variable, once */
+void trace_configure(void);
+
+/* RETURNS: whether any request may be traced */
+int trace_enabled(void);
+
+/* RETURNS: whether the calling thread's next request is traced */
+int trace_sample(void);
+
+/* Records one phase of a traced request, from start to end in monotonic
+ * nanoseconds, in the calling thread's ring. name must be a literal.
+ * Never blocks: each thread writes its own ring, and readers discard spans
+ * overwritten while they copy them */
+void trace_span(const char *name, char side, uint32_t id, uint64_t conn, uint64_t start, uint64_t end);
+
+/* Writes every span still held by any thread as Chrome trace event JSON */
+/* RETURNS: -1 on write failure */
+int trace_write(FILE *out);
+
+#endif
@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Sets up a ring whose SQ and CQ share one mapping. SINGLE_ISSUER, which
+ * arrived in the same release as multishot receives, doubles as the check
+ * that they are available.
+ * */
+int uring_init(uring *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_map_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_map = mmap(NULL, ring->ring_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                          IORING_OFF_SQ_RING);
+    if (ring->ring_map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_map, ring->ring_map_len);
+        close(fd);
+        return -1;
+    }
+
+    char *map = (char *) ring->ring_map;
+    ring->fd = fd;
+    ring->sq_head = (unsigned *) (map + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (map + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (map + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (map + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (map + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (map + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (map + p.cq_off.cqes);
+
+    /* SQE i always sits in slot i, so the indirection array is fixed */
+    unsigned *array = (unsigned *) (map + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    return 0;
+}
+
+void uring_free(uring *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->ring_map, ring->ring_map_len);
+    close(ring->fd);
+}
+
+int uring_supported(void) {
+    uring ring;
+    if (uring_init(&ring, 2) < 0) {
+        return 0;
+    }
+    uring_free(&ring);
+    return 1;
+}
+
+struct io_uring_sqe *uring_sqe(uring *ring) {
+    if (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        uring_enter(ring, 0);
+        if (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local++;
+    return sqe;
+}
+
+/* Publishes the filled SQEs, then submits and waits in one system call.
+ * EINTR and EBUSY, when completions must be read first, are not failures.
+ * */
+int uring_enter(uring *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    unsigned submit = ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    unsigned flags = wait_nr != 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr, flags, NULL, 0) < 0 &&
+        errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        return -1;
+    }
+    return 0;
+}
+
+struct io_uring_cqe *uring_cqe(uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* The ring of free buffers and the buffers share one anonymous mapping,
+ * which keeps the ring page-aligned as the kernel requires.
+ * */
+int uring_bufs_init(uring *ring, uring_bufs *bufs, unsigned short bgid, unsigned entries, size_t buf_len) {
+    size_t ring_len = entries * sizeof(struct io_uring_buf);
+    bufs->map_len = ring_len + entries * buf_len;
+    void *map = mmap(NULL, bufs->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    bufs->br = (struct io_uring_buf_ring *) map;
+    bufs->bufs = (char *) map + ring_len;
+    bufs->entries = entries;
+    bufs->buf_len = buf_len;
+    bufs->bgid = bgid;
+    bufs->tail = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) map;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(map, bufs->map_len);
+        return -1;
+    }
+    for (unsigned i = 0; i < entries; i++) {
+        uring_buf_recycle(bufs, (unsigned short) i);
+    }
+    return 0;
+}
+
+char *uring_buf(uring_bufs *bufs, unsigned short bid) {
+    return bufs->bufs + bid * bufs->buf_len;
+}
+
+void uring_buf_recycle(uring_bufs *bufs, unsigned short bid) {
+    struct io_uring_buf *buf = &bufs->br->bufs[bufs->tail & (bufs->entries - 1)];
+    buf->addr = (unsigned long) uring_buf(bufs, bid);
+    buf->len = (unsigned) bufs->buf_len;
+    buf->bid = bid;
+    bufs->tail++;
+    __atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
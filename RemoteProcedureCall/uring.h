@@ -0,0 +1,78 @@
+/* Header for io_uring through the raw system calls */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/* Submission and completion queues shared with the kernel. Only the thread
+ * that created the ring may use it */
+typedef struct {
+    int fd;                         // ring descriptor
+    unsigned *sq_head;              // next SQE the kernel consumes
+    unsigned *sq_tail;              // SQEs published to the kernel
+    unsigned sq_mask;               // SQ entries - 1
+    unsigned sq_entries;            // SQ entries
+    unsigned sq_local;              // SQEs filled, published on the next enter
+    struct io_uring_sqe *sqes;      // submission entries
+    unsigned *cq_head;              // next CQE to read
+    unsigned *cq_tail;              // CQEs posted by the kernel
+    unsigned cq_mask;               // CQ entries - 1
+    struct io_uring_cqe *cqes;      // completion entries
+    void *ring_map;                 // mapping of both rings
+    size_t ring_map_len;            // length of ring_map
+    size_t sqes_len;                // length of the mapping of sqes
+} uring;
+
+/* Buffers the kernel picks from for receives that select a buffer, and
+ * that are handed back once their data is copied out */
+typedef struct {
+    struct io_uring_buf_ring *br;   // ring of free buffers shared with the kernel
+    char *bufs;                     // the buffers, buf_len bytes each
+    unsigned entries;               // number of buffers, a power of two
+    size_t buf_len;                 // bytes per buffer
+    unsigned short bgid;            // buffer group id SQEs select from
+    unsigned short tail;            // buffers handed to the kernel so far
+    size_t map_len;                 // length of the mapping of br and bufs
+} uring_bufs;
+
+/* Sets up a ring with entries SQEs and four times as many CQEs. Needs a
+ * kernel of 6.0 or later, which multishot receives also need */
+/* RETURNS: -1 if io_uring is unavailable */
+int uring_init(uring *ring, unsigned entries);
+
+/* Tears down a ring */
+void uring_free(uring *ring);
+
+/* RETURNS: whether io_uring can be set up on this kernel */
+int uring_supported(void);
+
+/* Takes the next free SQE, zeroed, submitting what is queued first if the
+ * SQ is full */
+/* RETURNS: NULL if the SQ stays full */
+struct io_uring_sqe *uring_sqe(uring *ring);
+
+/* Submits every SQE filled so far and waits for wait_nr completions, with
+ * a single io_uring_enter. Returns early on a signal, or if completions
+ * must be read before more can be posted */
+/* RETURNS: -1 on failure */
+int uring_enter(uring *ring, unsigned wait_nr);
+
+/* RETURNS: the oldest unread CQE, or NULL if there is none */
+struct io_uring_cqe *uring_cqe(uring *ring);
+
+/* Marks the CQE returned by uring_cqe as read, freeing its slot */
+void uring_cqe_seen(uring *ring);
+
+/* Registers entries buffers of buf_len bytes under group bgid */
+/* RETURNS: -1 on failure */
+int uring_bufs_init(uring *ring, uring_bufs *bufs, unsigned short bgid, unsigned entries, size_t buf_len);
+
+/* RETURNS: the buffer a CQE selected */
+char *uring_buf(uring_bufs *bufs, unsigned short bid);
+
+/* Hands a buffer back to the kernel for later receives */
+void uring_buf_recycle(uring_bufs *bufs, unsigned short bid);
+
+#endif